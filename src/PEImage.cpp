@@ -17,8 +17,13 @@ extern "C" {
 #include <direct.h>
 #include <share.h>
 #include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
 
+#include "inflate.h"
+
 #ifdef UNICODE
 #define T_sopen	_wsopen
 #define T_open	_wopen
@@ -31,6 +36,7 @@ extern "C" {
 PEImage::PEImage(const TCHAR* iname)
 : dump_base(0)
 , dump_total_len(0)
+, dump_mapped(false)
 , dirHeader(0)
 , hdr32(0)
 , hdr64(0)
@@ -41,7 +47,9 @@ PEImage::PEImage(const TCHAR* iname)
 , strtable(0)
 , bigobj(false)
 , dbgfile(false)
+, sectionsOverlap(false)
 , x64(false)
+, numThreads(1)
 {
 	if(iname)
 		loadExe(iname);
@@ -51,8 +59,20 @@ PEImage::~PEImage()
 {
 	if(fd != -1)
 		close(fd);
-	if(dump_base)
+	freeDump();
+}
+
+///////////////////////////////////////////////////////////////////////
+void PEImage::freeDump()
+{
+	if(dump_mapped)
+		UnmapViewOfFile(dump_base);
+	else if(dump_base)
 		free_aligned(dump_base);
+	dump_base = 0;
+	dump_mapped = false;
+	// the keys of the symbol cache point into the released image
+	symbolCache.clear();
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -65,16 +85,39 @@ bool PEImage::readAll(const TCHAR* iname)
 	if (fd == -1)
 		return setError("Can't open file");
 
-	struct stat s;
-	if (fstat(fd, &s) < 0)
+	struct _stat64 s;
+	if (_fstat64(fd, &s) < 0)
 		return setError("Can't get size");
-	dump_total_len = s.st_size;
-
-	dump_base = alloc_aligned(dump_total_len, 0x1000);
+	if ((unsigned long long)s.st_size > SIZE_MAX)
+		return setError("file too large");
+	dump_total_len = (size_t)s.st_size;
+
+	// Map the file copy-on-write, so that pages are only read when accessed.
+	// Modified pages (e.g. by relocateDebugLineInfo) become private to this
+	// process, the file itself is never changed.
+	HANDLE hMap = CreateFileMapping((HANDLE)_get_osfhandle(fd), NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (hMap)
+	{
+		dump_base = MapViewOfFile(hMap, FILE_MAP_COPY, 0, 0, 0);
+		dump_mapped = dump_base != 0;
+		CloseHandle(hMap);
+	}
 	if (!dump_base)
-		return setError("Out of memory");
-	if (read(fd, dump_base, dump_total_len) != dump_total_len)
-		return setError("Cannot read file");
+	{
+		// Fall back to reading the file, e.g. empty files cannot be mapped.
+		dump_base = alloc_aligned(dump_total_len, 0x1000);
+		if (!dump_base)
+			return setError("Out of memory");
+		// read() is limited to 2 GB per call
+		for (size_t pos = 0; pos < dump_total_len; )
+		{
+			unsigned int cnt = (unsigned int)min(dump_total_len - pos, (size_t)0x40000000);
+			int rd = read(fd, (char*)dump_base + pos, cnt);
+			if (rd <= 0)
+				return setError("Cannot read file");
+			pos += rd;
+		}
+	}
 
 	close(fd);
 	fd = -1;
@@ -112,8 +155,15 @@ bool PEImage::save(const TCHAR* oname)
 	if (fd == -1)
 		return setError("Can't create file");
 
-	if (write(fd, dump_base, dump_total_len) != dump_total_len)
-		return setError("Cannot write file");
+	// write() is limited to 2 GB per call
+	for (size_t pos = 0; pos < dump_total_len; )
+	{
+		unsigned int cnt = (unsigned int)min(dump_total_len - pos, (size_t)0x40000000);
+		int wr = write(fd, (char*)dump_base + pos, cnt);
+		if (wr <= 0)
+			return setError("Cannot write file");
+		pos += wr;
+	}
 
 	close(fd);
 	fd = -1;
@@ -198,7 +248,7 @@ bool PEImage::replaceDebugSection (const void* data, int datalen, bool initCV)
 	sec[s].Misc.VirtualSize = align_len; // union with PhysicalAddress;
 	sec[s].VirtualAddress = lastVirtualAddress;
 	sec[s].SizeOfRawData = xdatalen;
-	sec[s].PointerToRawData = dump_total_len + fill;
+	sec[s].PointerToRawData = (DWORD)(dump_total_len + fill);
 	sec[s].PointerToRelocations = 0;
 	sec[s].PointerToLinenumbers = 0;
 	sec[s].NumberOfRelocations = 0;
@@ -242,7 +292,7 @@ bool PEImage::replaceDebugSection (const void* data, int datalen, bool initCV)
 	dbgDir->SizeOfData = sec[s].SizeOfRawData - sizeof(IMAGE_DEBUG_DIRECTORY);
 #endif
 
-	free_aligned(dump_base);
+	freeDump();
 	dump_base = newdata;
 	dump_total_len += fill + xdatalen;
 
@@ -277,6 +327,7 @@ bool PEImage::initCVPtr(bool initDbgDir)
 
 	sec = hdr32 ? IMAGE_FIRST_SECTION(hdr32) : IMAGE_FIRST_SECTION(hdr64);
 	nsec = IMGHDR(FileHeader.NumberOfSections);
+	initSectionIndex();
 
 	symtable = DPV<char>(IMGHDR(FileHeader.PointerToSymbolTable));
 	nsym = IMGHDR(FileHeader.NumberOfSymbols);
@@ -319,6 +370,7 @@ bool PEImage::initDbgPtr(bool initDbgDir)
 
 	sec = (PIMAGE_SECTION_HEADER)(dbg + 1);
 	nsec = dbg->NumberOfSections;
+	initSectionIndex();
 
 	symtable = (char*)(sec + nsec);
 	nsym = 0;
@@ -405,6 +457,8 @@ bool PEImage::initDWARFPtr(bool initDbgDir)
 
 	dbgDir = 0;
 	sec = hdr32 ? IMAGE_FIRST_SECTION(hdr32) : IMAGE_FIRST_SECTION(hdr64);
+	nsec = IMGHDR(FileHeader.NumberOfSections);
+	initSectionIndex();
 	symtable = DPV<char>(IMGHDR(FileHeader.PointerToSymbolTable));
 	nsym = IMGHDR(FileHeader.NumberOfSymbols);
 	strtable = symtable + nsym * IMAGE_SIZEOF_SYMBOL;
@@ -450,6 +504,7 @@ bool PEImage::initDWARFObject()
 	if (!symtable || !strtable)
 		return setError("Unknown object file format");
 
+	initSectionIndex();
 	initDWARFSegments();
 	setError(0);
 	return true;
@@ -471,10 +526,21 @@ void PEImage::initSec(PESection& peSec, int secNo) const
 	peSec.secNo = secNo;
 }
 
+// Sections compressed by the GNU tools start with "ZLIB", followed by the
+// size of the uncompressed data as a 64-bit big-endian value and the zlib
+// stream.
+static bool isCompressedSection(const PESection& peSec)
+{
+	return peSec.length >= 12 && memcmp(peSec.base, "ZLIB", 4) == 0;
+}
+
 // Initialize all the DWARF sections present in this PE or COFF file.
 // Common to both object and image modules.
 void PEImage::initDWARFSegments()
 {
+	std::vector<PESection*> compressed;
+	sectionBuffers.clear();
+
 	// Scan all the PE sections in this image.
 	for(int s = 0; s < nsec; s++)
 	{
@@ -485,14 +551,85 @@ void PEImage::initDWARFSegments()
 			name = strtable + off;
 		}
 
-		// Is 'name' one of the DWARF sections?
+		// Is 'name' one of the DWARF sections? Compressed sections can also
+		// be named .zdebug_* instead of .debug_*, the sections of split DWARF
+		// .dwo files have the suffix .dwo.
 		for (const SectionDescriptor *sec_desc : sec_descriptors) {
-			if (!strcmp(name, sec_desc->name)) {
+			const size_t len = strlen(sec_desc->name);
+			bool zdebug = strncmp(name, ".zdebug_", 8) == 0 && strcmp(name + 2, sec_desc->name + 1) == 0;
+			bool dwo = strncmp(name, sec_desc->name, len) == 0 && strcmp(name + len, ".dwo") == 0;
+			if (zdebug || dwo || !strcmp(name, sec_desc->name)) {
 				PESection& peSec = this->*(sec_desc->pSec);
 				initSec(peSec, s);
+				if (isCompressedSection(peSec))
+					compressed.push_back(&peSec);
 			}
 		}
 	}
+
+	if (!compressed.empty())
+		decompressSections(compressed, numThreads);
+}
+
+// Replace the compressed sections by their uncompressed contents. The
+// sections are independent, so they are decompressed on up to numThreads
+// threads.
+void PEImage::decompressSections(const std::vector<PESection*>& sections, int numThreads)
+{
+	const size_t cnt = sections.size();
+	std::vector<std::unique_ptr<byte[]>> buffers(cnt);
+	std::vector<unsigned long> sizes(cnt);
+	std::vector<char> ok(cnt, false);
+
+	auto decompress = [&](size_t i)
+	{
+		const byte* p = sections[i]->base;
+		unsigned long long size = 0;
+		for (int b = 4; b < 12; b++)
+			size = (size << 8) | p[b];
+		if (size > 0xffffffffu)
+			return; // section offsets are 32-bit
+		sizes[i] = (unsigned long)size;
+		buffers[i].reset(new (std::nothrow) byte[sizes[i] ? sizes[i] : 1]);
+		ok[i] = buffers[i] && zlibInflate(p + 12, sections[i]->length - 12, buffers[i].get(), sizes[i]);
+	};
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t i = next++; i < cnt; i = next++)
+			decompress(i);
+	};
+
+	const size_t cntThreads = (size_t)numThreads < cnt ? numThreads : cnt;
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < cntThreads; t++)
+		threads.emplace_back(worker);
+	worker();
+	for (std::thread& t : threads)
+		t.join();
+
+	for (size_t i = 0; i < cnt; i++)
+	{
+		PESection& peSec = *sections[i];
+		if (ok[i])
+		{
+			peSec.base = buffers[i].get();
+			peSec.length = sizes[i];
+			peSec.compressed = true;
+			sectionBuffers.push_back(std::move(buffers[i]));
+
+			// The COFF relocations refer to offsets in the compressed data.
+			if (&peSec == &debug_line && sec[peSec.secNo].NumberOfRelocations)
+				fprintf(stderr, "WARNING: ignoring relocations of compressed debug section %d\n", peSec.secNo + 1);
+		}
+		else
+		{
+			fprintf(stderr, "WARNING: cannot decompress debug section %d, ignoring it\n", peSec.secNo + 1);
+			peSec.base = 0;
+			peSec.length = 0;
+		}
+	}
 }
 
 bool PEImage::relocateDebugLineInfo(unsigned int img_base)
@@ -508,7 +645,17 @@ bool PEImage::relocateDebugLineInfo(unsigned int img_base)
 		unsigned int chksize = *(unsigned int *) (relocbase + 4);
 
 		char* p = RVA<char> (virtadr, 1);
-		if(debug_line.isPtrInside(p))
+		if(debug_line.compressed)
+		{
+			// The base relocations refer to the compressed contents in the
+			// image, not to the decompressed copy.
+			if(findSectionRVA(virtadr, 1) == (int)debug_line.secNo)
+			{
+				fprintf(stderr, "WARNING: ignoring base relocations of compressed debug section %d\n", debug_line.secNo + 1);
+				break;
+			}
+		}
+		else if(debug_line.isPtrInside(p))
 		{
 			for (unsigned int w = 8; w < chksize; w += 2)
 			{
@@ -531,6 +678,8 @@ bool PEImage::relocateDebugLineInfo(unsigned int img_base)
 
 int PEImage::getRelocationInLineSegment(unsigned int offset) const
 {
+	if (debug_line.compressed)
+		return -1; // relocation offsets don't match, see decompressSections
 	return getRelocationInSegment(debug_line.secNo, offset);
 }
 
@@ -730,12 +879,67 @@ int PEImage::dumpDebugLineInfoOMF() const
 }
 
 ///////////////////////////////////////////////////////////////////////
+// Sort the sections by address, so that findSection and RVA can use a binary
+// search. The sections of object files all start at address 0, they are
+// still searched linearly.
+void PEImage::initSectionIndex()
+{
+	sectionIndex.resize(nsec);
+	for(int s = 0; s < nsec; s++)
+		sectionIndex[s] = s;
+	std::stable_sort(sectionIndex.begin(), sectionIndex.end(),
+	                 [this](int s1, int s2) { return sec[s1].VirtualAddress < sec[s2].VirtualAddress; });
+
+	// Sections starting at the same address also count as overlapping, even
+	// if one of them is empty, as the binary search could pick either one.
+	sectionsOverlap = false;
+	for(size_t i = 1; i < sectionIndex.size(); i++)
+	{
+		const IMAGE_SECTION_HEADER& prev = sec[sectionIndex[i - 1]];
+		const IMAGE_SECTION_HEADER& next = sec[sectionIndex[i]];
+		DWORD size = prev.Misc.VirtualSize > prev.SizeOfRawData ? prev.Misc.VirtualSize : prev.SizeOfRawData;
+		if(prev.VirtualAddress + size > next.VirtualAddress || prev.VirtualAddress == next.VirtualAddress)
+			sectionsOverlap = true;
+	}
+}
+
+// Return the section with the highest address not above rva, -1 if none.
+int PEImage::lastSectionAt(unsigned long rva) const
+{
+	auto it = std::upper_bound(sectionIndex.begin(), sectionIndex.end(), rva,
+	                           [this](unsigned long rva, int s) { return rva < sec[s].VirtualAddress; });
+	return it == sectionIndex.begin() ? -1 : it[-1];
+}
+
 int PEImage::findSection(unsigned int off) const
 {
 	off -= IMGHDR(OptionalHeader.ImageBase);
-	for(int s = 0; s < nsec; s++)
-		if(sec[s].VirtualAddress <= off && off < sec[s].VirtualAddress + sec[s].Misc.VirtualSize)
-			return s;
+	if(sectionsOverlap)
+	{
+		for(int s = 0; s < nsec; s++)
+			if(sec[s].VirtualAddress <= off && off < sec[s].VirtualAddress + sec[s].Misc.VirtualSize)
+				return s;
+		return -1;
+	}
+	int s = lastSectionAt(off);
+	if(s >= 0 && off < sec[s].VirtualAddress + sec[s].Misc.VirtualSize)
+		return s;
+	return -1;
+}
+
+// Return the section with raw data at rva..rva+len, -1 if none.
+int PEImage::findSectionRVA(unsigned long rva, int len) const
+{
+	if(sectionsOverlap)
+	{
+		for(int s = 0; s < nsec; s++)
+			if(rva >= sec[s].VirtualAddress && rva + len <= sec[s].VirtualAddress + sec[s].SizeOfRawData)
+				return s;
+		return -1;
+	}
+	int s = lastSectionAt(rva);
+	if(s >= 0 && rva + len <= sec[s].VirtualAddress + sec[s].SizeOfRawData)
+		return s;
 	return -1;
 }
 
@@ -748,7 +952,7 @@ const char* PEImage::t_findSectionSymbolName(int s) const
 		sym = (SYM*) symtable + i;
 		if (sym->SectionNumber == s && sym->StorageClass == IMAGE_SYM_CLASS_EXTERNAL)
 		{
-			static char sname[10] = { 0 };
+			thread_local char sname[10] = { 0 };
 
 			if (sym->N.Name.Short == 0)
 				return strtable + sym->N.Name.Long;
@@ -771,20 +975,42 @@ const char* PEImage::findSectionSymbolName(int s) const
 		return t_findSectionSymbolName<IMAGE_SYMBOL> (s);
 }
 
+// Map the names of the COFF symbols to their location. A symbol is also
+// entered without its "_", "__imp_" or "__imp__" prefix, so that findSymbol
+// needs a single lookup. An entry with a shorter prefix takes precedence,
+// the same as trying the prefixes one after the other.
 void PEImage::createSymbolCache() const
 {
+	static const SymbolName prefixes[] = { { "", 0 }, { "_", 1 }, { "__imp_", 6 }, { "__imp__", 7 } };
+
+	if (!symbolCache.empty())
+		return;
+	symbolCache.reserve(nsym);
+
 	int sizeof_sym = bigobj ? sizeof(IMAGE_SYMBOL_EX) : IMAGE_SIZEOF_SYMBOL;
 	for (int i = 0; i < nsym; ++i)
 	{
 		IMAGE_SYMBOL* sym = (IMAGE_SYMBOL*)(symtable + i * sizeof_sym);
-		const char* symname = sym->N.Name.Short == 0 ? strtable + sym->N.Name.Long : (char*)sym->N.ShortName;
 		int seg = bigobj ? ((IMAGE_SYMBOL_EX*)sym)->SectionNumber : sym->SectionNumber;
 		if (seg)
 		{
-			unsigned long off = sym->Value;
-			std::string key = symname;
-			bool dllimport = !key.compare(0, 6, "__imp_"); // symname starts with "__imp_"
-			symbolCache[key] = {seg, off, dllimport};
+			// short names are not zero terminated if they have 8 characters
+			SymbolName symname;
+			symname.name = sym->N.Name.Short == 0 ? strtable + sym->N.Name.Long : (char*)sym->N.ShortName;
+			symname.len = sym->N.Name.Short == 0 ? strlen(symname.name) : strnlen(symname.name, 8);
+
+			bool dllimport = symname.len >= 6 && memcmp(symname.name, "__imp_", 6) == 0;
+			for (int p = 0; p < 4; p++)
+			{
+				const SymbolName& prefix = prefixes[p];
+				if (symname.len < prefix.len || memcmp(symname.name, prefix.name, prefix.len) != 0)
+					continue;
+				SymbolName key = { symname.name + prefix.len, symname.len - prefix.len };
+				SymbolInfo info = { seg, sym->Value, dllimport, p };
+				auto it = symbolCache.emplace(key, info);
+				if (!it.second && it.first->second.prefix >= p)
+					it.first->second = info; // later symbols replace earlier ones
+			}
 		}
 		i += sym->NumberOfAuxSymbols;
 	}
@@ -792,14 +1018,8 @@ void PEImage::createSymbolCache() const
 
 int PEImage::findSymbol(const char* name, unsigned long& off, bool& dllimport) const
 {
-	std::string key = name;
+	SymbolName key = { name, strlen(name) };
 	auto it = symbolCache.find(key);
-	if (it == symbolCache.end())
-		it = symbolCache.find("_" + key);
-	if (it == symbolCache.end())
-		it = symbolCache.find("__imp_" + key);
-	if (it == symbolCache.end())
-		it = symbolCache.find("__imp__" + key);
 	if (it != symbolCache.end())
 	{
 		off = it->second.off;
@@ -823,13 +1043,15 @@ OMFDirEntry* PEImage::getCVEntry(int i) const
 
 ///////////////////////////////////////////////////////////////////////
 // utilities
-void* PEImage::alloc_aligned(unsigned int size, unsigned int align, unsigned int alignoff)
+void* PEImage::alloc_aligned(size_t size, unsigned int align, unsigned int alignoff)
 {
 	if (align & (align - 1))
 		return 0;
 
 	unsigned int pad = align + sizeof(void*);
 	char* p = (char*) malloc(size + pad);
+	if (!p)
+		return 0;
 	unsigned int off = (align + alignoff - sizeof(void*) - (p - (char*) 0)) & (align - 1);
 	char* q = p + sizeof(void*) + off;
 	((void**) q)[-1] = p;
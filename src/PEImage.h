@@ -10,8 +10,11 @@
 #include "LastError.h"
 
 #include <windows.h>
+#include <memory>
+#include <string.h>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 struct OMFDirHeader;
 struct OMFDirEntry;
@@ -23,6 +26,30 @@ struct SymbolInfo
 	int seg;
 	unsigned long off;
 	bool dllimport;
+	int prefix; // 0: exact name, 1: "_", 2: "__imp_", 3: "__imp__" stripped
+};
+
+// Name of a COFF symbol, pointing into the symbol or string table.
+struct SymbolName
+{
+	const char* name;
+	size_t len;
+
+	bool operator==(const SymbolName& other) const
+	{
+		return len == other.len && memcmp(name, other.name, len) == 0;
+	}
+};
+
+struct SymbolNameHash
+{
+	size_t operator()(const SymbolName& sym) const
+	{
+		size_t hash = 14695981039346656037ull;
+		for (size_t i = 0; i < sym.len; i++)
+			hash = (hash ^ (unsigned char)sym.name[i]) * 1099511628211ull;
+		return hash;
+	}
 };
 
 struct PESection
@@ -30,11 +57,13 @@ struct PESection
 	byte* base;
 	unsigned long length;
 	unsigned int secNo;
+	bool compressed; // base points to the decompressed contents
 
 	PESection()
 		: base(0)
 		, length(0)
 		, secNo(0)
+		, compressed(false)
 	{
 	}
 
@@ -100,38 +129,32 @@ public:
 	PEImage(const TCHAR* iname = 0);
 	~PEImage();
 
-	template<class P> P* DP(int off) const
+	template<class P> P* DP(size_t off) const
 	{
 		return (P*) ((char*) dump_base + off);
 	}
-	template<class P> P* DPV(int off, int size) const
+	// negative offsets passed as int wrap around and are rejected
+	template<class P> P* DPV(size_t off, size_t size) const
 	{
-		if(off < 0 || off + size > dump_total_len)
+		if(off > dump_total_len || size > dump_total_len - off)
 			return 0;
 		return (P*) ((char*) dump_base + off);
 	}
-	template<class P> P* DPV(int off) const
+	template<class P> P* DPV(size_t off) const
 	{
 		return DPV<P>(off, sizeof(P));
 	}
 	template<class P> P* CVP(int off) const
 	{
-		return DPV<P>(cv_base + off, sizeof(P));
+		return DPV<P>((size_t)cv_base + off, sizeof(P));
 	}
 
-	template<class P> P* RVA(unsigned long rva, int len)
+	template<class P> P* RVA(unsigned long rva, int len) const
 	{
-		IMAGE_DOS_HEADER *dos = DPV<IMAGE_DOS_HEADER> (0);
-		IMAGE_NT_HEADERS32* hdr = DPV<IMAGE_NT_HEADERS32> (dos->e_lfanew);
-		IMAGE_SECTION_HEADER* sec = IMAGE_FIRST_SECTION(hdr);
-
-		for (int i = 0; i < hdr->FileHeader.NumberOfSections; i++)
-		{
-			if (rva       >= sec[i].VirtualAddress &&
-				rva + len <= sec[i].VirtualAddress + sec[i].SizeOfRawData)
-				return DPV<P>(sec[i].PointerToRawData + rva - sec[i].VirtualAddress, len);
-		}
-		return 0;
+		int s = findSectionRVA(rva, len);
+		if (s < 0)
+			return 0;
+		return DPV<P>(sec[s].PointerToRawData + rva - sec[s].VirtualAddress, len);
 	}
 
 	bool readAll(const TCHAR* iname);
@@ -146,6 +169,7 @@ public:
 	bool initDWARFPtr(bool initDbgDir);
 	bool initDWARFObject();
 	void initDWARFSegments();
+	void decompressSections(const std::vector<PESection*>& sections, int numThreads);
 	bool relocateDebugLineInfo(unsigned int img_base);
 
 	bool hasDWARF() const { return debug_line.isPresent(); }
@@ -160,11 +184,12 @@ public:
 	int getCVSize() const { return dbgDir->SizeOfData; }
 
 	// utilities
-	static void* alloc_aligned(unsigned int size, unsigned int align, unsigned int alignoff = 0);
+	static void* alloc_aligned(size_t size, unsigned int align, unsigned int alignoff = 0);
 	static void free_aligned(void* p);
 
 	int countSections() const { return nsec; }
 	int findSection(unsigned int off) const;
+	int findSectionRVA(unsigned long rva, int len) const;
 	int findSymbol(const char* name, unsigned long& off, bool& dllimport) const;
 	const char* findSectionSymbolName(int s) const;
 	const IMAGE_SECTION_HEADER& getSection(int s) const { return sec[s]; }
@@ -180,8 +205,11 @@ public:
 
 private:
 	bool _initFromCVDebugDir(IMAGE_DEBUG_DIRECTORY* ddir);
+	void freeDump();
 
 	template<typename SYM> const char* t_findSectionSymbolName(int s) const;
+	void initSectionIndex();
+	int lastSectionAt(unsigned long rva) const;
 
 	// File handle to PE image.
 	int fd;
@@ -190,7 +218,11 @@ private:
 	void* dump_base;
 
 	// Size of `dump_base` in bytes.
-	int dump_total_len;
+	size_t dump_total_len;
+
+	// `dump_base` is a copy-on-write view of the input file instead of
+	// a buffer allocated with alloc_aligned.
+	bool dump_mapped;
 
 	// codeview fields
 	IMAGE_DOS_HEADER *dos;
@@ -208,7 +240,12 @@ private:
 	WORD machine;
 	bool bigobj;
 	bool dbgfile; // is DBG file
-	mutable std::unordered_map<std::string, SymbolInfo> symbolCache;
+	std::vector<int> sectionIndex; // section numbers sorted by VirtualAddress
+	bool sectionsOverlap;          // sectionIndex cannot be used for lookups
+	mutable std::unordered_map<SymbolName, SymbolInfo, SymbolNameHash> symbolCache;
+
+	// Decompressed contents of compressed debug sections.
+	std::vector<std::unique_ptr<byte[]>> sectionBuffers;
 
 public:
 	// dwarf fields
@@ -217,7 +254,10 @@ public:
 	SECTION_LIST()
 #undef EXPANDSEC
 
-	int cv_base;
+	unsigned int cv_base;
+
+	// Maximum number of threads decompressing the debug sections.
+	int numThreads;
 };
 
 struct SectionDescriptor {
@@ -24,6 +24,7 @@ CV2PDB::CV2PDB(PEImage& image, PEImage* imageDWARF, DebugLevel debug_)
 , userTypes(0), cbUserTypes(0), allocUserTypes(0)
 , globalSymbols(0), cbGlobalSymbols(0), staticSymbols(0), cbStaticSymbols(0)
 , udtSymbols(0), cbUdtSymbols(0), allocUdtSymbols(0)
+, cbIndexedUdtSymbols(-1), cbIndexedUserTypes(-1), userClassTypeIndex(0)
 , dwarfTypes(0), cbDwarfTypes(0), allocDwarfTypes(0)
 , srcLineStart(0), srcLineSections(0)
 , pointerTypes(0)
@@ -50,6 +51,44 @@ CV2PDB::CV2PDB(PEImage& image, PEImage* imageDWARF, DebugLevel debug_)
 	build_cfi_index();
 }
 
+CV2PDB::CV2PDB(const CV2PDB& parent, int firstTypeID)
+: img(parent.img), imgDbg(parent.imgDbg), cfi_index(parent.cfi_index), pdb(0), dbi(0), tpi(0), ipi(0), libraries(0), rsds(0), rsdsLen(0), modules(0), globmod(0)
+, segMap(0), segMapDesc(0), segFrame2Index(0), globalTypeHeader(0)
+, globalTypes(0), cbGlobalTypes(0), allocGlobalTypes(0)
+, userTypes(0), cbUserTypes(0), allocUserTypes(0)
+, globalSymbols(0), cbGlobalSymbols(0), staticSymbols(0), cbStaticSymbols(0)
+, udtSymbols(0), cbUdtSymbols(0), allocUdtSymbols(0)
+, cbIndexedUdtSymbols(-1), cbIndexedUserTypes(-1), userClassTypeIndex(0)
+, dwarfTypes(0), cbDwarfTypes(0), allocDwarfTypes(0)
+, srcLineStart(0), srcLineSections(0)
+, pointerTypes(0)
+, Dversion(parent.Dversion)
+, debug(parent.debug)
+, classEnumType(0), ifaceEnumType(0), cppIfaceEnumType(0), structEnumType(0)
+, classBaseType(0), ifaceBaseType(0), cppIfaceBaseType(0), structBaseType(0)
+, emptyFieldListType(parent.emptyFieldListType)
+{
+	memcpy(typedefs, parent.typedefs, sizeof(typedefs));
+	memcpy(translatedTypedefs, parent.translatedTypedefs, sizeof(translatedTypedefs));
+	cntTypedefs = parent.cntTypedefs;
+
+	addClassTypeEnum = parent.addClassTypeEnum;
+	addObjectViewHelper = parent.addObjectViewHelper;
+	addStringViewHelper = parent.addStringViewHelper;
+	methodListToOneMethod = parent.methodListToOneMethod;
+	removeMethodLists = parent.removeMethodLists;
+	useGlobalMod = parent.useGlobalMod;
+	thisIsNotRef = parent.thisIsNotRef;
+	v3 = parent.v3;
+	countEntries = 0;
+
+	codeSegOff = parent.codeSegOff;
+	currentDefaultLowerBound = parent.currentDefaultLowerBound;
+	nextUserType = firstTypeID;
+	nextDwarfType = firstDwarfType = parent.nextDwarfType;
+	dwarfParent = &parent;
+}
+
 CV2PDB::~CV2PDB()
 {
 	cleanup(false);
@@ -103,9 +142,11 @@ bool CV2PDB::cleanup(bool commit)
 	globalTypes = 0;
 	cbGlobalTypes = 0;
 	allocGlobalTypes = 0;
+	globalTypeOffsets.clear();
 	userTypes = 0;
 	cbUserTypes = 0;
 	allocUserTypes = 0;
+	userTypeOffsets.clear();
 	globalSymbols = 0;
 	cbGlobalSymbols = 0;
 	staticSymbols = 0;
@@ -113,8 +154,17 @@ bool CV2PDB::cleanup(bool commit)
 	udtSymbols = 0;
 	cbUdtSymbols = 0;
 	allocUdtSymbols = 0;
+	udtSymbolsByType.clear();
+	udtSymbolsByPName.clear();
+	udtSymbolsByCName.clear();
+	cbIndexedUdtSymbols = -1;
+	completeClassTypes.clear();
+	cbIndexedUserTypes = -1;
 	cbDwarfTypes = 0;
 	allocDwarfTypes = 0;
+	dwarfTypeHashes.clear();
+	cntFoldedDwarfTypes = 0;
+	cbFoldedDwarfTypes = 0;
 	modules = 0;
 	globmod = 0;
 	countEntries = 0;
@@ -149,12 +199,17 @@ bool CV2PDB::openPDB(const TCHAR* pdbname, const TCHAR* pdbref)
 		return setError("cannot load PDB helper DLL");
 	if (debug & DbgBasic)
 	{
-		extern HMODULE modMsPdb;
-		char modpath[260];
-		GetModuleFileNameA(modMsPdb, modpath, 260);
-		printf("Loaded PDB helper DLL: %s\n", modpath);
+		if (mspdb::nativeWriter)
+			printf("Using built-in PDB writer\n");
+		else
+		{
+			extern HMODULE modMsPdb;
+			char modpath[260];
+			GetModuleFileNameA(modMsPdb, modpath, 260);
+			printf("Loaded PDB helper DLL: %s\n", modpath);
+		}
 	}
-	pdb = CreatePDB (pdbnameW);
+	pdb = CreatePDB (pdbnameW, numThreads);
 	if (!pdb)
 		return setError("cannot create PDB file");
 
@@ -921,15 +976,9 @@ const codeview_type* CV2PDB::getUserTypeData(int type)
 	if (type < 0 || type >= nextUserType - BASE_USER_TYPE)
 		return 0;
 
-	int pos = 0;
-	while(type > 0 && pos < cbUserTypes)
-	{
-		const codeview_type* ptype = (codeview_type*)(userTypes + pos);
-		int len = ptype->generic.len + 2;
-		pos += len;
-		type--;
-	}
-	return (codeview_type*)(userTypes + pos);
+	if (userTypeOffsets.empty())
+		userTypeOffsets.push_back(0);
+	return findTypeRecord(userTypeOffsets, userTypes, cbUserTypes, type);
 }
 
 const codeview_type* CV2PDB::getConvertedTypeData(int type)
@@ -938,15 +987,83 @@ const codeview_type* CV2PDB::getConvertedTypeData(int type)
 	if (type < 0 || type >= nextUserType - BASE_USER_TYPE)
 		return 0;
 
-	int pos = typePrefix;
-	while(type > 0 && pos < cbGlobalTypes)
+	if (globalTypeOffsets.empty())
+		globalTypeOffsets.push_back(typePrefix);
+	return findTypeRecord(globalTypeOffsets, globalTypes, cbGlobalTypes, type);
+}
+
+// Forget the offsets of the records following the record at 'off' in
+// globalTypes after that record has grown.
+void CV2PDB::invalidateConvertedTypeOffsets(int off)
+{
+	while (!globalTypeOffsets.empty() && globalTypeOffsets.back() > off)
+		globalTypeOffsets.pop_back();
+}
+
+// Return record 'type' of a type buffer. 'offsets' caches the offsets of the
+// records scanned so far and is extended as needed, so that appending
+// records doesn't invalidate it. If the buffer doesn't contain as many
+// records, the end of the buffer is returned.
+const codeview_type* CV2PDB::findTypeRecord(std::vector<int>& offsets, const unsigned char* types, int cbTypes, int type)
+{
+	while ((int)offsets.size() <= type && offsets.back() < cbTypes)
 	{
-		const codeview_type* ptype = (codeview_type*)(globalTypes + pos);
-		int len = ptype->generic.len + 2;
-		pos += len;
-		type--;
+		const codeview_type* ptype = (const codeview_type*)(types + offsets.back());
+		offsets.push_back(offsets.back() + ptype->generic.len + 2);
 	}
-	return (codeview_type*)(globalTypes + pos);
+	int pos = type < (int)offsets.size() ? offsets[type] : offsets.back();
+	return (const codeview_type*)(types + pos);
+}
+
+// key for name lookups, compatible with the comparison done by dstrcmp
+static std::string structNameKey(const BYTE* name, bool cstr)
+{
+	int len = dstrlen(name, cstr);
+	std::string key((const char*)name, len);
+	for (size_t i = 0; i < key.size(); i++)
+		if (key[i] == '.')
+			key[i] = dotReplacementChar;
+	return key;
+}
+
+void CV2PDB::indexCompleteClassTypes()
+{
+	if (!globalTypeHeader)
+		return;
+
+	DWORD* offset = (DWORD*)(globalTypeHeader + 1);
+	BYTE* typeData = (BYTE*)(offset + globalTypeHeader->cTypes);
+	if (cbIndexedUserTypes < 0 || cbIndexedUserTypes > cbUserTypes)
+	{
+		completeClassTypes.clear();
+		for (unsigned int t = 0; t < globalTypeHeader->cTypes; t++)
+		{
+			const codeview_type* type = (const codeview_type*)(typeData + offset[t]);
+			bool cstr;
+			if (isStruct(type) && !(getStructProperty(type) & kPropIncomplete))
+				if (const BYTE* name = getStructName(type, cstr))
+					completeClassTypes.emplace(structNameKey(name, cstr), std::make_pair((int)t, (int)offset[t]));
+		}
+		cbIndexedUserTypes = 0;
+		userClassTypeIndex = globalTypeHeader->cTypes;
+	}
+	if (!userTypes)
+		return;
+
+	// first match wins, so types appended later never replace an entry
+	int t = userClassTypeIndex;
+	int pos = cbIndexedUserTypes;
+	for ( ; pos < cbUserTypes; t++)
+	{
+		const codeview_type* type = (codeview_type*)(userTypes + pos);
+		bool cstr;
+		if (isStruct(type) && !(getStructProperty(type) & kPropIncomplete))
+			if (const BYTE* name = getStructName(type, cstr))
+				completeClassTypes.emplace(structNameKey(name, cstr), std::make_pair(t, pos));
+		pos += type->generic.len + 2;
+	}
+	userClassTypeIndex = t;
+	cbIndexedUserTypes = pos;
 }
 
 const codeview_type* CV2PDB::findCompleteClassType(const codeview_type* cvtype, int* ptype)
@@ -956,37 +1073,24 @@ const codeview_type* CV2PDB::findCompleteClassType(const codeview_type* cvtype,
 	if(!pname)
 		return 0;
 
-	if(globalTypeHeader)
+	indexCompleteClassTypes();
+	auto it = completeClassTypes.find(structNameKey(pname, cstr));
+	if (it == completeClassTypes.end())
+		return cvtype;
+
+	int t = it->second.first;
+	const codeview_type* type;
+	if (t < (int)globalTypeHeader->cTypes)
 	{
 		DWORD* offset = (DWORD*)(globalTypeHeader + 1);
 		BYTE* typeData = (BYTE*)(offset + globalTypeHeader->cTypes);
-		for (unsigned int t = 0; t < globalTypeHeader->cTypes; t++)
-		{
-			const codeview_type* type = (const codeview_type*)(typeData + offset[t]);
-			if (isCompleteStruct(type, pname, cstr))
-			{
-				if(ptype)
-					*ptype = t;
-				return type;
-			}
-		}
-	}
-	if(userTypes)
-	{
-		int t = globalTypeHeader->cTypes;
-		for(int pos = 0; pos < cbUserTypes; t++)
-		{
-			const codeview_type* type = (codeview_type*)(userTypes + pos);
-			if (isCompleteStruct(type, pname, cstr))
-			{
-				if(ptype)
-					*ptype = t;
-				return type;
-			}
-			pos += type->generic.len + 2;
-		}
+		type = (const codeview_type*)(typeData + it->second.second);
 	}
-	return cvtype;
+	else
+		type = (const codeview_type*)(userTypes + it->second.second);
+	if(ptype)
+		*ptype = t;
+	return type;
 }
 
 int CV2PDB::findMemberFunctionType(codeview_symbol* lastGProcSym, int thisPtrType)
@@ -1486,7 +1590,7 @@ const char* CV2PDB::appendDynamicArray(int indexType, int elemType)
 
 	checkUserTypeAlloc();
 
-	static char name[kMaxNameLen];
+	thread_local char name[kMaxNameLen];
 	nameOfDynamicArray(indexType, elemType, name, sizeof(name));
 
 	// nextUserType: pointer to elemType
@@ -1611,7 +1715,7 @@ int CV2PDB::appendAssocArray(codeview_type* odtype, int keyType, int elemType)
 
 	checkUserTypeAlloc();
 
-	static char name[kMaxNameLen];
+	thread_local char name[kMaxNameLen];
 	if(Dversion >= 2.068)
 		return appendAssocArray2068(odtype, keyType, elemType);
 
@@ -1778,7 +1882,7 @@ const char* CV2PDB::appendDelegate(int thisType, int funcType)
 	rdtype->fieldlist.len = len1 + len2 + 2;
 	cbUserTypes += rdtype->fieldlist.len + 2;
 
-	static char name[kMaxNameLen];
+	thread_local char name[kMaxNameLen];
 	nameOfDelegate(thisType, funcType, name, sizeof(name));
 
 	// nextUserType + 3: struct delegate<>
@@ -2507,6 +2611,7 @@ int CV2PDB::appendClassTypeEnum(const codeview_type* fieldlist, int type, const
 	memmove(globalTypes + copyoff + len, globalTypes + copyoff, cbGlobalTypes - copyoff);
 	memcpy(globalTypes + copyoff, data, len);
 	cbGlobalTypes += len;
+	invalidateConvertedTypeOffsets(off);
 
 	codeview_type* nfieldlist = (codeview_type*) (globalTypes + off);
 	nfieldlist->generic.len = fieldlen + len - 2;
@@ -2533,6 +2638,7 @@ int CV2PDB::insertBaseClass(const codeview_type* fieldlist, int type)
 	memmove(globalTypes + copyoff + len, globalTypes + copyoff, cbGlobalTypes - copyoff);
 	memcpy(globalTypes + copyoff, &cvtype, len);
 	cbGlobalTypes += len;
+	invalidateConvertedTypeOffsets(off);
 
 	codeview_type* nfieldlist = (codeview_type*) (globalTypes + off);
 	nfieldlist->generic.len = fieldlen + len - 2;
@@ -2815,27 +2921,6 @@ bool CV2PDB::addSrcLines()
 }
 
 ////////////////////////////////////////
-template<typename T>
-void append(std::vector<char>& v, const T& x)
-{
-	size_t sz = v.size();
-	v.resize(sz + sizeof(T));
-	memcpy(v.data() + sz, &x, sizeof(T));
-}
-
-void append(std::vector<char>& v, const void* data, size_t len)
-{
-	size_t sz = v.size();
-	v.resize(sz + len);
-	memcpy(v.data() + sz, data, len);
-}
-
-void align(std::vector<char>& v, int algn)
-{
-	while(v.size() & (algn - 1))
-		v.push_back(0);
-}
-
 int addfile(std::vector<char>& f3, std::vector<char>& f4, const char* s)
 {
 	size_t slen = strlen(s);
@@ -3035,6 +3120,7 @@ bool CV2PDB::initGlobalSymbols()
 			cbStaticSymbols = header->cbSymbol;
 		}
 	}
+	cbIndexedUdtSymbols = -1;
 	return true;
 }
 
@@ -3287,64 +3373,70 @@ bool isUDTid(int id)
 
 // Find a user-defined type CV symbol.
 // CV-only.
-codeview_symbol* CV2PDB::findUdtSymbol(int type)
+// pos is relative to the concatenation of globalSymbols, staticSymbols and udtSymbols
+codeview_symbol* CV2PDB::udtSymbolAt(int pos)
 {
-	type = translateType(type);
-	for(int p = 0; p < cbGlobalSymbols; )
-	{
-		codeview_symbol* sym = (codeview_symbol*) (globalSymbols + p);
-		if(isUDTid(sym->generic.id) && sym->udt_v1.type == type)
-			return sym;
-		p += sym->generic.len + 2;
-	}
-	for(int p = 0; p < cbStaticSymbols; )
+	if (pos < cbGlobalSymbols)
+		return (codeview_symbol*) (globalSymbols + pos);
+	pos -= cbGlobalSymbols;
+	if (pos < cbStaticSymbols)
+		return (codeview_symbol*) (staticSymbols + pos);
+	return (codeview_symbol*) (udtSymbols + pos - cbStaticSymbols);
+}
+
+void CV2PDB::indexUdtSymbols()
+{
+	int base = cbGlobalSymbols + cbStaticSymbols;
+	int p = base + cbIndexedUdtSymbols;
+	if (cbIndexedUdtSymbols < 0 || cbIndexedUdtSymbols > cbUdtSymbols)
 	{
-		codeview_symbol* sym = (codeview_symbol*) (staticSymbols + p);
-		if(isUDTid(sym->generic.id) && sym->udt_v1.type == type)
-			return sym;
-		p += sym->generic.len + 2;
+		udtSymbolsByType.clear();
+		udtSymbolsByPName.clear();
+		udtSymbolsByCName.clear();
+		p = 0;
 	}
-	for(int p = 0; p < cbUdtSymbols; )
+	while (p < base + cbUdtSymbols)
 	{
-		codeview_symbol* sym = (codeview_symbol*) (udtSymbols + p);
-		if(isUDTid(sym->generic.id) && sym->udt_v1.type == type)
-			return sym;
+		codeview_symbol* sym = udtSymbolAt(p);
+		if(isUDTid(sym->generic.id))
+		{
+			// emplace keeps the first symbol, matching the search order
+			udtSymbolsByType.emplace(sym->udt_v1.type, p);
+			if(sym->generic.id == S_UDT_V3)
+				udtSymbolsByCName.emplace(sym->udt_v3.name, p);
+			else
+			{
+				const BYTE* name = sym->generic.id == S_UDT_V1 ? &sym->udt_v1.p_name.namelen : &sym->udt_v2.p_name.namelen;
+				udtSymbolsByPName.emplace(structNameKey(name, false), p);
+			}
+		}
 		p += sym->generic.len + 2;
 	}
-	return 0;
+	cbIndexedUdtSymbols = cbUdtSymbols;
 }
 
-bool isUDT(codeview_symbol* sym, const char* name)
+// Find a user-defined type CV symbol by its type.
+codeview_symbol* CV2PDB::findUdtSymbol(int type)
 {
-	return (sym->generic.id == S_UDT_V1 && p2ccmp(sym->udt_v1.p_name, name) ||
-			sym->generic.id == S_UDT_V2 && p2ccmp(sym->udt_v2.p_name, name) ||
-			sym->generic.id == S_UDT_V3 && strcmp(sym->udt_v3.name, name) == 0);
+	type = translateType(type);
+	indexUdtSymbols();
+	auto it = udtSymbolsByType.find(type);
+	if (it == udtSymbolsByType.end())
+		return 0;
+	return udtSymbolAt(it->second);
 }
 
 codeview_symbol* CV2PDB::findUdtSymbol(const char* name)
 {
-	for(int p = 0; p < cbGlobalSymbols; )
-	{
-		codeview_symbol* sym = (codeview_symbol*) (globalSymbols + p);
-		if(isUDT(sym, name))
-			return sym;
-		p += sym->generic.len + 2;
-	}
-	for(int p = 0; p < cbStaticSymbols; )
-	{
-		codeview_symbol* sym = (codeview_symbol*) (staticSymbols + p);
-		if(isUDT(sym, name))
-			return sym;
-		p += sym->generic.len + 2;
-	}
-	for(int p = 0; p < cbUdtSymbols; )
-	{
-		codeview_symbol* sym = (codeview_symbol*) (udtSymbols + p);
-		if(isUDT(sym, name))
-			return sym;
-		p += sym->generic.len + 2;
-	}
-	return 0;
+	indexUdtSymbols();
+	auto itp = udtSymbolsByPName.find(structNameKey((const BYTE*)name, true));
+	auto itc = udtSymbolsByCName.find(name);
+	int pos = -1;
+	if (itp != udtSymbolsByPName.end())
+		pos = itp->second;
+	if (itc != udtSymbolsByCName.end() && (pos < 0 || itc->second < pos))
+		pos = itc->second;
+	return pos < 0 ? 0 : udtSymbolAt(pos);
 }
 
 void CV2PDB::checkUdtSymbolAlloc(int size, int add)
@@ -3406,7 +3498,8 @@ bool CV2PDB::writeSymbols(mspdb::Mod* mod, DWORD* data, int databytes, int prefi
 	int rc = mod->AddSymbols((BYTE*) data, ((databytes + 3) / 4 + prefix) * 4);
 	if (rc <= 0)
 		return setError(
-		    mspdb::vsVersion == 10 ? "cannot add symbols to module, probably msobj100.dll missing"
+		    mspdb::nativeWriter    ? "cannot add symbols to module"
+		  : mspdb::vsVersion == 10 ? "cannot add symbols to module, probably msobj100.dll missing"
 		  : mspdb::vsVersion == 11 ? "cannot add symbols to module, probably msobj110.dll missing"
 		  : mspdb::vsVersion == 12 ? "cannot add symbols to module, probably msobj120.dll missing"
 		  : mspdb::vsVersion == 14 ? "cannot add symbols to module, probably msobj140.dll missing"
@@ -8,13 +8,13 @@
 #define __CV2PDB_H__
 
 #include <stdint.h>
+#include <map>
 
 #include "LastError.h"
 #include "mspdb.h"
 #include "readDwarf.h"
 
 #include <windows.h>
-#include <map>
 
 extern "C" {
 	#include "mscvpdb.h"
@@ -22,6 +22,7 @@ extern "C" {
 }
 
 class PEImage;
+struct PESection;
 struct DWARF_InfoData;
 struct DWARF_CompilationUnit;
 class CFIIndex;
@@ -30,6 +31,9 @@ class CV2PDB : public LastError
 {
 public:
 	CV2PDB(PEImage& image, PEImage* imageDWARF, DebugLevel debug);
+	// context to convert a single DWARF compilation unit on a worker thread,
+	// see createTypes()
+	CV2PDB(const CV2PDB& parent, int firstTypeID);
 	~CV2PDB();
 
 	bool cleanup(bool commit);
@@ -77,12 +81,16 @@ public:
 	void checkGlobalTypeAlloc(int size, int add = 1000);
 	void checkUdtSymbolAlloc(int size, int add = 10000);
 	void checkDWARFTypeAlloc(int size, int add = 10000);
+	int foldDWARFType(int recOff, int type);
 	void writeUserTypeLen(codeview_type* type, int len);
 
 	const codeview_type* getTypeData(int type);
 	const codeview_type* getUserTypeData(int type);
 	const codeview_type* getConvertedTypeData(int type);
+	const codeview_type* findTypeRecord(std::vector<int>& offsets, const unsigned char* types, int cbTypes, int type);
+	void invalidateConvertedTypeOffsets(int off);
 	const codeview_type* findCompleteClassType(const codeview_type* cvtype, int* ptype = 0);
+	void indexCompleteClassTypes();
 
 	int findMemberFunctionType(codeview_symbol* lastGProcSym, int thisPtrType);
 	int createEmptyFieldListType();
@@ -144,6 +152,8 @@ public:
 
 	codeview_symbol* findUdtSymbol(int type);
 	codeview_symbol* findUdtSymbol(const char* name);
+	codeview_symbol* udtSymbolAt(int pos);
+	void indexUdtSymbols();
 	bool addUdtSymbol(int type, const char* name);
 	void ensureUDT(int type, const codeview_type* cvtype);
 
@@ -169,12 +179,15 @@ public:
 	bool addDWARFLines();
 	bool addDWARFPublics();
 	bool writeDWARFImage(const TCHAR* opath);
-	DWARF_InfoData* findEntryByPtr(byte* entryPtr) const;
+	DWARF_Node* findEntryByPtr(byte* entryPtr) const;
+	bool readDWARFEntry(const DWARF_Node* node, DWARF_InfoData& id) const;
 
 	// Helper to just print the DWARF tree we've built for debugging purposes.
 	void dumpDwarfTree() const;
 
 	bool addDWARFSectionContrib(mspdb::Mod* mod, unsigned long pclo, unsigned long pchi);
+	bool addDWARFPublic(const char* name, int seg, unsigned long off, int type);
+	void addDWARFTypeRef(int buffer, const unsigned int* field);
 	bool addDWARFProc(DWARF_InfoData& id, const std::vector<RangeEntry> &ranges, DIECursor cursor);
 	void formatFullyQualifiedName(const DWARF_InfoData* node, char* buf, size_t cbBuf) const;
 
@@ -183,7 +196,7 @@ public:
 	int  addDWARFArray(DWARF_InfoData& arrayid, const DIECursor& cursor);
 	int  addDWARFBasicType(const char*name, int encoding, int byte_size);
 	int  addDWARFEnum(DWARF_InfoData& enumid, DIECursor cursor);
-	int  getTypeByDWARFPtr(byte* typePtr);
+	int  getTypeByDWARFPtr(byte* typePtr) const;
 	int  findTypeIdByPtr(byte* typePtr) const;
 	int  getDWARFTypeSize(const DIECursor& parent, byte* ptr);
 	void getDWARFArrayBounds(DIECursor cursor,
@@ -193,8 +206,34 @@ public:
 	int getDWARFBasicType(int encoding, int byte_size);
 
 	void build_cfi_index();
+
+	// Skeleton unit of split DWARF and the .dwo file holding its DIEs.
+	struct DWARF_SkeletonUnit
+	{
+		DWARF_CompilationUnitInfo cu; // including the bases set by its DIE
+		std::string dwoName;          // empty if the DIE names no .dwo file
+		std::string compDir;
+	};
+
 	bool mapTypes();
+	void scanDWARFUnit(DWARF_CompilationUnitInfo& cu, byte* ptr,
+		std::vector<DWARF_Node*>& lastNodes, std::vector<DWARF_Node*>& declarations);
+	void addDWARFNode(const DWARF_Node& proto, size_t level,
+		std::vector<DWARF_Node*>& lastNodes, std::vector<DWARF_Node*>& declarations);
+	void mapSplitUnits(const std::vector<DWARF_SkeletonUnit>& skeletons,
+		std::vector<DWARF_Node*>& lastNodes, std::vector<DWARF_Node*>& declarations);
+	std::vector<std::vector<unsigned long long>> hashDWARFDefinitions() const;
+	bool sameDWARFStructure(const DWARF_Node* a, const DWARF_Node* b) const;
+	unsigned long long hashDWARFStructure(const DWARF_Node* node, int depth) const;
+	unsigned long long hashDWARFTypeRef(byte* typePtr, int depth) const;
+	struct DWARF_DerivedTypes;
+	int foldDWARFDerivedTypes(int endTypeID, int& cntFolded);
+	int getDerivedDWARFTypeRef(byte* typePtr, DWARF_DerivedTypes& derived);
+	void foldDWARFDerivedType(DWARF_Node* node, DWARF_DerivedTypes& derived);
 	bool createTypes();
+	bool createTypesParallel();
+	bool createUnitTypes(unsigned int unit);
+	bool mergeUnitTypes(CV2PDB& unit);
 
 // private:
 	BYTE* libraries;
@@ -232,6 +271,11 @@ public:
 	int cbUserTypes;
 	int allocUserTypes;
 
+	// Offsets of the records in globalTypes and userTypes, extended on
+	// demand by getConvertedTypeData and getUserTypeData.
+	std::vector<int> globalTypeOffsets;
+	std::vector<int> userTypeOffsets;
+
 	unsigned char* globalSymbols;
 	int cbGlobalSymbols;
 
@@ -242,10 +286,30 @@ public:
 	int cbUdtSymbols;
 	int allocUdtSymbols;
 
+	// Hash indices for findUdtSymbol, mapping to the position of the first
+	// matching symbol in globalSymbols, staticSymbols and udtSymbols (in that
+	// order). Extended on demand as addUdtSymbol appends, -1 if not built yet.
+	std::unordered_map<int, int> udtSymbolsByType;
+	std::unordered_map<std::string, int> udtSymbolsByPName; // S_UDT_V1/V2, '.' replaced
+	std::unordered_map<std::string, int> udtSymbolsByCName; // S_UDT_V3
+	int cbIndexedUdtSymbols;
+
+	// Name of complete structs/classes to (type index, record offset) for
+	// findCompleteClassType, extended on demand as userTypes grows.
+	std::unordered_map<std::string, std::pair<int, int>> completeClassTypes;
+	int cbIndexedUserTypes;
+	int userClassTypeIndex;
+
 	unsigned char* dwarfTypes;
 	int cbDwarfTypes;
 	int allocDwarfTypes;
 
+	// Hash of the records in dwarfTypes to their offset and type index, used
+	// by foldDWARFType to share identical records.
+	std::unordered_multimap<unsigned long long, std::pair<int, int>> dwarfTypeHashes;
+	int cntFoldedDwarfTypes = 0;
+	int cbFoldedDwarfTypes = 0;
+
 	static constexpr int BASE_USER_TYPE = 0x1000;
 
 	int nextUserType = BASE_USER_TYPE;
@@ -288,21 +352,74 @@ public:
 
 	int codeSegOff;
 
-	// Lookup table for type IDs based on the DWARF_InfoData::entryPtr
-	std::unordered_map<byte*, int> mapEntryPtrToTypeID;
-	
-	// Lookup table for entries based on the DWARF_InfoData::entryPtr
-	std::unordered_map<byte*, DWARF_InfoData*> mapEntryPtrToEntry;
+	// Context of the DIE cursors for imgDbg, created by createDWARFModules.
+	std::unique_ptr<DWARF_Context> dwarfContext;
+
+	// Nodes of the DIE tree built by mapTypes, indexed by their offset in
+	// .debug_info. The nodes also hold the reserved type IDs.
+	DWARF_NodeArena dwarfTree;
+
+	// Named type definitions by the hash of their name, tag and enclosing
+	// scopes, see hashDWARFScope. Only the first of equivalent definitions is
+	// kept, but all of those with colliding hashes. The names are not copied.
+	std::unordered_multimap<unsigned long long, DWARF_Node*> mapScopeToDefinition;
 
-	// A multimap keyed on entry name. Since this is not unique, we use a multimap.
-	std::multimap<std::string, DWARF_InfoData*> mapEntryNameToEntries;
+	// Lookup table for the type IDs of struct declarations, mapping them to
+	// the type of the equivalent definition.
+	std::unordered_map<byte*, int> mapDeclPtrToTypeID;
 
 	// Head of list of DWARF DIE nodes.
-	DWARF_InfoData* dwarfHead = nullptr;
+	DWARF_Node* dwarfHead = nullptr;
 
 	// Default lower bound for the current compilation unit. This depends on
 	// the language of the current unit.
 	unsigned currentDefaultLowerBound;
+
+	// Number of threads used to convert the DWARF compilation units.
+	int numThreads = 1;
+
+	// Compilation units scanned by mapTypes, the index of their first node
+	// in dwarfTree and the first type ID reserved for the types declared in
+	// each of them. The unit header is kept to read DIEs of the tree again.
+	struct DWARF_UnitTypes
+	{
+		size_t firstNode;
+		int firstTypeID;
+		DWARF_CompilationUnitInfo cu;
+	};
+	std::vector<DWARF_UnitTypes> dwarfUnits;
+
+	// The .dwo files of split units, loaded by mapTypes. Their .debug_info
+	// sections are indexed by their end address, with the offset of the
+	// section in dwarfTree.
+	std::vector<std::unique_ptr<PEImage>> dwoImages;
+	std::map<const byte*, std::pair<const PESection*, unsigned int>> dwoInfoSections;
+
+	// Set if this context converts a single compilation unit on a worker
+	// thread. DWARF lookups are forwarded to the parent, type IDs for
+	// dwarfTypes are allocated starting at firstDwarfType and rebased when
+	// the unit is merged into the parent.
+	const CV2PDB* dwarfParent = nullptr;
+	int firstDwarfType = 0;
+
+	enum { kUserTypes, kDwarfTypes, kUdtSymbols };
+
+	// Offsets of type index fields referring to dwarfTypes records, written
+	// by a worker context into one of its buffers.
+	std::vector<std::pair<int, int>> dwarfTypeRefs;
+
+	// Public symbols and section contributions of a worker context, added
+	// to the global module when the unit is merged (name is NULL for a
+	// section contribution).
+	struct DeferredModCall
+	{
+		const char* name;
+		int seg;
+		unsigned long off;
+		unsigned long len;
+		int type;
+	};
+	std::vector<DeferredModCall> deferredModCalls;
 };
 
 #endif //__CV2PDB_H__
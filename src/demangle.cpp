@@ -54,7 +54,7 @@ struct stringpool
 
 	char* _first;
 };
-stringpool pool;
+thread_local stringpool pool;
 
 #define string _string // fool debugger to not use visualizers for std::string
 
@@ -40,6 +40,10 @@ double
 #define SARG		"%s"
 #endif
 
+// dwarflines.cpp adds lines through the wrappers of mspdb.h, but dumplines
+// never creates a PDB, so neither mspdb*.dll nor the built-in writer is used.
+bool mspdb::nativeWriter = false;
+
 void fatal(const char *message, ...)
 {
 	va_list argptr;
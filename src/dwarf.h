@@ -246,6 +246,8 @@ extern "C" {
 #define DW_FORM_addrx2                  0x2a /* DWARF5 */
 #define DW_FORM_addrx3                  0x2b /* DWARF5 */
 #define DW_FORM_addrx4                  0x2c /* DWARF5 */
+#define DW_FORM_GNU_ref_alt             0x1f20 /* dwz */
+#define DW_FORM_GNU_strp_alt            0x1f21 /* dwz */
 
 #define DW_UT_compile                   0x01 /* DWARF5 */
 #define DW_UT_type                      0x02 /* DWARF5 */
@@ -711,6 +713,7 @@ extern "C" {
 #define DW_OP_bit_piece                 0x9d /* DWARF3f */
 #define DW_OP_implicit_value            0x9e /* DWARF4 */
 #define DW_OP_stack_value               0x9f /* DWARF4 */
+#define DW_OP_addrx                     0xa1 /* DWARF5 */
 
 
     /* GNU extensions. */
@@ -19,7 +19,11 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 // Returns all non-empty address ranges specified by id.  The entry point (if applicable) is always the low address of the first range.
@@ -87,6 +91,48 @@ void CV2PDB::checkDWARFTypeAlloc(int size, int add)
 	}
 }
 
+// Called for the record just appended to dwarfTypes at recOff, which got
+// the last allocated type index. If an identical record has been added
+// before, the new one is dropped and the index of the existing one is
+// returned instead.
+int CV2PDB::foldDWARFType(int recOff, int type)
+{
+	assert(type == nextDwarfType - 1);
+	const codeview_type* rec = (const codeview_type*)(dwarfTypes + recOff);
+	const int len = rec->generic.len + 2;
+	assert(recOff + len == cbDwarfTypes);
+
+	unsigned long long hash = 14695981039346656037ull;
+	for (int i = 0; i < len; i++)
+		hash = (hash ^ dwarfTypes[recOff + i]) * 1099511628211ull;
+
+	auto range = dwarfTypeHashes.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		const codeview_type* prev = (const codeview_type*)(dwarfTypes + it->second.first);
+		if (prev->generic.len + 2 != len || memcmp(prev, rec, len) != 0)
+			continue;
+
+		// Drop the record and the references to rebase within it.
+		for (size_t r = dwarfTypeRefs.size(); r > 0; r--)
+		{
+			const std::pair<int, int>& ref = dwarfTypeRefs[r - 1];
+			if (ref.first != kDwarfTypes)
+				continue;
+			if (ref.second < recOff)
+				break;
+			dwarfTypeRefs.erase(dwarfTypeRefs.begin() + (r - 1));
+		}
+		cbDwarfTypes = recOff;
+		nextDwarfType--;
+		cntFoldedDwarfTypes++;
+		cbFoldedDwarfTypes += len;
+		return it->second.second;
+	}
+	dwarfTypeHashes.emplace(hash, std::make_pair(recOff, type));
+	return type;
+}
+
 enum CV_X86_REG
 {
 	CV_REG_NONE = 0,
@@ -576,7 +622,7 @@ Location findBestCFA(const PEImage& img, const CFIIndex* index, unsigned int pcl
 
 Location findBestFBLoc(const DIECursor& parent, unsigned long fblocoff)
 {
-	int regebp = parent.img->isX64() ? 6 : 5;
+	int regebp = parent.ctx->img->isX64() ? 6 : 5;
 	LOCCursor cursor(parent, fblocoff);
 	LOCEntry entry;
 	Location longest = { Location::RegRel, DW_REG_CFA, 0 };
@@ -714,26 +760,30 @@ void CV2PDB::appendLexicalBlock(DWARF_InfoData& id, unsigned int proclo)
 // for a Foo constructor in a Foo class in a namespace called "some_ns".
 // PDBs require fully qualified names in their symbols.
 // TODO: better error handling for out of space.
-void CV2PDB::formatFullyQualifiedName(const DWARF_InfoData* node, char* buf, size_t cbBuf) const {
-	if (node->specification) {
+void CV2PDB::formatFullyQualifiedName(const DWARF_InfoData* id, char* buf, size_t cbBuf) const {
+	const DWARF_Node* node = nullptr;
+	DWARF_Node self = {};
+	if (id->specification) {
 		// If the proc has a "specification", i.e. a declaration, use it instead
 		// of the definition, as it has a proper hierarchy connected to it
 		// which will give us a proper fully-qualified name like Foo::Foo
 		// instead of just Foo.
-		const DWARF_InfoData* entry = findEntryByPtr(node->specification);
-		if (entry) {
-			node = entry;
-		}
+		node = findEntryByPtr(id->specification);
 	} else {
-		// Find the node's entry in the DWARF tree. We can't use 'node' as is because
+		// Find the node's entry in the DWARF tree. We can't use 'id' as is because
 		// it is a local copy without linkage into the tree, as it comes from
 		// the 2nd pass scan after the tree is already built.
-		const DWARF_InfoData* entry = findEntryByPtr(node->entryPtr);
-		assert(entry);  // how can it not exist? Bug in tree construction.
-		node = entry;
+		node = findEntryByPtr(id->entryPtr);
+		assert(node);  // how can it not exist? Bug in tree construction.
 	}
-	DWARF_InfoData* parent = node->parent;
-	std::vector<const DWARF_InfoData*> segments;
+	if (!node) {
+		// Not in the tree, format the unqualified name.
+		self.name = id->name;
+		self.entryOff = id->entryOff;
+		node = &self;
+	}
+	const DWARF_Node* parent = node->parent;
+	std::vector<const DWARF_Node*> segments;
 	segments.push_back(node);
 
 	// Accumulate all the valid parent scopes so that we can reverse them for
@@ -808,8 +858,9 @@ void mergeSpecification(DWARF_InfoData& id, const CV2PDB& context);
 // TODO: this description isn't quite right. See section 3.3.8.1 in DWARF 4 spec.
 void mergeAbstractOrigin(DWARF_InfoData& id, const CV2PDB& context)
 {
-	DWARF_InfoData* abstractOrigin = context.findEntryByPtr(id.abstract_origin);
-	if (!abstractOrigin) {
+	const DWARF_Node* abstractOrigin = context.findEntryByPtr(id.abstract_origin);
+	DWARF_InfoData origin;
+	if (!abstractOrigin || !context.readDWARFEntry(abstractOrigin, origin)) {
 		// Could not find abstract origin. Why not?
 		assert(false);
 		return;
@@ -820,19 +871,20 @@ void mergeAbstractOrigin(DWARF_InfoData& id, const CV2PDB& context)
 	//
 	// assert(id.tag == idspec.tag);
 
-	if (abstractOrigin->abstract_origin)
-		mergeAbstractOrigin(*abstractOrigin, context);
-	if (abstractOrigin->specification)
-		mergeSpecification(*abstractOrigin, context);
-	id.merge(*abstractOrigin);
+	if (origin.abstract_origin)
+		mergeAbstractOrigin(origin, context);
+	if (origin.specification)
+		mergeSpecification(origin, context);
+	id.merge(origin);
 }
 
 // Find the declaration entry for a definition by following its 'specification'
 // attribute references and merge it into 'id'.
 void mergeSpecification(DWARF_InfoData& id, const CV2PDB& context)
 {
-	DWARF_InfoData* idspec = context.findEntryByPtr(id.specification);
-	if (!idspec) {
+	const DWARF_Node* idspec = context.findEntryByPtr(id.specification);
+	DWARF_InfoData spec;
+	if (!idspec || !context.readDWARFEntry(idspec, spec)) {
 		// Could not find decl for this definition. Why not?
 		assert(false);
 		return;
@@ -843,12 +895,12 @@ void mergeSpecification(DWARF_InfoData& id, const CV2PDB& context)
 	//
 	// assert(id.tag == idspec.tag);
 
-	if (idspec->abstract_origin)
-		mergeAbstractOrigin(*idspec, context);
-	if (idspec->specification) {
-		mergeSpecification(*idspec, context);
+	if (spec.abstract_origin)
+		mergeAbstractOrigin(spec, context);
+	if (spec.specification) {
+		mergeSpecification(spec, context);
 	}
-	id.merge(*idspec);
+	id.merge(spec);
 }
 
 bool CV2PDB::addDWARFProc(DWARF_InfoData& procid, const std::vector<RangeEntry> &ranges, DIECursor cursor)
@@ -1070,10 +1122,10 @@ int CV2PDB::addDWARFFields(DWARF_InfoData& structid, DIECursor& cursor, int base
 				{
 					checkDWARFTypeAlloc(kMaxNameLen + 100);
 					codeview_fieldtype* dfieldtype = (codeview_fieldtype*)(dwarfTypes + cbDwarfTypes);
-					const DWARF_InfoData* entry = findEntryByPtr(id.type);
+					const DWARF_Node* entry = findEntryByPtr(id.type);
 					if (entry && entry->tag == DW_TAG_pointer_type)
 					{
-						const DWARF_InfoData* ptrEntry = findEntryByPtr(entry->type);
+						const DWARF_Node* ptrEntry = findEntryByPtr(entry->type);
 						if (ptrEntry && ptrEntry->abbrev == structid.abbrev)
 							hasBackRef = true;
 					}
@@ -1164,7 +1216,7 @@ int CV2PDB::addDWARFStructure(DWARF_InfoData& structid, DIECursor cursor)
 		nfields += addDWARFFields(structid, cursor, 0, flbegin, hasBackRef);
 		fl = (codeview_reftype*) (dwarfTypes + flbegin);
 		fl->fieldlist.len = cbDwarfTypes - flbegin - 2;
-		fieldlistType = nextDwarfType++;
+		fieldlistType = foldDWARFType(flbegin, nextDwarfType++);
 	}
 
 	char namebuf[kMaxNameLen] = {};
@@ -1176,10 +1228,12 @@ int CV2PDB::addDWARFStructure(DWARF_InfoData& structid, DIECursor cursor)
 		// with back references, make the original struct incomplete and
 		// put the full definition into the DWARF chunk
 		checkDWARFTypeAlloc(kMaxNameLen + 100);
-		codeview_type* dwarf = (codeview_type*)(dwarfTypes + cbDwarfTypes);
+		int recOff = cbDwarfTypes;
+		codeview_type* dwarf = (codeview_type*)(dwarfTypes + recOff);
 		int len = addAggregate(dwarf, structid.tag == DW_TAG_class_type, nfields, fieldlistType, 0, 0, 0, structid.byte_size, namebuf, nullptr);
+		addDWARFTypeRef(kDwarfTypes, &dwarf->struct_v2.fieldlist);
 		cbDwarfTypes += len;
-		udttype = nextDwarfType++;
+		udttype = foldDWARFType(recOff, nextDwarfType++);
 		fieldlistType = 0;
 		nfields = 0;
 	}
@@ -1187,11 +1241,14 @@ int CV2PDB::addDWARFStructure(DWARF_InfoData& structid, DIECursor cursor)
 	codeview_type* cvt = (codeview_type*)(userTypes + cbUserTypes);
 	int attr = fieldlistType ? 0 : kPropIncomplete;
 	int len = addAggregate(cvt, structid.tag == DW_TAG_class_type, nfields, fieldlistType, attr, 0, 0, structid.byte_size, namebuf, nullptr);
+	addDWARFTypeRef(kUserTypes, &cvt->struct_v2.fieldlist);
 	cbUserTypes += len;
 	int cvtype = nextUserType++;
 
 	//ensureUDT()?
+	int udtOff = cbUdtSymbols;
 	addUdtSymbol(udttype, namebuf);
+	addDWARFTypeRef(kUdtSymbols, &((codeview_symbol*)(udtSymbols + udtOff))->udt_v2.type);
 	return cvtype;
 }
 
@@ -1377,6 +1434,13 @@ bool CV2PDB::addDWARFSymbols()
 
 bool CV2PDB::addDWARFSectionContrib(mspdb::Mod* mod, unsigned long pclo, unsigned long pchi)
 {
+	if (dwarfParent)
+	{
+		// added to the module when the unit is merged, see mergeUnitTypes()
+		deferredModCalls.push_back({ nullptr, 0, pclo, pchi - pclo, 0 });
+		return true;
+	}
+
 	int segIndex = imgDbg->findSection(pclo);
 	if(segIndex >= 0)
 	{
@@ -1388,6 +1452,30 @@ bool CV2PDB::addDWARFSectionContrib(mspdb::Mod* mod, unsigned long pclo, unsigne
 	return true;
 }
 
+bool CV2PDB::addDWARFPublic(const char* name, int seg, unsigned long off, int type)
+{
+	if (dwarfParent)
+	{
+		// added to the module when the unit is merged, see mergeUnitTypes()
+		deferredModCalls.push_back({ name, seg, off, 0, type });
+		return true;
+	}
+
+	globalMod()->AddPublic2(name, seg, off, type);
+	return true;
+}
+
+// Remember a type index field written by a worker context if it refers to
+// one of its dwarfTypes records, so it can be rebased in mergeUnitTypes().
+void CV2PDB::addDWARFTypeRef(int buffer, const unsigned int* field)
+{
+	if (!dwarfParent || *field < (unsigned int)firstDwarfType)
+		return;
+
+	const BYTE* base = buffer == kUserTypes ? userTypes : buffer == kDwarfTypes ? dwarfTypes : udtSymbols;
+	dwarfTypeRefs.push_back(std::make_pair(buffer, (int)((const BYTE*)field - base)));
+}
+
 int CV2PDB::addDWARFBasicType(const char*name, int encoding, int byte_size)
 {
 	int t = getDWARFBasicType(encoding, byte_size);
@@ -1424,7 +1512,7 @@ int CV2PDB::addDWARFEnum(DWARF_InfoData& enumid, DIECursor cursor)
 
 	/* Type index for the first LF_FIELDLIST record we produce. This is the one
 	   that LF_ENUM will refer to */
-	const int firstFieldlistType = fieldlistType;
+	int firstFieldlistType = fieldlistType;
 
 	/* Total number of DW_TAG_enumerator DIEs we translate into
 	   LF_ENUMERATE. */
@@ -1478,6 +1566,7 @@ int CV2PDB::addDWARFEnum(DWARF_InfoData& enumid, DIECursor cursor)
 
 				/* Reference this new record from the LF_INDEX leaf. */
 				indexLeaf->index_v2.ref = newFieldlistType;
+				addDWARFTypeRef(kDwarfTypes, &indexLeaf->index_v2.ref);
 
 				/* Make next runs target the new LF_FIELDLIST record. */
 				fieldlistType = newFieldlistType;
@@ -1502,9 +1591,13 @@ int CV2PDB::addDWARFEnum(DWARF_InfoData& enumid, DIECursor cursor)
 	rdtype = (codeview_reftype*)(dwarfTypes + fieldlistOffset);
 	rdtype->fieldlist.len += fieldlistLength - 2;
 
+	/* A single LF_FIELDLIST record can be shared with identical enums. */
+	if (fieldlistType == firstFieldlistType)
+		firstFieldlistType = foldDWARFType(fieldlistOffset, fieldlistType);
+
 	/* Now the LF_FIELDLIST is ready, create the LF_ENUM type record itself. */
 	checkUserTypeAlloc();
-	const DWARF_InfoData* entry = findEntryByPtr(enumid.entryPtr);
+	const DWARF_Node* entry = findEntryByPtr(enumid.entryPtr);
 	int prop = 0;
 	if (entry && entry->parent) {
 		int tag = entry->parent->tag;
@@ -1521,8 +1614,8 @@ int CV2PDB::addDWARFEnum(DWARF_InfoData& enumid, DIECursor cursor)
 	// 
 	// Compute the best base/underlying type to use.
 	int encoding = DW_ATE_signed;  // default to int
-	const DWARF_InfoData* typeEntry = findEntryByPtr(enumid.type);
-	const DWARF_InfoData* t = typeEntry;
+	const DWARF_Node* typeEntry = findEntryByPtr(enumid.type);
+	const DWARF_Node* t = typeEntry;
 
 	// Follow all the parent types to get to the base UDT.
 	while (t) {
@@ -1530,9 +1623,10 @@ int CV2PDB::addDWARFEnum(DWARF_InfoData& enumid, DIECursor cursor)
 		if (t) typeEntry = t;
 	}
 
-	if (typeEntry) {
-		encoding = typeEntry->encoding;
-		assert(typeEntry->byte_size == enumid.byte_size);
+	DWARF_InfoData baseid;
+	if (typeEntry && readDWARFEntry(typeEntry, baseid)) {
+		encoding = baseid.encoding;
+		assert(baseid.byte_size == enumid.byte_size);
 	}
 
 	const int basetype = getDWARFBasicType(encoding, enumid.byte_size);
@@ -1541,99 +1635,126 @@ int CV2PDB::addDWARFEnum(DWARF_InfoData& enumid, DIECursor cursor)
 	char namebuf[kMaxNameLen] = {};
 	formatFullyQualifiedName(&enumid, namebuf, sizeof namebuf);
 	cbUserTypes += addEnum(dtype, count, firstFieldlistType, prop, basetype, namebuf);
+	addDWARFTypeRef(kUserTypes, &dtype->enumeration_v2.fieldlist);
 	int enumType = nextUserType++;
 
 	addUdtSymbol(enumType, namebuf);
 	return enumType;
 }
 
+// Tag of a node for comparing scopes, types defined at the top level of a
+// type unit or partial unit are in the same scope as those of a compilation
+// unit.
+static unsigned int scopeTag(const DWARF_Node* node)
+{
+	switch (node->tag)
+	{
+	case DW_TAG_type_unit:
+	case DW_TAG_partial_unit:
+		return DW_TAG_compile_unit;
+	}
+	return node->tag;
+}
+
+// Hash of the name and tag of a node and its enclosing scopes. The names of
+// the compilation units are not included.
+static unsigned long long hashDWARFScope(const DWARF_Node* node)
+{
+	unsigned long long hash = 14695981039346656037ull;
+	for (; node; node = node->parent)
+	{
+		hash = (hash ^ scopeTag(node)) * 1099511628211ull;
+		if (scopeTag(node) != DW_TAG_compile_unit && node->name)
+			for (const unsigned char* p = (const unsigned char*)node->name; *p; p++)
+				hash = (hash ^ *p) * 1099511628211ull;
+		hash = (hash ^ 0xff) * 1099511628211ull; // separator, not part of any name
+	}
+	return hash;
+}
+
+// Check whether two nodes have the same name and tag and are declared in
+// equivalent scopes.
+static bool sameDWARFScope(const DWARF_Node* a, const DWARF_Node* b)
+{
+	for (; a && b; a = a->parent, b = b->parent)
+	{
+		if (scopeTag(a) != scopeTag(b))
+			return false;
+
+		// Skip CUs as of course they have different names. We only
+		// care about namespaces, other containing structs, classes, etc.
+		if (scopeTag(a) != DW_TAG_compile_unit &&
+			a->name != b->name &&
+			(!a->name || !b->name || strcmp(a->name, b->name)))
+			return false;
+	}
+	return !a && !b;
+}
+
+// Lower bound of array subranges without DW_AT_lower_bound.
+static unsigned getDWARFDefaultLowerBound(unsigned language)
+{
+	switch (language)
+	{
+	case DW_LANG_Ada83:
+	case DW_LANG_Cobol74:
+	case DW_LANG_Cobol85:
+	case DW_LANG_Fortran77:
+	case DW_LANG_Fortran90:
+	case DW_LANG_Pascal83:
+	case DW_LANG_Modula2:
+	case DW_LANG_Ada95:
+	case DW_LANG_Fortran95:
+	case DW_LANG_PLI:
+		return 1;
+	}
+	return 0;
+}
+
+// Returns whether mapTypes shares the type ID of the node with equivalent
+// definitions in other units.
+static bool isSharedDWARFDefinition(const DWARF_Node* node)
+{
+	switch (node->tag)
+	{
+	case DW_TAG_structure_type:
+	case DW_TAG_class_type:
+	case DW_TAG_union_type:
+	case DW_TAG_enumeration_type:
+		return node->name && !node->isDecl;
+	}
+	return false;
+}
+
 // Try to find or compute the "best" CV TypeID for a given DIE found by following
 // a DW_AT_type attribute or its closest counterpart.
-int CV2PDB::getTypeByDWARFPtr(byte* typePtr)
+int CV2PDB::getTypeByDWARFPtr(byte* typePtr) const
 {
 	if (typePtr == nullptr)
 		return T_NOTYPE;
 
+	if (dwarfParent)
+		return dwarfParent->getTypeByDWARFPtr(typePtr);
+
 	// First just attempt to find the type entry directly.
 	int ret = findTypeIdByPtr(typePtr);
 	if (!ret) {
 		// TypeID was not found in the map. This may be due to struct
 		// decl / definition consolidation. I.e. we don't emit the struct decl
 		// because they show up as "empty" structs (devoid of members).
-		// Try to match this against the logically equivalent "definition"
-		// type.
-		DWARF_InfoData* entry = findEntryByPtr(typePtr);
+		// Use the logically equivalent "definition" type found by mapTypes.
+		auto it = mapDeclPtrToTypeID.find(typePtr);
+		if (it != mapDeclPtrToTypeID.end())
+			return it->second;
+
+		const DWARF_Node* entry = findEntryByPtr(typePtr);
 		assert(entry); // how can the entry not exist in the map?
 
 		// Skip anonymous structures or similar.
 		if (!entry || !entry->name) {
 			return T_NOTYPE;
 		}
-
-		// See if there exists another "logically equivalent" entry in the tree.
-		// 
-		// First, find all entries with the same (local) name as this type.
-		auto range = mapEntryNameToEntries.equal_range(entry->name);
-		for (auto it = range.first; !ret && it != range.second; ++it) {
-			DWARF_InfoData* candidate = it->second;
-
-			// Skip self.
-			if (candidate == entry) {
-				continue;
-			}
-
-			// Skip declarations (as when they are of structs, they don't help.
-			// We want definitions only as they define the fields in DWARF.)
-			if (candidate->isDecl) {
-				continue;
-			}
-			
-			// Filter nodes based on the matching tag.
-			if (candidate->tag != entry->tag) {
-				continue;
-			}
-
-			// Found a matching tag for this element. Walk up the tree and check
-			// if all parent tags and names match also. If they do, we found an
-			// "equivalent" node to 'typePtr' one that wasn't added to the
-			// typeID registry (because it was likely a decl that we filtered out)
-			DWARF_InfoData* candidateParent = candidate->parent;
-			DWARF_InfoData* entryParent = entry->parent;
-
-			bool equivalentHierarchy = true;
-			while (candidateParent && entryParent) {
-				if (candidateParent->tag != entryParent->tag) {
-					// Tag mismatch.
-					equivalentHierarchy = false;
-					break;
-				}
-
-				// Skip CUs as of course they have different names. We only
-				// care about namespaces, other containing structs, classes, etc.
-				// Entries have the same tag. Checking one is sufficient.
-				if (entryParent->tag != DW_TAG_compile_unit) {
-
-					if (candidateParent->name != entryParent->name &&
-						(!candidateParent->name || !entryParent->name ||
-						strcmp(candidateParent->name, entryParent->name))) {
-						// Name mismatch.
-						equivalentHierarchy = false;
-						break;
-					}
-				}
-
-				candidateParent = candidateParent->parent;
-				entryParent = entryParent->parent;
-			}
-
-			if (equivalentHierarchy) {
-				// Try another lookup with this new candidate.
-				ret = findTypeIdByPtr(candidate->entryPtr);
-				assert(ret);  // how can it now be in the map?
-			}
-		}
-		if (!ret)
-			fprintf(stderr, "warn: could not find equivalent entry for typePtr %p (%s)\n", typePtr, entry->name);
+		fprintf(stderr, "warn: could not find equivalent entry for typePtr %p (%s)\n", typePtr, entry->name);
 	}
 	return ret;
 }
@@ -1673,6 +1794,284 @@ int CV2PDB::getDWARFTypeSize(const DIECursor& parent, byte* typePtr)
 	return 0;
 }
 
+// Add a node of the DIE tree, linking it to its parent and previous sibling.
+// lastNodes holds the last node added at each level, the unit nodes at level 0
+// are linked as siblings.
+void CV2PDB::addDWARFNode(const DWARF_Node& proto, size_t level,
+	std::vector<DWARF_Node*>& lastNodes, std::vector<DWARF_Node*>& declarations)
+{
+	DWARF_Node* node = dwarfTree.alloc(proto.entryOff);
+	*node = proto;
+
+	assert(level <= lastNodes.size());
+	if (level > 0)
+		node->parent = lastNodes[level - 1];
+	if (level < lastNodes.size())
+		lastNodes[level]->next = node;
+	else if (node->parent)
+		node->parent->children = node;
+	lastNodes.resize(level + 1);
+	lastNodes[level] = node;
+
+	// Initialize the head of the DWARF DIE list the first time.
+	if (!dwarfHead) {
+		dwarfHead = node;
+	}
+
+	switch (node->tag)
+	{
+		case DW_TAG_structure_type:
+		case DW_TAG_class_type:
+		case DW_TAG_union_type:
+			if (node->isDecl && node->name)
+				declarations.push_back(node);
+	}
+}
+
+// Node of the DIE tree for the DIE just read, not linked yet.
+static DWARF_Node makeDWARFNode(const DWARF_InfoData& id, unsigned int unit)
+{
+	DWARF_Node node{};
+	node.entryPtr = id.entryPtr;
+	node.name = id.name;
+	node.type = id.type;
+	node.abbrev = id.abbrev;
+	node.entryOff = id.entryOff;
+	node.unit = unit;
+	node.tag = id.tag;
+	node.isDecl = id.isDecl;
+	return node;
+}
+
+// Add the DIEs of the unit starting at ptr to the DIE tree.
+void CV2PDB::scanDWARFUnit(DWARF_CompilationUnitInfo& cu, byte* ptr,
+	std::vector<DWARF_Node*>& lastNodes, std::vector<DWARF_Node*>& declarations)
+{
+	const unsigned int unit = dwarfUnits.size();
+	dwarfUnits.push_back({ dwarfTree.count(), 0 });
+
+	// Look up the abbreviations once, the cursors of the unit reuse them.
+	cu.abbrevTable = dwarfContext->getAbbrevTable(*cu.img, cu.debug_abbrev_offset);
+	DIECursor cursor(*dwarfContext, &cu, ptr);
+	DWARF_InfoData id;
+
+	// Start scanning this CU from the beginning and *build a tree of DIE nodes*.
+	while (cursor.readNext(&id))
+	{
+		if (debug & DbgDwarfTagRead)
+			fprintf(stderr, "%s:%d: 0x%08x, level = %d, id.code = %d, id.tag = %d\n", __FUNCTION__, __LINE__,
+					cursor.entryOff, cursor.level, id.code, id.tag);
+
+		addDWARFNode(makeDWARFNode(id, unit), cursor.level, lastNodes, declarations);
+	}
+
+	// Keep the unit including the bases set by its DIE.
+	dwarfUnits.back().cu = cu;
+}
+
+// Load the .dwo file of a split unit. A relative name is looked up in the
+// compilation directory first, then in the current directory.
+static std::unique_ptr<PEImage> loadDWOFile(const std::string& dwoName, const std::string& compDir)
+{
+	std::vector<std::string> paths;
+	const char* name = dwoName.c_str();
+	if (name[0] != '/' && name[0] != '\\' && !(name[0] && name[1] == ':') && !compDir.empty())
+		paths.push_back(compDir + "/" + dwoName);
+	paths.push_back(dwoName);
+
+	for (const std::string& path : paths)
+	{
+		TCHAR tpath[MAX_PATH];
+#ifdef UNICODE
+		if (!MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, tpath, MAX_PATH))
+			continue;
+#else
+		if (path.size() >= MAX_PATH)
+			continue;
+		strcpy(tpath, path.c_str());
+#endif
+		std::unique_ptr<PEImage> dwo = std::make_unique<PEImage>();
+		if (dwo->loadObj(tpath) && dwo->debug_info.isPresent())
+			return dwo;
+	}
+
+	fprintf(stderr, "WARNING: cannot load split DWARF file %s\n", paths[0].c_str());
+	return nullptr;
+}
+
+// Set up the bases of a split unit. Addresses are read from the skeleton's
+// .debug_addr, the other indexed attributes refer to the sections of the
+// .dwo file, following the header of its only contribution to them.
+static void initSplitUnit(DWARF_CompilationUnitInfo& cu, const DWARF_CompilationUnitInfo& skeleton)
+{
+	const PEImage& dwo = *cu.img;
+	cu.addr_base = skeleton.addr_base;
+	cu.base_address = skeleton.base_address;
+	if (dwo.debug_str_offsets.length > 8)
+		cu.str_offset_base = dwo.debug_str_offsets.byteAt(8);
+	if (dwo.debug_rnglists.length > 12)
+		cu.rnglist_base = dwo.debug_rnglists.byteAt(12);
+	if (dwo.debug_loclists.length > 12)
+		cu.loclist_base = dwo.debug_loclists.byteAt(12);
+}
+
+// Units of a .dwo file, decoded on a worker thread by mapSplitUnits. The
+// nodes are linked into the tree afterwards, using their level.
+struct DWARF_SplitFile
+{
+	struct Unit
+	{
+		DWARF_CompilationUnitInfo cu;
+		byte* ptr;        // first DIE
+		size_t firstNode; // first node in nodes
+	};
+
+	std::unique_ptr<PEImage> img;
+	std::vector<Unit> units;
+	std::vector<DWARF_Node> nodes;
+	std::vector<int> levels;
+	bool hasCompileUnit = false; // a split unit matches the skeleton
+};
+
+// Load the .dwo files of the skeleton units and add their split units to the
+// DIE tree. The files are loaded and decoded on up to numThreads threads, the
+// nodes are then added in the order of the skeletons, with their offsets
+// continuing after .debug_info. Files that cannot be loaded are skipped and
+// counted in a warning.
+void CV2PDB::mapSplitUnits(const std::vector<DWARF_SkeletonUnit>& skeletons,
+	std::vector<DWARF_Node*>& lastNodes, std::vector<DWARF_Node*>& declarations)
+{
+	const size_t cntFiles = skeletons.size();
+	const size_t cntThreads = (size_t)numThreads < cntFiles ? numThreads : cntFiles;
+	std::vector<DWARF_SplitFile> files(cntFiles);
+
+	auto forEachFile = [&](auto fn)
+	{
+		std::atomic<size_t> nextFile(0);
+		auto work = [&]()
+		{
+			for (size_t f = nextFile++; f < cntFiles; f = nextFile++)
+				fn(files[f], skeletons[f]);
+		};
+		std::vector<std::thread> threads;
+		for (size_t t = 1; t < cntThreads; t++)
+			threads.emplace_back(work);
+		work();
+		for (std::thread& t : threads)
+			t.join();
+	};
+
+	// Load the files and read the unit headers.
+	forEachFile([&](DWARF_SplitFile& file, const DWARF_SkeletonUnit& skeleton)
+	{
+		if (skeleton.dwoName.empty())
+			return;
+		file.img = loadDWOFile(skeleton.dwoName, skeleton.compDir);
+		if (!file.img)
+			return;
+
+		const PEImage& dwo = *file.img;
+		unsigned long off = 0;
+		while (off < dwo.debug_info.length)
+		{
+			DWARF_CompilationUnitInfo cu{};
+			byte* ptr = cu.read(debug, dwo, &off);
+			if (!ptr || (cu.unit_type != DW_UT_split_compile && cu.unit_type != DW_UT_split_type))
+				continue;
+			if (cu.unit_type == DW_UT_split_compile && cu.dwo_id != skeleton.cu.dwo_id)
+			{
+				fprintf(stderr, "WARNING: split DWARF file %s does not match its skeleton unit\n", skeleton.dwoName.c_str());
+				continue;
+			}
+			initSplitUnit(cu, skeleton.cu);
+			file.units.push_back({ cu, ptr, 0 });
+			if (cu.unit_type == DW_UT_split_compile)
+				file.hasCompileUnit = true;
+		}
+	});
+
+	// All type units have to be known before decoding references to them.
+	for (const DWARF_SplitFile& file : files)
+		for (const DWARF_SplitFile::Unit& unit : file.units)
+			if (unit.cu.unit_type == DW_UT_split_type)
+				dwarfContext->typeUnits.emplace(unit.cu.type_signature, unit.cu.start_ptr + unit.cu.type_offset);
+
+	// Decode the DIEs. A type unit repeated in several files is only decoded
+	// in the first one.
+	forEachFile([&](DWARF_SplitFile& file, const DWARF_SkeletonUnit&)
+	{
+		DWARF_InfoData id;
+		for (DWARF_SplitFile::Unit& unit : file.units)
+		{
+			unit.firstNode = file.nodes.size();
+			if (unit.cu.unit_type == DW_UT_split_type &&
+				dwarfContext->findTypeUnit(unit.cu.type_signature) != unit.cu.start_ptr + unit.cu.type_offset)
+				continue;
+
+			unit.cu.abbrevTable = dwarfContext->getAbbrevTable(*unit.cu.img, unit.cu.debug_abbrev_offset);
+			DIECursor cursor(*dwarfContext, &unit.cu, unit.ptr);
+			while (cursor.readNext(&id))
+			{
+				file.nodes.push_back(makeDWARFNode(id, 0));
+				file.levels.push_back(cursor.level);
+			}
+		}
+	});
+
+	unsigned int infoBase = imgDbg->debug_info.length;
+	size_t cntSplitUnits = 0;
+	size_t cntUnnamed = 0, cntNotLoaded = 0, cntUnmatched = 0;
+	for (size_t f = 0; f < cntFiles; f++)
+	{
+		DWARF_SplitFile& file = files[f];
+		if (!file.img)
+		{
+			if (skeletons[f].dwoName.empty())
+				cntUnnamed++;
+			else
+				cntNotLoaded++;
+			continue;
+		}
+		if (!file.hasCompileUnit)
+			cntUnmatched++;
+
+		for (size_t u = 0; u < file.units.size(); u++)
+		{
+			DWARF_SplitFile::Unit& unit = file.units[u];
+			const size_t endNode = u + 1 < file.units.size() ? file.units[u + 1].firstNode : file.nodes.size();
+			if (unit.firstNode == endNode)
+				continue;
+
+			unit.cu.info_base = infoBase;
+			const unsigned int unitIndex = dwarfUnits.size();
+			dwarfUnits.push_back({ dwarfTree.count(), 0, unit.cu });
+			for (size_t n = unit.firstNode; n < endNode; n++)
+			{
+				DWARF_Node& proto = file.nodes[n];
+				proto.entryOff += infoBase;
+				proto.unit = unitIndex;
+				addDWARFNode(proto, file.levels[n], lastNodes, declarations);
+			}
+			cntSplitUnits++;
+		}
+
+		const PESection& info = file.img->debug_info;
+		dwoInfoSections.emplace(info.endByte(), std::make_pair(&info, infoBase));
+		infoBase += info.length;
+		dwoImages.push_back(std::move(file.img));
+	}
+
+	if (debug & DbgBasic)
+		fprintf(stderr, "%s:%d: loaded %zd .dwo files of %zd skeleton units with %zd split units\n", __FUNCTION__, __LINE__,
+				dwoImages.size(), cntFiles, cntSplitUnits);
+
+	// The DIEs of these compilation units are missing from the PDB.
+	if (cntUnnamed + cntNotLoaded + cntUnmatched)
+		fprintf(stderr, "WARNING: %zd of %zd skeleton units have no split unit: %zd name no .dwo file, "
+				"%zd .dwo files not loaded, %zd .dwo files without matching unit\n",
+				cntUnnamed + cntNotLoaded + cntUnmatched, cntFiles, cntUnnamed, cntNotLoaded, cntUnmatched);
+}
+
 // Scan the .debug_info section and allocate type IDs for each unique type and
 // create a mapping to look them up by their address.
 // This is the first pass scan that builds up the DWARF tree. The second pass (createTypes)
@@ -1685,8 +2084,29 @@ bool CV2PDB::mapTypes()
 	if (debug & DbgBasic)
 		fprintf(stderr, "%s:%d: mapTypes()\n", __FUNCTION__, __LINE__);
 
-	// Maintain the first node of each CU to ensure all of them get linked.
-	DWARF_InfoData* firstNode = nullptr;
+	// Last node read at each level of the tree, the CU nodes at level 0 are
+	// linked as siblings.
+	std::vector<DWARF_Node*> lastNodes;
+	DWARF_InfoData id;
+
+	// Struct declarations to be resolved to their definitions.
+	std::vector<DWARF_Node*> declarations;
+
+	// Index the type units by their signature first, as DW_FORM_ref_sig8
+	// references can precede the unit they refer to. Only the headers are
+	// read here.
+	while (off < imgDbg->debug_info.length)
+	{
+		DWARF_CompilationUnitInfo cu{};
+		if (cu.read(debug & ~DbgDwarfCompilationUnit, *imgDbg, &off) && cu.unit_type == DW_UT_type)
+			dwarfContext->typeUnits.emplace(cu.type_signature, cu.start_ptr + cu.type_offset);
+	}
+	if ((debug & DbgBasic) && !dwarfContext->typeUnits.empty())
+		fprintf(stderr, "%s:%d: found %zd type units\n", __FUNCTION__, __LINE__, dwarfContext->typeUnits.size());
+	off = 0;
+
+	// Skeleton units of split DWARF, the DIEs are in the .dwo files they name.
+	std::vector<DWARF_SkeletonUnit> skeletons;
 
 	// Scan each compilation unit in '.debug_info'.
 	while (off < imgDbg->debug_info.length)
@@ -1699,8 +2119,27 @@ bool CV2PDB::mapTypes()
 		if (!ptr)
 			continue;
 
-		// We only support regular full 'DW_UT_compile' compilation units.
-		if (cu.unit_type != DW_UT_compile) {
+		if (cu.unit_type == DW_UT_skeleton)
+		{
+			// Read the DIE twice, as its indexed attributes can precede the
+			// bases they depend on.
+			DIECursor cursor(*dwarfContext, &cu, ptr);
+			if (cursor.readNext(&id))
+			{
+				cursor.gotoEntry(ptr);
+				cursor.readNext(&id);
+			}
+			cu.base_address = id.pclo;
+			skeletons.push_back({ cu, id.dwo_name ? id.dwo_name : "", id.dir ? id.dir : "" });
+			continue;
+		}
+
+		// We only support regular full 'DW_UT_compile' compilation units,
+		// partial units (as created by dwz, the DIEs are referenced directly
+		// from the importing units) and the type units they refer to. A type
+		// unit repeated by several objects is only converted once.
+		if (cu.unit_type != DW_UT_compile && cu.unit_type != DW_UT_partial &&
+			(cu.unit_type != DW_UT_type || dwarfContext->findTypeUnit(cu.type_signature) != cu.start_ptr + cu.type_offset)) {
 			if (debug & DbgDwarfCompilationUnit)
 				fprintf(stderr, "%s:%d: skipping compilation unit offs=%x, unit_type=%d\n", __FUNCTION__, __LINE__,
 						cu.cu_offset, cu.unit_type);
@@ -1708,49 +2147,53 @@ bool CV2PDB::mapTypes()
 			continue;
 		}
 
-		DIECursor cursor(&cu, ptr);
-
-		// Set up link to ensure this CU links to the prior one.
-		cursor.prevNode = firstNode;
+		scanDWARFUnit(cu, ptr, lastNodes, declarations);
+	}
 
-		DWARF_InfoData* node = nullptr;
-		bool setFirstNode = false;
-		// Start scanning this CU from the beginning and *build a tree of DIE nodes*.
-		while ((node = cursor.readNext(nullptr)) != nullptr)
+	if (!skeletons.empty())
+		mapSplitUnits(skeletons, lastNodes, declarations);
+
+	// Reserve the type IDs in the order of the nodes. Definitions of structs,
+	// classes, unions and enums repeated in several compilation units (as
+	// emitted for C++ headers) share the type ID of the first one, so that
+	// they are only converted once. They are found by a 64-bit hash of the
+	// name, scope and members of the type, a match is confirmed by comparing
+	// the scopes, sizes and member names.
+	std::vector<std::vector<unsigned long long>> unitHashes = hashDWARFDefinitions();
+	std::unordered_map<unsigned long long, DWARF_Node*> representatives;
+	int cntDuplicates = 0;
+	for (size_t u = 0; u < dwarfUnits.size(); u++)
+	{
+		const unsigned long long* hashes = unitHashes[u].data();
+		dwarfUnits[u].firstTypeID = typeID;
+		const size_t endNode = u + 1 < dwarfUnits.size() ? dwarfUnits[u + 1].firstNode : dwarfTree.count();
+		for (size_t n = dwarfUnits[u].firstNode; n < endNode; n++)
 		{
-			DWARF_InfoData& id = *node;
-
-			// Initialize the head of the DWARF DIE list the first time.
-			if (!dwarfHead) {
-				dwarfHead = node;
-			}
-
-			if (!setFirstNode) {
-				firstNode = node;
-				setFirstNode = true;
-			}
-
-			if (debug & DbgDwarfTagRead)
-				fprintf(stderr, "%s:%d: 0x%08x, level = %d, id.code = %d, id.tag = %d\n", __FUNCTION__, __LINE__,
-						cursor.entryOff, cursor.level, id.code, id.tag);
-
-			// Insert the node into the entryPtr-based index.
-			mapEntryPtrToEntry[node->entryPtr] = node;
-
-			// Insert named nodes into the name-based index.
-			if (node->name) {
-				mapEntryNameToEntries.insert({ node->name, node });
-			}
-
-			switch (id.tag)
+			DWARF_Node* node = &dwarfTree.at(n);
+			switch (node->tag)
 			{
 				case DW_TAG_structure_type:
 				case DW_TAG_class_type:
 				case DW_TAG_union_type:
+				case DW_TAG_enumeration_type:
 					// skip generating a typeID for declaration flavor of
 					// class/struct/union since we don't emit the PDB symbol
 					// for them. See related code in CV2PDB::createTypes().
-					if (id.isDecl) continue; 
+					if (node->isDecl && node->tag != DW_TAG_enumeration_type)
+						continue;
+					if (isSharedDWARFDefinition(node))
+					{
+						auto ins = representatives.emplace(*hashes++, node);
+						if (!ins.second && sameDWARFScope(ins.first->second, node) &&
+							sameDWARFStructure(ins.first->second, node))
+						{
+							node->typeID = ins.first->second->typeID;
+							node->isDuplicate = true;
+							cntDuplicates++;
+							continue;
+						}
+					}
+					// fall through
 				case DW_TAG_base_type:
 				case DW_TAG_typedef:
 				case DW_TAG_pointer_type:
@@ -1758,7 +2201,6 @@ bool CV2PDB::mapTypes()
 				case DW_TAG_array_type:
 				case DW_TAG_const_type:
 				case DW_TAG_reference_type:
-				case DW_TAG_enumeration_type:
 				case DW_TAG_string_type:
 				case DW_TAG_ptr_to_member_type:
 				case DW_TAG_set_type:
@@ -1773,283 +2215,871 @@ bool CV2PDB::mapTypes()
 				case DW_TAG_mutable_type: // withdrawn
 				case DW_TAG_shared_type:
 				case DW_TAG_rvalue_reference_type:
-					// Reserve a typeID and store it in the map for quick lookup.
-					mapEntryPtrToTypeID.insert(std::make_pair(id.entryPtr, typeID));
-					typeID++;
+					// Reserve a typeID and store it in the node for quick lookup.
+					node->typeID = typeID++;
+
+					// The first definition is used for all equivalent declarations,
+					// others are only added if their scope differs on a hash collision.
+					if (node->name && !node->isDecl)
+					{
+						unsigned long long hash = hashDWARFScope(node);
+						auto range = mapScopeToDefinition.equal_range(hash);
+						auto it = range.first;
+						while (it != range.second && !sameDWARFScope(it->second, node))
+							++it;
+						if (it == range.second)
+							mapScopeToDefinition.emplace(hash, node);
+					}
 			}
 		}
 	}
 
+	// Map the declarations to the type of their definition, so that
+	// getTypeByDWARFPtr doesn't have to search for it on every reference.
+	for (const DWARF_Node* decl : declarations)
+	{
+		auto range = mapScopeToDefinition.equal_range(hashDWARFScope(decl));
+		for (auto it = range.first; it != range.second; ++it)
+			if (sameDWARFScope(it->second, decl))
+			{
+				mapDeclPtrToTypeID.insert(std::make_pair(decl->entryPtr, it->second->typeID));
+				break;
+			}
+	}
+
+	int cntDerived = 0;
+	typeID = foldDWARFDerivedTypes(typeID, cntDerived);
+
 	if (debug & DbgBasic)
-		fprintf(stderr, "%s:%d: mapped %zd types\n", __FUNCTION__, __LINE__, mapEntryPtrToTypeID.size());
+	{
+		fprintf(stderr, "%s:%d: mapped %d types\n", __FUNCTION__, __LINE__, typeID - nextUserType);
+		fprintf(stderr, "%s:%d: DIE tree: %zd nodes, %zd KB (%zd KB with full entries)\n", __FUNCTION__, __LINE__,
+				dwarfTree.count(), dwarfTree.bytes() / 1024, dwarfTree.count() * sizeof(DWARF_InfoData) / 1024);
+		fprintf(stderr, "%s:%d: resolved %zd of %zd declarations\n", __FUNCTION__, __LINE__,
+				mapDeclPtrToTypeID.size(), declarations.size());
+		fprintf(stderr, "%s:%d: unified %d duplicate type definitions\n", __FUNCTION__, __LINE__, cntDuplicates);
+		fprintf(stderr, "%s:%d: unified %d duplicate derived types\n", __FUNCTION__, __LINE__, cntDerived);
+	}
 
-	nextDwarfType = typeID;
-	assert(nextDwarfType == nextUserType + mapEntryPtrToTypeID.size());
+	nextDwarfType = firstDwarfType = typeID;
 	return true;
 }
 
-// Walks the .debug_info section and builds a DIE tree.
-bool CV2PDB::createTypes()
+// Compute hashDWARFStructure for the shared definitions of each unit, in
+// the order of the nodes. The units are hashed on up to numThreads threads,
+// as this reads the DIEs of all members again.
+std::vector<std::vector<unsigned long long>> CV2PDB::hashDWARFDefinitions() const
 {
-	img.createSymbolCache();
-	if (&img != imgDbg)
-		imgDbg->createSymbolCache();
-	mspdb::Mod* mod = globalMod();
-	int firstUserType = nextUserType;
-	int typeID = nextUserType;
-	int pointerAttr = img.isX64() ? 0x1000C : 0x800A;
-
-	if (debug & DbgBasic)
-		fprintf(stderr, "%s:%d: createTypes()\n", __FUNCTION__, __LINE__);
+	const size_t cntUnits = dwarfUnits.size();
+	std::vector<std::vector<unsigned long long>> unitHashes(cntUnits);
+	std::atomic<size_t> nextUnit(0);
 
-	unsigned long off = 0;
-
-	// Scan each compilation unit in '.debug_info'.
-	while (off < imgDbg->debug_info.length)
+	auto hashUnits = [&]()
 	{
-		DWARF_CompilationUnitInfo cu{};
+		for (size_t u = nextUnit++; u < cntUnits; u = nextUnit++)
+		{
+			const size_t endNode = u + 1 < cntUnits ? dwarfUnits[u + 1].firstNode : dwarfTree.count();
+			for (size_t n = dwarfUnits[u].firstNode; n < endNode; n++)
+			{
+				const DWARF_Node* node = &dwarfTree.at(n);
+				if (isSharedDWARFDefinition(node))
+					unitHashes[u].push_back(hashDWARFStructure(node, 2));
+			}
+		}
+	};
 
-		// Read the next compilation unit from 'off' and update it to the next
-		// CU, returning the pointer just beyond the header to the first DIE.
-		byte* ptr = cu.read(debug, *imgDbg, &off);
-		if (!ptr)
-			continue;
+	const size_t cntThreads = (size_t)numThreads < cntUnits ? numThreads : cntUnits;
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < cntThreads; t++)
+		threads.emplace_back(hashUnits);
+	hashUnits();
+	for (std::thread& t : threads)
+		t.join();
 
-		if (cu.unit_type != DW_UT_compile) {
-			if (debug & DbgDwarfCompilationUnit)
-				fprintf(stderr, "%s:%d: skipping compilation unit offs=%x, unit_type=%d\n", __FUNCTION__, __LINE__,
-						cu.cu_offset, cu.unit_type);
+	return unitHashes;
+}
 
-			continue;
-		}
+// Check whether the definitions with equal hashDWARFStructure have the same
+// size and members, to rule out hash collisions.
+bool CV2PDB::sameDWARFStructure(const DWARF_Node* a, const DWARF_Node* b) const
+{
+	DWARF_InfoData ida, idb;
+	if (!readDWARFEntry(a, ida) || !readDWARFEntry(b, idb) || ida.byte_size != idb.byte_size)
+		return false;
+
+	const DWARF_Node* ca = a->children;
+	const DWARF_Node* cb = b->children;
+	for (; ca && cb; ca = ca->next, cb = cb->next)
+	{
+		if (ca->tag != cb->tag)
+			return false;
+		if (ca->name != cb->name && (!ca->name || !cb->name || strcmp(ca->name, cb->name)))
+			return false;
+	}
+	return !ca && !cb;
+}
 
-		DIECursor cursor(&cu, ptr);
+// Hash of a struct, class, union or enum definition, including its scope,
+// size and members. Referenced types are identified by their name and scope,
+// unnamed ones are followed up to the given depth.
+unsigned long long CV2PDB::hashDWARFStructure(const DWARF_Node* node, int depth) const
+{
+	DWARF_InfoData id;
+	unsigned long long hash = hashDWARFScope(node);
+	if (readDWARFEntry(node, id))
+		hash = (hash ^ id.byte_size) * 1099511628211ull;
 
-		DWARF_InfoData* node = nullptr;
-		bool setFirstNode = false;
-		DWARF_InfoData id;
+	for (const DWARF_Node* child = node->children; child; child = child->next)
+	{
+		hash = (hash ^ child->tag) * 1099511628211ull;
+		if (child->name)
+			for (const unsigned char* p = (const unsigned char*)child->name; *p; p++)
+				hash = (hash ^ *p) * 1099511628211ull;
+		hash = (hash ^ 0xff) * 1099511628211ull;
 
-		// Scan the DIEs in this CU, reusing the elements.
-		while (cursor.readNext(&id))
+		switch (child->tag)
 		{
-			if (debug & DbgDwarfTagRead)
-				fprintf(stderr, "%s:%d: 0x%08x, level = %d, id.code = %d, id.tag = %d\n", __FUNCTION__, __LINE__,
-						cursor.entryOff, cursor.level, id.code, id.tag);
-
-			// Merge in related entries. This relies on the DWARF tree having been built
-			// in the first pass (mapTypes).
-			if (id.abstract_origin)
-				mergeAbstractOrigin(id, *this);
-			if (id.specification)
-				mergeSpecification(id, *this);
-
-			int cvtype = -1;
-			switch (id.tag)
+		case DW_TAG_member:
+		case DW_TAG_inheritance:
+			if (readDWARFEntry(child, id))
 			{
-			case DW_TAG_base_type:
-				cvtype = addDWARFBasicType(id.name, id.encoding, id.byte_size);
-				break;
-			case DW_TAG_typedef:
-				cvtype = appendModifierType(getTypeByDWARFPtr(id.type), 0);
-				addUdtSymbol(cvtype, id.name);
-				break;
-			case DW_TAG_pointer_type:
-				cvtype = appendPointerType(getTypeByDWARFPtr(id.type), pointerAttr);
-				break;
-			case DW_TAG_const_type:
-				cvtype = appendModifierType(getTypeByDWARFPtr(id.type), 1);
-				break;
-			case DW_TAG_reference_type:
-				cvtype = appendPointerType(getTypeByDWARFPtr(id.type), pointerAttr | 0x20);
-				break;
+				Location loc = decodeLocation(id.member_location, 0, DW_AT_data_member_location);
+				hash = (hash ^ loc.type) * 1099511628211ull;
+				hash = (hash ^ (unsigned)loc.off) * 1099511628211ull;
+			}
+			hash = (hash ^ hashDWARFTypeRef(child->type, depth)) * 1099511628211ull;
+			break;
+		case DW_TAG_enumerator:
+			if (readDWARFEntry(child, id))
+				hash = (hash ^ id.const_value) * 1099511628211ull;
+			break;
+		}
+	}
+	return hash;
+}
 
-			case DW_TAG_subrange_type:
-				// It seems we cannot materialize bounds for scalar types in
-				// CodeView, so just redirect to a mere base type.
-				cvtype = appendModifierType(getTypeByDWARFPtr(id.type), 0);
-				break;
+unsigned long long CV2PDB::hashDWARFTypeRef(byte* typePtr, int depth) const
+{
+	const DWARF_Node* node = typePtr ? findEntryByPtr(typePtr) : nullptr;
+	if (!node)
+		return 0;
+	if (node->name)
+		return hashDWARFScope(node);
 
-			case DW_TAG_class_type:
-			case DW_TAG_structure_type:
-			case DW_TAG_union_type:
-				if (!id.isDecl) {
-					// Only export the non-declaration version of structs/classes.
-					// DWARF emits multiple copies of the same class, some of
-					// which are marked as declarations and lack members, resulting
-					// in an empty struct UDT in the PDB. Then when we encounter
-					// the non-declaration copy we emit it again, but now we
-					// end up with multiple copies of the same UDT in the PDB
-					// and the debugger gets confused.
-					cvtype = addDWARFStructure(id, cursor);
-				}
-				break;
-			case DW_TAG_array_type:
-				cvtype = addDWARFArray(id, cursor);
-				break;
+	unsigned long long hash = 14695981039346656037ull;
+	hash = (hash ^ node->tag) * 1099511628211ull;
+	if (depth <= 0)
+		return hash;
 
-			case DW_TAG_enumeration_type:
-				cvtype = addDWARFEnum(id, cursor);
-				break;
+	switch (node->tag)
+	{
+	case DW_TAG_structure_type:
+	case DW_TAG_class_type:
+	case DW_TAG_union_type:
+	case DW_TAG_enumeration_type:
+		return hashDWARFStructure(node, depth - 1);
+	case DW_TAG_array_type:
+		for (const DWARF_Node* child = node->children; child; child = child->next)
+		{
+			DWARF_InfoData id;
+			if (child->tag == DW_TAG_subrange_type && readDWARFEntry(child, id))
+			{
+				hash = (hash ^ id.lower_bound) * 1099511628211ull;
+				hash = (hash ^ id.upper_bound) * 1099511628211ull;
+			}
+		}
+		break;
+	}
+	return (hash ^ hashDWARFTypeRef(node->type, depth - 1)) * 1099511628211ull;
+}
+
+// Key of the record converted from a DIE that only refers to other types,
+// see foldDWARFDerivedType. Equal keys result in identical records and UDT
+// symbols.
+struct DWARF_DerivedKey
+{
+	enum Kind { Pointer, Modifier, Basic, Array };
+
+	int kind;
+	int type;           // referenced type ID, see getDerivedDWARFTypeRef
+	int attr;           // pointer or modifier attributes, encoding or index type
+	long lower;         // array bounds
+	long upper;
+	unsigned long size; // size of base types and array elements
+	const char* name;   // name of the UDT symbol added
+
+	bool operator==(const DWARF_DerivedKey& other) const
+	{
+		return kind == other.kind && type == other.type && attr == other.attr &&
+			lower == other.lower && upper == other.upper && size == other.size &&
+			(name == other.name || (name && other.name && strcmp(name, other.name) == 0));
+	}
+};
 
-			case DW_TAG_subroutine_type:
-			case DW_TAG_string_type:
-			case DW_TAG_ptr_to_member_type:
-			case DW_TAG_set_type:
-			case DW_TAG_file_type:
-			case DW_TAG_packed_type:
-			case DW_TAG_thrown_type:
-			case DW_TAG_volatile_type:
-			case DW_TAG_restrict_type: // DWARF3
-			case DW_TAG_interface_type:
-			case DW_TAG_unspecified_type:
-			case DW_TAG_mutable_type: // withdrawn
-			case DW_TAG_shared_type:
-			case DW_TAG_rvalue_reference_type:
-				cvtype = appendPointerType(0x74, pointerAttr);
+struct DWARF_DerivedKeyHash
+{
+	size_t operator()(const DWARF_DerivedKey& key) const
+	{
+		unsigned long long hash = 14695981039346656037ull;
+		hash = (hash ^ key.kind) * 1099511628211ull;
+		hash = (hash ^ (unsigned)key.type) * 1099511628211ull;
+		hash = (hash ^ (unsigned)key.attr) * 1099511628211ull;
+		hash = (hash ^ (unsigned long)key.lower) * 1099511628211ull;
+		hash = (hash ^ (unsigned long)key.upper) * 1099511628211ull;
+		hash = (hash ^ key.size) * 1099511628211ull;
+		if (key.name)
+			for (const unsigned char* p = (const unsigned char*)key.name; *p; p++)
+				hash = (hash ^ *p) * 1099511628211ull;
+		return (size_t)hash;
+	}
+};
+
+struct CV2PDB::DWARF_DerivedTypes
+{
+	int firstTypeID;
+	std::vector<char> state;            // by reserved type ID: 0 new, 1 visiting, 2 done
+	std::vector<int> lowerBounds;       // default lower bound by unit, -1 if not read yet
+	std::unordered_map<DWARF_DerivedKey, int, DWARF_DerivedKeyHash> types;
+	int cntFolded = 0;
+};
+
+// Pointers, modifiers, typedefs, subranges, arrays and base types are
+// repeated in every unit using them, e.g. one "const int*" per unit. Their
+// records only depend on the types they refer to, so mapTypes lets equal
+// ones share a single type ID and converts them only once, the same as
+// duplicate struct definitions. The type IDs reserved up to endTypeID are then
+// renumbered without the folded ones.
+int CV2PDB::foldDWARFDerivedTypes(int endTypeID, int& cntFolded)
+{
+	DWARF_DerivedTypes derived;
+	derived.firstTypeID = nextUserType;
+	derived.state.resize(endTypeID - nextUserType, 0);
+	derived.lowerBounds.resize(dwarfUnits.size(), -1);
+
+	const size_t cntNodes = dwarfTree.count();
+	for (size_t n = 0; n < cntNodes; n++)
+	{
+		DWARF_Node* node = &dwarfTree.at(n);
+		if (node->typeID && !node->isDuplicate)
+			foldDWARFDerivedType(node, derived);
+	}
+	cntFolded = derived.cntFolded;
+	if (!cntFolded)
+		return endTypeID;
+
+	// Renumber the remaining types in the order of their nodes, as
+	// createUnitTypes converts them.
+	std::vector<int> typeMap(endTypeID - nextUserType, 0);
+	int typeID = nextUserType;
+	for (size_t u = 0; u < dwarfUnits.size(); u++)
+	{
+		dwarfUnits[u].firstTypeID = typeID;
+		const size_t endNode = u + 1 < dwarfUnits.size() ? dwarfUnits[u + 1].firstNode : cntNodes;
+		for (size_t n = dwarfUnits[u].firstNode; n < endNode; n++)
+		{
+			const DWARF_Node& node = dwarfTree.at(n);
+			if (node.typeID && !node.isDuplicate)
+				typeMap[node.typeID - nextUserType] = typeID++;
+		}
+	}
+	for (size_t n = 0; n < cntNodes; n++)
+	{
+		DWARF_Node& node = dwarfTree.at(n);
+		if (node.typeID)
+			node.typeID = typeMap[node.typeID - nextUserType];
+	}
+	for (auto& decl : mapDeclPtrToTypeID)
+		decl.second = typeMap[decl.second - nextUserType];
+	return typeID;
+}
+
+// Type ID of a DW_AT_type reference as returned by getTypeByDWARFPtr, with
+// the derived type it refers to folded first.
+int CV2PDB::getDerivedDWARFTypeRef(byte* typePtr, DWARF_DerivedTypes& derived)
+{
+	DWARF_Node* node = typePtr ? findEntryByPtr(typePtr) : nullptr;
+	if (!node)
+		return T_NOTYPE;
+	if (!node->typeID)
+	{
+		auto it = mapDeclPtrToTypeID.find(typePtr);
+		return it != mapDeclPtrToTypeID.end() ? it->second : T_NOTYPE;
+	}
+	if (!node->isDuplicate)
+		foldDWARFDerivedType(node, derived);
+	return node->typeID;
+}
+
+// If the node is a derived type with the same record as one folded before,
+// make it a duplicate of that one. The types it refers to are folded first.
+void CV2PDB::foldDWARFDerivedType(DWARF_Node* node, DWARF_DerivedTypes& derived)
+{
+	char& state = derived.state[node->typeID - derived.firstTypeID];
+	if (state)
+		return; // done, or a cycle through this node, which is not folded
+	state = 1;
+
+	DWARF_DerivedKey key{};
+	DWARF_InfoData id;
+	switch (node->tag)
+	{
+	case DW_TAG_base_type:
+		if (!readDWARFEntry(node, id))
+			break;
+		key.kind = DWARF_DerivedKey::Basic;
+		key.attr = id.encoding;
+		key.size = id.byte_size;
+		key.name = node->name;
+		break;
+	case DW_TAG_typedef:
+		key.kind = DWARF_DerivedKey::Modifier;
+		key.type = getDerivedDWARFTypeRef(node->type, derived);
+		key.name = node->name;
+		break;
+	case DW_TAG_const_type:
+		key.kind = DWARF_DerivedKey::Modifier;
+		key.type = getDerivedDWARFTypeRef(node->type, derived);
+		key.attr = 1;
+		break;
+	case DW_TAG_subrange_type:
+		key.kind = DWARF_DerivedKey::Modifier;
+		key.type = getDerivedDWARFTypeRef(node->type, derived);
+		break;
+	case DW_TAG_pointer_type:
+		key.kind = DWARF_DerivedKey::Pointer;
+		key.type = getDerivedDWARFTypeRef(node->type, derived);
+		break;
+	case DW_TAG_reference_type:
+		key.kind = DWARF_DerivedKey::Pointer;
+		key.type = getDerivedDWARFTypeRef(node->type, derived);
+		key.attr = 0x20;
+		break;
+	case DW_TAG_array_type:
+	{
+		// see addDWARFArray, only the first subrange is converted
+		int& lowerBound = derived.lowerBounds[node->unit];
+		if (lowerBound < 0)
+		{
+			const DWARF_Node& unit = dwarfTree.at(dwarfUnits[node->unit].firstNode);
+			lowerBound = readDWARFEntry(&unit, id) ? getDWARFDefaultLowerBound(id.language) : 0;
+		}
+		key.kind = DWARF_DerivedKey::Array;
+		key.type = getDerivedDWARFTypeRef(node->type, derived);
+		key.attr = T_INT4;
+		key.lower = key.upper = lowerBound;
+		for (const DWARF_Node* child = node->children; child; child = child->next)
+		{
+			if (child->tag != DW_TAG_subrange_type)
+				continue;
+			if (!readDWARFEntry(child, id))
+			{
+				key.kind = -1;
 				break;
+			}
+			key.attr = getDerivedDWARFTypeRef(child->type, derived);
+			key.lower = id.has_lower_bound ? id.lower_bound : lowerBound;
+			key.upper = id.upper_bound;
+			break;
+		}
+		if (node->type)
+		{
+			DWARF_CompilationUnitInfo cu = dwarfUnits[node->unit].cu;
+			DIECursor cursor(*dwarfContext, &cu, node->entryPtr);
+			key.size = getDWARFTypeSize(cursor, node->type);
+		}
+		break;
+	}
+	case DW_TAG_subroutine_type:
+	case DW_TAG_string_type:
+	case DW_TAG_ptr_to_member_type:
+	case DW_TAG_set_type:
+	case DW_TAG_file_type:
+	case DW_TAG_packed_type:
+	case DW_TAG_thrown_type:
+	case DW_TAG_volatile_type:
+	case DW_TAG_restrict_type:
+	case DW_TAG_interface_type:
+	case DW_TAG_unspecified_type:
+	case DW_TAG_mutable_type:
+	case DW_TAG_shared_type:
+	case DW_TAG_rvalue_reference_type:
+		// converted to a placeholder pointer, see createUnitTypes
+		key.kind = DWARF_DerivedKey::Pointer;
+		key.type = 0x74;
+		break;
+	default:
+		key.kind = -1; // structs, unions and enums are folded by mapTypes
+	}
 
-			case DW_TAG_subprogram:
-				if (id.name)
+	if (key.kind >= 0)
+	{
+		auto ins = derived.types.emplace(key, node->typeID);
+		if (!ins.second)
+		{
+			node->typeID = ins.first->second;
+			node->isDuplicate = true;
+			derived.cntFolded++;
+		}
+	}
+	state = 2;
+}
+
+// Walks the compilation units found by mapTypes and emits the types and
+// symbols.
+bool CV2PDB::createTypes()
+{
+	if (debug & DbgBasic)
+		fprintf(stderr, "%s:%d: createTypes()\n", __FUNCTION__, __LINE__);
+
+	// only global variables of imgDbg are looked up by symbol name
+	auto start = std::chrono::steady_clock::now();
+	imgDbg->createSymbolCache();
+	if (debug & DbgBasic)
+		fprintf(stderr, "%s:%d: symbol cache built in %d ms\n", __FUNCTION__, __LINE__,
+				(int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+	if (numThreads > 1 && dwarfUnits.size() > 1)
+	{
+		if (!createTypesParallel())
+			return false;
+	}
+	else
+	{
+		for (unsigned int u = 0; u < dwarfUnits.size(); u++)
+		{
+			assert(dwarfUnits[u].firstTypeID == nextUserType);
+			if (!createUnitTypes(u))
+				return false;
+		}
+	}
+
+	assert(nextUserType == firstDwarfType);
+
+	if (debug & DbgBasic)
+		fprintf(stderr, "%s:%d: folded %d duplicate type records (%d bytes)\n", __FUNCTION__, __LINE__,
+				cntFoldedDwarfTypes, cbFoldedDwarfTypes);
+	return true;
+}
+
+// Convert the compilation units on multiple threads. As mapTypes has already
+// reserved the type IDs of each unit, they can be converted independently by
+// separate contexts. Their output is then merged in the original order, so
+// the result is the same as with the serial conversion.
+bool CV2PDB::createTypesParallel()
+{
+	const size_t cntUnits = dwarfUnits.size();
+	std::vector<std::unique_ptr<CV2PDB>> units(cntUnits);
+	std::vector<char> unitOk(cntUnits, false);
+	std::atomic<size_t> nextUnit(0);
+
+	auto convertUnits = [&]()
+	{
+		for (size_t u = nextUnit++; u < cntUnits; u = nextUnit++)
+		{
+			units[u] = std::make_unique<CV2PDB>(*this, dwarfUnits[u].firstTypeID);
+			unitOk[u] = units[u]->createUnitTypes((unsigned int)u);
+		}
+	};
+
+	size_t cntThreads = (size_t)numThreads < cntUnits ? numThreads : cntUnits;
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < cntThreads; t++)
+		threads.emplace_back(convertUnits);
+	convertUnits();
+	for (std::thread& t : threads)
+		t.join();
+
+	if (debug & DbgBasic)
+		fprintf(stderr, "%s:%d: converted %zd units on %zd threads\n", __FUNCTION__, __LINE__, cntUnits, cntThreads);
+
+	for (size_t u = 0; u < cntUnits; u++)
+	{
+		if (!unitOk[u])
+			return setError(units[u]->hadError() ? units[u]->getLastError() : "cannot convert compilation unit");
+		if (!mergeUnitTypes(*units[u]))
+			return false;
+		units[u].reset();
+	}
+	return true;
+}
+
+// Append the output of a worker context to this context. The type IDs
+// reserved by mapTypes are already final, but the records added to
+// dwarfTypes are numbered as if the unit was the first one. They are
+// appended one by one and folded with the identical records of the units
+// merged before, as in the serial conversion, and the references to them
+// are mapped to their final type index.
+bool CV2PDB::mergeUnitTypes(CV2PDB& unit)
+{
+	assert(unit.dwarfParent == this);
+
+	// Final type index of the records in unit.dwarfTypes. Only the records
+	// kept by foldDWARFType in the unit are folded, the others (continued
+	// enum field lists) are never folded and can refer to later records.
+	const int cntTypes = unit.nextDwarfType - unit.firstDwarfType;
+	std::vector<int> typeMap(cntTypes, 0);
+	std::vector<char> foldable(cntTypes, false);
+	for (const auto& hash : unit.dwarfTypeHashes)
+		foldable[hash.second.second - unit.firstDwarfType] = true;
+
+	auto mapType = [&](unsigned int* field)
+	{
+		if (*field >= (unsigned int)unit.firstDwarfType)
+		{
+			assert(typeMap[*field - unit.firstDwarfType]);
+			*field = typeMap[*field - unit.firstDwarfType];
+		}
+	};
+
+	// The references within dwarfTypes by record.
+	std::vector<int> recordRefs;
+	for (const std::pair<int, int>& ref : unit.dwarfTypeRefs)
+		if (ref.first == kDwarfTypes)
+			recordRefs.push_back(ref.second);
+	std::sort(recordRefs.begin(), recordRefs.end());
+
+	// References of the records not folded, mapped once all records are.
+	std::vector<int> laterRefs;
+
+	checkDWARFTypeAlloc(unit.cbDwarfTypes);
+	size_t r = 0;
+	int off = 0;
+	for (int t = 0; t < cntTypes; t++)
+	{
+		const codeview_type* rec = (const codeview_type*)(unit.dwarfTypes + off);
+		const int len = rec->generic.len + 2;
+		const int recOff = cbDwarfTypes;
+		memcpy(dwarfTypes + recOff, rec, len);
+		cbDwarfTypes += len;
+		for (; r < recordRefs.size() && recordRefs[r] < off + len; r++)
+		{
+			if (foldable[t])
+				mapType((unsigned int*)(dwarfTypes + recOff + recordRefs[r] - off));
+			else
+				laterRefs.push_back(recOff + recordRefs[r] - off);
+		}
+		typeMap[t] = foldable[t] ? foldDWARFType(recOff, nextDwarfType++) : nextDwarfType++;
+		off += len;
+	}
+	assert(off == unit.cbDwarfTypes);
+	for (int fieldOff : laterRefs)
+		mapType((unsigned int*)(dwarfTypes + fieldOff));
+
+	for (const std::pair<int, int>& ref : unit.dwarfTypeRefs)
+	{
+		if (ref.first == kUserTypes)
+			mapType((unsigned int*)(unit.userTypes + ref.second));
+		else if (ref.first == kUdtSymbols)
+			mapType((unsigned int*)(unit.udtSymbols + ref.second));
+	}
+
+	if (unit.cbUserTypes)
+	{
+		checkUserTypeAlloc(unit.cbUserTypes);
+		memcpy(userTypes + cbUserTypes, unit.userTypes, unit.cbUserTypes);
+		cbUserTypes += unit.cbUserTypes;
+	}
+	if (unit.cbUdtSymbols)
+	{
+		checkUdtSymbolAlloc(unit.cbUdtSymbols);
+		memcpy(udtSymbols + cbUdtSymbols, unit.udtSymbols, unit.cbUdtSymbols);
+		cbUdtSymbols += unit.cbUdtSymbols;
+	}
+	nextUserType = unit.nextUserType;
+	cntFoldedDwarfTypes += unit.cntFoldedDwarfTypes;
+	cbFoldedDwarfTypes += unit.cbFoldedDwarfTypes;
+
+	mspdb::Mod* mod = globalMod();
+	for (const DeferredModCall& call : unit.deferredModCalls)
+	{
+		if (call.name)
+		{
+			int type = call.type >= unit.firstDwarfType ? typeMap[call.type - unit.firstDwarfType] : call.type;
+			addDWARFPublic(call.name, call.seg, call.off, type);
+		}
+		else if (!addDWARFSectionContrib(mod, call.off, call.off + call.len))
+			return false;
+	}
+	return true;
+}
+
+// Returns whether createUnitTypes converts DIEs with the given tag. Other
+// DIEs (members, parameters, enumerators, scopes) are only read as children
+// of the DIEs they belong to.
+static bool isConvertedDWARFTag(unsigned int tag)
+{
+	switch (tag)
+	{
+	case DW_TAG_base_type:
+	case DW_TAG_typedef:
+	case DW_TAG_pointer_type:
+	case DW_TAG_const_type:
+	case DW_TAG_reference_type:
+	case DW_TAG_subrange_type:
+	case DW_TAG_class_type:
+	case DW_TAG_structure_type:
+	case DW_TAG_union_type:
+	case DW_TAG_array_type:
+	case DW_TAG_enumeration_type:
+	case DW_TAG_subroutine_type:
+	case DW_TAG_string_type:
+	case DW_TAG_ptr_to_member_type:
+	case DW_TAG_set_type:
+	case DW_TAG_file_type:
+	case DW_TAG_packed_type:
+	case DW_TAG_thrown_type:
+	case DW_TAG_volatile_type:
+	case DW_TAG_restrict_type:
+	case DW_TAG_interface_type:
+	case DW_TAG_unspecified_type:
+	case DW_TAG_mutable_type:
+	case DW_TAG_shared_type:
+	case DW_TAG_rvalue_reference_type:
+	case DW_TAG_subprogram:
+	case DW_TAG_compile_unit:
+	case DW_TAG_type_unit:
+	case DW_TAG_partial_unit:
+	case DW_TAG_variable:
+		return true;
+	}
+	return false;
+}
+
+// Convert the types and symbols of a single compilation unit. Instead of
+// scanning .debug_info again, this walks the nodes of the unit in the tree
+// built by mapTypes and only decodes the attributes of the DIEs it converts.
+bool CV2PDB::createUnitTypes(unsigned int unit)
+{
+	const CV2PDB* context = dwarfParent ? dwarfParent : this;
+	const DWARF_NodeArena& tree = context->dwarfTree;
+	const size_t firstNode = context->dwarfUnits[unit].firstNode;
+	const size_t endNode = unit + 1 < context->dwarfUnits.size() ? context->dwarfUnits[unit + 1].firstNode : tree.count();
+
+	mspdb::Mod* mod = dwarfParent ? nullptr : globalMod();
+	int typeID = nextUserType;
+	int pointerAttr = img.isX64() ? 0x1000C : 0x800A;
+
+	// Use a copy of the unit, as reading the DIEs can update it.
+	DWARF_CompilationUnitInfo cu = context->dwarfUnits[unit].cu;
+	DIECursor cursor(*context->dwarfContext, &cu, nullptr);
+	DWARF_InfoData id;
+
+	// Visit the DIEs of this CU in their physical order, reusing the elements.
+	for (size_t n = firstNode; n < endNode; n++)
+	{
+		const DWARF_Node& node = tree.at(n);
+		if (debug & DbgDwarfTagRead)
+			fprintf(stderr, "%s:%d: 0x%08x, tag = %d\n", __FUNCTION__, __LINE__, node.entryOff, node.tag);
+
+		// Duplicate definitions use the type converted for the first one.
+		if (!isConvertedDWARFTag(node.tag) || node.isDuplicate)
+			continue;
+
+		cursor.gotoEntry(node.entryPtr);
+		if (!cursor.readNext(&id))
+			return setError("cannot read DWARF entry");
+
+		// Merge in related entries. This relies on the DWARF tree having been built
+		// in the first pass (mapTypes).
+		if (id.abstract_origin)
+			mergeAbstractOrigin(id, *this);
+		if (id.specification)
+			mergeSpecification(id, *this);
+
+		int cvtype = -1;
+		switch (id.tag)
+		{
+		case DW_TAG_base_type:
+			cvtype = addDWARFBasicType(id.name, id.encoding, id.byte_size);
+			break;
+		case DW_TAG_typedef:
+			cvtype = appendModifierType(getTypeByDWARFPtr(id.type), 0);
+			addUdtSymbol(cvtype, id.name);
+			break;
+		case DW_TAG_pointer_type:
+			cvtype = appendPointerType(getTypeByDWARFPtr(id.type), pointerAttr);
+			break;
+		case DW_TAG_const_type:
+			cvtype = appendModifierType(getTypeByDWARFPtr(id.type), 1);
+			break;
+		case DW_TAG_reference_type:
+			cvtype = appendPointerType(getTypeByDWARFPtr(id.type), pointerAttr | 0x20);
+			break;
+
+		case DW_TAG_subrange_type:
+			// It seems we cannot materialize bounds for scalar types in
+			// CodeView, so just redirect to a mere base type.
+			cvtype = appendModifierType(getTypeByDWARFPtr(id.type), 0);
+			break;
+
+		case DW_TAG_class_type:
+		case DW_TAG_structure_type:
+		case DW_TAG_union_type:
+			if (!id.isDecl) {
+				// Only export the non-declaration version of structs/classes.
+				// DWARF emits multiple copies of the same class, some of
+				// which are marked as declarations and lack members, resulting
+				// in an empty struct UDT in the PDB. Then when we encounter
+				// the non-declaration copy we emit it again, but now we
+				// end up with multiple copies of the same UDT in the PDB
+				// and the debugger gets confused.
+				cvtype = addDWARFStructure(id, cursor);
+			}
+			break;
+		case DW_TAG_array_type:
+			cvtype = addDWARFArray(id, cursor);
+			break;
+
+		case DW_TAG_enumeration_type:
+			cvtype = addDWARFEnum(id, cursor);
+			break;
+
+		case DW_TAG_subroutine_type:
+		case DW_TAG_string_type:
+		case DW_TAG_ptr_to_member_type:
+		case DW_TAG_set_type:
+		case DW_TAG_file_type:
+		case DW_TAG_packed_type:
+		case DW_TAG_thrown_type:
+		case DW_TAG_volatile_type:
+		case DW_TAG_restrict_type: // DWARF3
+		case DW_TAG_interface_type:
+		case DW_TAG_unspecified_type:
+		case DW_TAG_mutable_type: // withdrawn
+		case DW_TAG_shared_type:
+		case DW_TAG_rvalue_reference_type:
+			cvtype = appendPointerType(0x74, pointerAttr);
+			break;
+
+		case DW_TAG_subprogram:
+			if (id.name)
+			{
+				std::vector<RangeEntry> ranges = getRanges(cursor, id);
+				if (!ranges.empty())
 				{
-					std::vector<RangeEntry> ranges = getRanges(cursor, id);
-					if (!ranges.empty())
+					if (!id.is_artificial)
 					{
-						if (!id.is_artificial)
-						{
-							std::uint64_t entry_point = ranges.front().pclo;
-							if (debug & DbgPdbSyms)
-								fprintf(stderr, "%s:%d: Adding a public: %s at %llx\n", __FUNCTION__, __LINE__, id.name, entry_point);
+						std::uint64_t entry_point = ranges.front().pclo;
+						if (debug & DbgPdbSyms)
+							fprintf(stderr, "%s:%d: Adding a public: %s at %llx\n", __FUNCTION__, __LINE__, id.name, entry_point);
 
-							mod->AddPublic2(id.name, img.text.secNo + 1, entry_point - codeSegOff, 0);
-						}
+						addDWARFPublic(id.name, img.text.secNo + 1, entry_point - codeSegOff, 0);
+					}
 
-						// Only add the definition, not declaration, because
-						// MSVC toolset only produces a single symbol for
-						// each function and will get confused if there are
-						// 2 PDB symbols for the same routine.
-						//
-						// TODO: Add more type info to the routine. Today we
-						// expose it as "T_NOTYPE" when we could do better.
-						if (!id.isDecl) {
-							addDWARFProc(id, ranges, cursor);
-						}
+					// Only add the definition, not declaration, because
+					// MSVC toolset only produces a single symbol for
+					// each function and will get confused if there are
+					// 2 PDB symbols for the same routine.
+					//
+					// TODO: Add more type info to the routine. Today we
+					// expose it as "T_NOTYPE" when we could do better.
+					if (!id.isDecl) {
+						addDWARFProc(id, ranges, cursor);
 					}
 				}
-				break;
+			}
+			break;
 
-			case DW_TAG_compile_unit:
-				// Set the implicit base address for range lists.
+		case DW_TAG_type_unit:
+		case DW_TAG_partial_unit:
+		case DW_TAG_compile_unit:
+			// Set the implicit base address for range lists. Split units
+			// inherit it from their skeleton.
+			if (cu.unit_type != DW_UT_split_compile)
 				cu.base_address = id.pclo;
-				switch (id.language)
-				{
-				case DW_LANG_Ada83:
-				case DW_LANG_Cobol74:
-				case DW_LANG_Cobol85:
-				case DW_LANG_Fortran77:
-				case DW_LANG_Fortran90:
-				case DW_LANG_Pascal83:
-				case DW_LANG_Modula2:
-				case DW_LANG_Ada95:
-				case DW_LANG_Fortran95:
-				case DW_LANG_PLI:
-					currentDefaultLowerBound = 1;
-					break;
-
-				default:
-					currentDefaultLowerBound = 0;
-				}
+			currentDefaultLowerBound = getDWARFDefaultLowerBound(id.language);
 #if !FULL_CONTRIB
-				if (id.dir && id.name)
+			if (id.dir && id.name)
+			{
+				if (id.ranges > 0 && id.ranges < imgDbg->debug_ranges.length)
 				{
-					if (id.ranges > 0 && id.ranges < imgDbg->debug_ranges.length)
-					{
-						RangeEntry range;
-						RangeCursor rangeCursor(cursor, id.ranges);
-						while (rangeCursor.readNext(range))
-						{
-							if (debug & DbgPdbContrib)
-								fprintf(stderr, "%s:%d: Adding a section contrib: %I64x-%I64x\n", __FUNCTION__, __LINE__,
-										range.pclo, range.pchi);
-
-							if (!addDWARFSectionContrib(mod, range.pclo, range.pchi))
-								return false;
-						}
-					}
-					else
+					RangeEntry range;
+					RangeCursor rangeCursor(cursor, id.ranges);
+					while (rangeCursor.readNext(range))
 					{
 						if (debug & DbgPdbContrib)
-							fprintf(stderr, "%s:%d: Adding a section contrib: %x-%x\n", __FUNCTION__, __LINE__,
-									id.pclo, id.pchi);
+							fprintf(stderr, "%s:%d: Adding a section contrib: %I64x-%I64x\n", __FUNCTION__, __LINE__,
+									range.pclo, range.pchi);
 
-						if (!addDWARFSectionContrib(mod, id.pclo, id.pchi))
+						if (!addDWARFSectionContrib(mod, range.pclo, range.pchi))
 							return false;
 					}
 				}
+				else
+				{
+					if (debug & DbgPdbContrib)
+						fprintf(stderr, "%s:%d: Adding a section contrib: %x-%x\n", __FUNCTION__, __LINE__,
+								id.pclo, id.pchi);
+
+					if (!addDWARFSectionContrib(mod, id.pclo, id.pchi))
+						return false;
+				}
+			}
 #endif
-				break;
+			break;
 
-			case DW_TAG_variable:
-				if (id.name)
+		case DW_TAG_variable:
+			if (id.name)
+			{
+				int seg = -1;
+				unsigned long segOff;
+				bool dllimport = false;
+				if (id.location.type == Invalid && id.external && id.linkage_name)
 				{
-					int seg = -1;
-					unsigned long segOff;
-					bool dllimport = false;
-					if (id.location.type == Invalid && id.external && id.linkage_name)
-					{
-						seg = imgDbg->findSymbol(id.linkage_name, segOff, dllimport);
-					}
-					else if (id.location.type == Invalid && id.external)
-					{
-						seg = imgDbg->findSymbol(id.name, segOff, dllimport);
-					}
-					else
+					seg = imgDbg->findSymbol(id.linkage_name, segOff, dllimport);
+				}
+				else if (id.location.type == Invalid && id.external)
+				{
+					seg = imgDbg->findSymbol(id.name, segOff, dllimport);
+				}
+				else
+				{
+					Location loc = decodeLocation(id.location, 0, 0, &cursor);
+					if (loc.is_abs())
 					{
-						Location loc = decodeLocation(id.location);
-						if (loc.is_abs())
-						{
-							segOff = loc.off;
-							seg = imgDbg->findSection(segOff);
-							if (seg >= 0)
-								segOff -= imgDbg->getImageBase() + imgDbg->getSection(seg).VirtualAddress;
-						}
+						segOff = loc.off;
+						seg = imgDbg->findSection(segOff);
+						if (seg >= 0)
+							segOff -= imgDbg->getImageBase() + imgDbg->getSection(seg).VirtualAddress;
 					}
-					if (seg >= 0)
+				}
+				if (seg >= 0)
+				{
+					int type = getTypeByDWARFPtr(id.type);
+					if (dllimport)
 					{
-						int type = getTypeByDWARFPtr(id.type);
-						if (dllimport)
-						{
-							checkDWARFTypeAlloc(100);
-							cbDwarfTypes += addPointerType(dwarfTypes + cbDwarfTypes, type, pointerAttr | 0x20); // needs to be deduplicted?
-							type = nextDwarfType++;
-						}
-						appendGlobalVar(id.name, type, seg + 1, segOff);
-						int rc = mod->AddPublic2(id.name, seg + 1, segOff, type);
+						checkDWARFTypeAlloc(100);
+						int recOff = cbDwarfTypes;
+						cbDwarfTypes += addPointerType(dwarfTypes + cbDwarfTypes, type, pointerAttr | 0x20);
+						type = foldDWARFType(recOff, nextDwarfType++);
 					}
+					int symOff = cbUdtSymbols;
+					appendGlobalVar(id.name, type, seg + 1, segOff);
+					addDWARFTypeRef(kUdtSymbols, &((codeview_symbol*)(udtSymbols + symOff))->data_v2.symtype);
+					addDWARFPublic(id.name, seg + 1, segOff, type);
 				}
-				break;
-			case DW_TAG_formal_parameter:
-			case DW_TAG_unspecified_parameters:
-			case DW_TAG_inheritance:
-			case DW_TAG_member:
-			case DW_TAG_inlined_subroutine:
-			case DW_TAG_lexical_block:
-			default:
-				break;
 			}
+			break;
+		case DW_TAG_formal_parameter:
+		case DW_TAG_unspecified_parameters:
+		case DW_TAG_inheritance:
+		case DW_TAG_member:
+		case DW_TAG_inlined_subroutine:
+		case DW_TAG_lexical_block:
+		default:
+			break;
+		}
 
-			if (cvtype >= 0)
-			{
-				assert(cvtype == typeID); 
-				typeID++;
+		if (cvtype >= 0)
+		{
+			assert(cvtype == typeID); 
+			typeID++;
 
-				assert(mapEntryPtrToTypeID[id.entryPtr] == cvtype);
-				assert(typeID == nextUserType);
-			}
+			assert(node.typeID == cvtype);
+			assert(typeID == nextUserType);
 		}
 	}
 
-	assert(typeID == nextUserType);
-	assert(typeID == firstUserType + mapEntryPtrToTypeID.size());
 	return true;
 }
 
@@ -2059,12 +3089,10 @@ void printIndent(int level) {
 	}
 }
 
-void dumpTreeHelper(DWARF_InfoData* node, int level) {
-	for (DWARF_InfoData* n = node; n; n = n->next) {
-		const unsigned dieOffset = n->img->debug_info.sectOff(n->entryPtr);
-
+void dumpTreeHelper(const DWARF_Node* node, int level) {
+	for (const DWARF_Node* n = node; n; n = n->next) {
 		printIndent(level);
-		printf("offset: %#x, name: \"%s\", tag: %#x, abbrev: %d\n", dieOffset, n->name, n->tag, n->code);
+		printf("offset: %#x, name: \"%s\", tag: %#x, abbrev: %d\n", n->entryOff, n->name, n->tag, n->abbrev->code);
 
 		// Visit the children.
 		dumpTreeHelper(n->children, level + 1);
@@ -2137,7 +3165,7 @@ bool CV2PDB::createDWARFModules()
 		appendComplex(0x52, 0x42, 12, "creal");
 	}
 
-	DIECursor::setContext(imgDbg, debug);
+	dwarfContext = std::make_unique<DWARF_Context>(imgDbg, debug);
 
 	countEntries = 0;
 	if (!mapTypes())
@@ -2174,6 +3202,7 @@ bool CV2PDB::createDWARFModules()
 			memcpy(userTypes + cbUserTypes, dwarfTypes, cbDwarfTypes);
 			cbUserTypes += cbDwarfTypes;
 			cbDwarfTypes = 0;
+			dwarfTypeHashes.clear();
 		}
 		int rc = mod->AddTypes(userTypes, cbUserTypes);
 		if (rc <= 0)
@@ -2187,7 +3216,7 @@ bool CV2PDB::addDWARFLines()
 	if(!imgDbg->debug_line.isPresent())
 		return setError("no .debug_line section found");
 
-	if (!interpretDWARFLines(*imgDbg, globalMod(), debug))
+	if (!interpretDWARFLines(*imgDbg, globalMod(), debug, numThreads, mspdb::vsVersion >= 14))
 		return setError("cannot add line number info to module");
 
 	return true;
@@ -2206,26 +3235,45 @@ bool CV2PDB::addDWARFPublics()
 
 // Try to lookup a DWARF_InfoData in the constructed DWARF tree given its
 // "entryPtr". I.e. its memory-mapped location in the loaded PE image buffer.
-DWARF_InfoData* CV2PDB::findEntryByPtr(byte* entryPtr) const
+DWARF_Node* CV2PDB::findEntryByPtr(byte* entryPtr) const
 {
-	auto it = mapEntryPtrToEntry.find(entryPtr);
-	if (it == mapEntryPtrToEntry.end()) {
-		// Could not find decl for this definition.
+	if (dwarfParent)
+		return dwarfParent->findEntryByPtr(entryPtr);
+
+	if (imgDbg->debug_info.isPtrInside(entryPtr))
+		return dwarfTree.find(imgDbg->debug_info.sectOff(entryPtr));
+
+	// The DIEs of split units follow in the order of their .dwo files.
+	auto it = dwoInfoSections.upper_bound(entryPtr);
+	if (it == dwoInfoSections.end() || !it->second.first->isPtrInside(entryPtr))
 		return nullptr;
-	} 
-	return it->second;
+	return dwarfTree.find(it->second.second + it->second.first->sectOff(entryPtr));
+}
+
+// Read all attributes of a node of the DWARF tree.
+bool CV2PDB::readDWARFEntry(const DWARF_Node* node, DWARF_InfoData& id) const
+{
+	const CV2PDB* context = dwarfParent ? dwarfParent : this;
+
+	// Use a copy of the unit, as reading the DIE can update it.
+	DWARF_CompilationUnitInfo cu = context->dwarfUnits[node->unit].cu;
+	DIECursor cursor(*context->dwarfContext, &cu, node->entryPtr);
+	return cursor.readNext(&id) != nullptr;
 }
 
 // Try to lookup a TypeID in the set of registered types by a
 // "typePtr". I.e. its memory-mapped location in the loaded PE image buffer.
 int CV2PDB::findTypeIdByPtr(byte* typePtr) const
 {
-	auto it = mapEntryPtrToTypeID.find(typePtr);
-	if (it == mapEntryPtrToTypeID.end()) {
+	if (dwarfParent)
+		return dwarfParent->findTypeIdByPtr(typePtr);
+
+	const DWARF_Node* node = findEntryByPtr(typePtr);
+	if (!node) {
 		// Could not find type for this definition.
 		return T_NOTYPE;
 	}
-	return it->second;
+	return node->typeID;
 }
 
 bool CV2PDB::writeDWARFImage(const TCHAR* opath)
@@ -6,12 +6,16 @@
 //
 
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include "PEImage.h"
 #include "mspdb.h"
 #include "dwarf.h"
 #include "readDwarf.h"
-
-static DebugLevel debug;
+#include "symutil.h"
 
 bool isRelativePath(const std::string& s)
 {
@@ -52,13 +56,75 @@ bool printLines(char const *fname, unsigned short sec, char const *secname, unsi
 }
 
 
-bool _flushDWARFLines(const PEImage& img, mspdb::Mod* mod, DWARF_LineState& state)
+// Normalized file names of the line number programs. Each name is only
+// stored once, no matter how many programs or blocks refer to it.
+class DWARF_PathTable
+{
+public:
+	// called while decoding the programs
+	unsigned int intern(const std::string& path, const byte* md5)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = ids.emplace(path, (unsigned int)names.size());
+		if (it.second)
+		{
+			names.push_back(&it.first->first);
+			md5s.push_back(md5);
+		}
+		else if (!md5s[it.first->second])
+			md5s[it.first->second] = md5;
+		return it.first->second;
+	}
+	// only called after all programs are decoded
+	size_t size() const { return names.size(); }
+	const std::string& name(unsigned int id) const { return *names[id]; }
+	const byte* md5(unsigned int id) const { return md5s[id]; }
+
+private:
+	std::mutex mutex;
+	std::unordered_map<std::string, unsigned int> ids;
+	std::vector<const std::string*> names;
+	std::vector<const byte*> md5s; // null if the checksum is unknown
+};
+
+static unsigned int internFileName(DWARF_PathTable& paths, const DWARF_LineState& state, const DWARF_FileName& dfn)
+{
+	std::string fname;
+	if(isRelativePath(dfn.file_name) &&
+	   dfn.dir_index > 0 && dfn.dir_index <= state.include_dirs.size())
+		fname = state.include_dirs[dfn.dir_index - 1];
+	fname += dfn.file_name;
+	std::replace(fname.begin(), fname.end(), '/', '\\');
+	return paths.intern(fname, dfn.md5);
+}
+
+// The lines of one file and section, collected from a line number program
+// before they are added to the module.
+struct DWARF_LineBlock
+{
+	unsigned int fileId;
+	int segIndex;
+	unsigned int low_line;
+	unsigned int high_offset;
+	std::vector<mspdb::LineInfoEntry> lineInfo;
+	std::vector<unsigned short> lineColumns;
+};
+
+// A line number program of .debug_line and the lines decoded from it.
+struct DWARF_LineProgram
+{
+	unsigned long off;
+	unsigned long length;
+	std::vector<DWARF_LineBlock> blocks;
+	bool ok;
+};
+
+bool _flushDWARFLines(const PEImage& img, DWARF_LineState& state, DWARF_PathTable& paths, std::vector<DWARF_LineBlock>& blocks)
 {
 	if(state.lineInfo.size() == 0)
 		return true;
 
 	unsigned int saddr = state.lineInfo[0].offset;
-	unsigned int eaddr = state.lineInfo.back().offset;
     int segIndex = state.section;
     if (segIndex < 0)
 	    segIndex = img.findSection(saddr + state.seg_offset);
@@ -66,85 +132,200 @@ bool _flushDWARFLines(const PEImage& img, mspdb::Mod* mod, DWARF_LineState& stat
 	{
 		// throw away invalid lines (mostly due to "set address to 0")
 		state.lineInfo.resize(0);
+		state.lineColumns.resize(0);
 		return true;
 	}
 
+	// resolve the file name only once per program
+	int* fileId;
 	const DWARF_FileName* dfn;
 	if(state.lineInfo_file == 0)
+	{
+		fileId = &state.cur_file_id;
 		dfn = &state.cur_file;
+	}
 	else if(state.lineInfo_file > 0 && state.lineInfo_file <= state.files.size())
+	{
+		if (state.file_ids.size() < state.files.size())
+			state.file_ids.resize(state.files.size(), -1);
+		fileId = &state.file_ids[state.lineInfo_file - 1];
 		dfn = &state.files[state.lineInfo_file - 1];
+	}
 	else
 		return false;
-	std::string fname = dfn->file_name;
+	if (*fileId < 0)
+		*fileId = internFileName(paths, state, *dfn);
+
+	unsigned int high_offset = state.address - state.seg_offset;
+	if (high_offset < state.lineInfo.back().offset)
+		// The current address is before the previous address; use that as the end instead to ensure we capture all of the preceeding line info
+		high_offset = state.lineInfo.back().offset;
+
+	// copy the lines, so the buffer of the state is reused for the next block
+	blocks.push_back(DWARF_LineBlock{ (unsigned int)*fileId, segIndex, state.lineInfo_low_line, high_offset,
+	                                  state.lineInfo, state.lineColumns });
+	state.lineInfo.resize(0);
+	state.lineColumns.resize(0);
+	return true;
+}
 
-	if(isRelativePath(fname) &&
-	   dfn->dir_index > 0 && dfn->dir_index <= state.include_dirs.size())
+bool addLineBlocks(const PEImage& img, mspdb::Mod* mod, const DWARF_PathTable& paths, std::vector<DWARF_LineBlock>& blocks,
+                   DebugLevel debug)
+{
+	for (DWARF_LineBlock& block : blocks)
 	{
-		std::string dir = state.include_dirs[dfn->dir_index - 1];
-		fname = dir + fname;
+		const char* fname = paths.name(block.fileId).c_str();
+		if (!mod)
+		{
+			printLines(fname, block.segIndex, img.findSectionSymbolName(block.segIndex), block.low_line,
+			           block.lineInfo.data(), block.lineInfo.size());
+			continue;
+		}
+
+		unsigned int low_offset = block.lineInfo[0].offset;
+		unsigned int low_line = block.low_line;
+
+		for (size_t ln = 0; ln < block.lineInfo.size(); ++ln)
+		{
+			auto& line_entry = block.lineInfo[ln];
+			line_entry.offset -= low_offset;
+		}
+
+		// PDB address ranges are fully closed, so point to before the next instruction
+		unsigned int high_offset = block.high_offset - 1;
+		// This subtraction can underflow to (unsigned)-1 if this info is only for a single instruction, but AddLines will immediately increment it to 0, so this is fine.  Not underflowing this can cause the debugger to ignore other line info for address ranges that include this address.
+		unsigned int address_range_length = high_offset - low_offset;
+
+		if (debug & DbgPdbLines)
+			fprintf(stderr, "%s:%d: AddLines(%08x+%04x, Line=%4d+%3d, %s)\n", __FUNCTION__, __LINE__,
+					low_offset, address_range_length, low_line,
+					(unsigned int)block.lineInfo.size(), fname);
+
+		int rc = mod->AddLines(fname, block.segIndex + 1, low_offset, address_range_length, low_offset, low_line,
+		                       (unsigned char*)&block.lineInfo[0],
+		                       block.lineInfo.size() * sizeof(block.lineInfo[0]));
+		if (rc <= 0)
+			return false;
 	}
-	for(size_t i = 0; i < fname.length(); i++)
-		if(fname[i] == '/')
-			fname[i] = '\\';
-
-    if (!mod)
-    {
-        printLines(fname.c_str(), segIndex, img.findSectionSymbolName(segIndex), state.lineInfo_low_line,
-                   state.lineInfo.data(), state.lineInfo.size());
-		state.lineInfo.resize(0);
-		return true;
-    }
-#if 1
-	//qsort(&state.lineInfo[0], state.lineInfo.size(), sizeof(state.lineInfo[0]), cmpAdr);
+	return true;
+}
 
-	int rc = 1;
-	unsigned int low_offset = state.lineInfo[0].offset;
-	unsigned int low_line = state.lineInfo_low_line;
+// Add the lines of all programs to the module with a single call, using the
+// C13 format of addSrcLines14: the file names (F3), their checksums (F4) and
+// a line subsection (F2) with columns for each block.
+bool addLinesC13(mspdb::Mod* mod, const DWARF_PathTable& paths, const std::vector<DWARF_LineProgram>& programs,
+                 DebugLevel debug)
+{
+	std::vector<char> F2_all; // multiple f2 blocks
+	std::vector<char> F3_buf; // filenames
+	std::vector<char> F4_buf; // file checksums
+	std::vector<int> fileids(paths.size(), -1); // offset of the F4 entry
 
-	for (size_t ln = 0; ln < state.lineInfo.size(); ++ln)
+	append(F3_buf, (char)0); // empty string
+
+	bool ok = true;
+	for (const DWARF_LineProgram& prog : programs)
 	{
-		auto& line_entry = state.lineInfo[ln];
-		line_entry.offset -= low_offset;
-	}
+		for (const DWARF_LineBlock& block : prog.blocks)
+		{
+			int& fileid = fileids[block.fileId];
+			if (fileid < 0)
+			{
+				const std::string& fname = paths.name(block.fileId);
+				const byte* md5 = paths.md5(block.fileId);
+				fileid = (int)F4_buf.size();
+				append(F4_buf, (int)F3_buf.size());
+				append(F3_buf, fname.c_str(), fname.size() + 1);
+				if (md5)
+				{
+					append(F4_buf, (char)16); // checksum size
+					append(F4_buf, (char)1);  // CHKSUM_TYPE_MD5
+					append(F4_buf, md5, 16);
+				}
+				else
+					append(F4_buf, (short)0); // no checksum
+				align(F4_buf, 4);
+			}
 
-	unsigned int high_offset = state.address - state.seg_offset;
-	if (high_offset < state.lineInfo.back().offset + low_offset)
-		// The current address is before the previous address; use that as the end instead to ensure we capture all of the preceeding line info
-		high_offset = state.lineInfo.back().offset + low_offset;
-	// PDB address ranges are fully closed, so point to before the next instruction
-	--high_offset;
-	// This subtraction can underflow to (unsigned)-1 if this info is only for a single instruction, but AddLines will immediately increment it to 0, so this is fine.  Not underflowing this can cause the debugger to ignore other line info for address ranges that include this address.
-	unsigned int address_range_length = high_offset - low_offset;
-
-	if (debug & DbgPdbLines)
-		fprintf(stderr, "%s:%d: AddLines(%08x+%04x, Line=%4d+%3d, %s)\n", __FUNCTION__, __LINE__,
-				low_offset, address_range_length, low_line,
-				(unsigned int)state.lineInfo.size(), fname.c_str());
-
-	rc = mod->AddLines(fname.c_str(), segIndex + 1, low_offset, address_range_length, low_offset, low_line,
-	                   (unsigned char*)&state.lineInfo[0],
-	                   state.lineInfo.size() * sizeof(state.lineInfo[0]));
-
-#else
-	unsigned int firstLine = 0;
-	unsigned int firstAddr = 0;
-	int rc = mod->AddLines(fname.c_str(), segIndex + 1, saddr, eaddr - saddr, firstAddr, firstLine,
-						   (unsigned char*) &state.lineInfo[0], state.lineInfo.size() * sizeof(state.lineInfo[0]));
-#endif
+			unsigned int low_offset = block.lineInfo[0].offset;
+			int cnt = (int)block.lineInfo.size();
+			bool columns = false;
+			for (unsigned short col : block.lineColumns)
+				columns = columns || col != 0;
+
+			if (debug & DbgPdbLines)
+				fprintf(stderr, "%s:%d: Lines(%08x+%04x, Line=%4d+%3d, %s)\n", __FUNCTION__, __LINE__,
+						low_offset, block.high_offset - low_offset, block.low_line, cnt, paths.name(block.fileId).c_str());
+
+			size_t start = F2_all.size();
+			append(F2_all, (int)0xf2);
+			append(F2_all, (int)0); // size of subsection, set below
+			append(F2_all, (int)low_offset);
+			append(F2_all, (short)(block.segIndex + 1));
+			append(F2_all, (short)(columns ? 1 : 0)); // flags (CV_LINES_HAVE_COLUMNS)
+			append(F2_all, (int)(block.high_offset - low_offset));
+
+			append(F2_all, fileid);
+			append(F2_all, cnt);
+			append(F2_all, cnt * (columns ? 12 : 8) + 12); // size of block
+
+			for (const mspdb::LineInfoEntry& entry : block.lineInfo)
+			{
+				append(F2_all, (int)(entry.offset - low_offset));
+				append(F2_all, (int)((block.low_line + entry.line) & 0xffffff) | (int)0x80000000); // mark as statement
+			}
+			if (columns)
+			{
+				for (unsigned short col : block.lineColumns)
+				{
+					append(F2_all, col);               // start column
+					append(F2_all, (unsigned short)0); // end column
+				}
+			}
+			*(int*)(F2_all.data() + start + 4) = (int)(F2_all.size() - start - 8);
+			align(F2_all, 4);
+		}
+		// lines before an error in a program are still added
+		if (!prog.ok)
+		{
+			ok = false;
+			break;
+		}
+	}
 
-	state.lineInfo.resize(0);
-	return rc > 0;
+	std::vector<char> buf;
+	append(buf, (int)4);
+	if (F3_buf.size() > 0)
+	{
+		append(buf, (int)0xf3);
+		append(buf, (int)F3_buf.size());
+		append(buf, F3_buf.data(), F3_buf.size());
+		align(buf, 4);
+	}
+	if (F4_buf.size() > 0)
+	{
+		append(buf, (int)0xf4);
+		append(buf, (int)F4_buf.size());
+		append(buf, F4_buf.data(), F4_buf.size());
+		align(buf, 4);
+	}
+	if (F2_all.size() > 0)
+	{
+		append(buf, F2_all.data(), F2_all.size());
+		align(buf, 4);
+	}
+	int rc = mod->AddSymbols((unsigned char *)buf.data(), buf.size());
+	return ok && rc > 0;
 }
 
-bool addLineInfo(const PEImage& img, mspdb::Mod* mod, DWARF_LineState& state)
+bool addLineInfo(const PEImage& img, DWARF_LineState& state, DWARF_PathTable& paths, std::vector<DWARF_LineBlock>& blocks)
 {
 	// The DWARF standard says about end_sequence: "indicating that the current
 	// address is that of the first byte after the end of a sequence of target
 	// machine instructions". So if this is a end_sequence row, don't append any
 	// lines to the list, just flush it.
 	if (state.end_sequence)
-		return _flushDWARFLines(img, mod, state);
+		return _flushDWARFLines(img, state, paths, blocks);
 
 	if (state.address < state.seg_offset)
 		return true;
@@ -157,7 +338,7 @@ bool addLineInfo(const PEImage& img, mspdb::Mod* mod, DWARF_LineState& state)
 		if (state.line < state.lineInfo_low_line || state.line > state.lineInfo_low_line + 0xffff ||
 			entry.offset < last_entry.offset || state.lineInfo_file != state.file)
 		{
-			if (!_flushDWARFLines(img, mod, state))
+			if (!_flushDWARFLines(img, state, paths, blocks))
 				return false;
 		}
 		else if (state.line == last_entry.line + state.lineInfo_low_line &&
@@ -171,360 +352,417 @@ bool addLineInfo(const PEImage& img, mspdb::Mod* mod, DWARF_LineState& state)
 		state.lineInfo_low_line = state.line;
 	entry.line = state.line - state.lineInfo_low_line;
 	state.lineInfo.push_back(entry);
+	state.lineColumns.push_back(state.column > 0xffff ? 0 : (unsigned short)state.column);
 	state.lineInfo_file = state.file;
 	return true;
 }
 
-bool interpretDWARFLines(const PEImage& img, mspdb::Mod* mod, DebugLevel debug_)
+// Decode a single line number program into prog.blocks. The relocations of
+// the addresses are only evaluated for object files (dumpOnly).
+static bool decodeLineProgram(const PEImage& img, const DWARF_CompilationUnitInfo& cu, DWARF_PathTable& paths,
+                              DWARF_LineProgram& prog, bool dumpOnly, DebugLevel debug)
 {
+	int ptrsize = cu.address_size;
+	unsigned long off = prog.off;
+	unsigned long length = prog.length;
 
-	DWARF_CompilationUnitInfo cu{};
+	DWARF_LineNumberProgramHeader hdr5;
+	DWARF_LineNumberProgramHeader* hdrver = (DWARF_LineNumberProgramHeader*)img.debug_line.byteAt(off);
 
-	unsigned long offs = 0;
-	if (!cu.read(debug_, img, &offs)) {
-		return false;
+	DWARF_LineNumberProgramHeader* hdr;
+	if (hdrver->version <= 3)
+	{
+		auto hdr2 = (DWARF2_LineNumberProgramHeader*)hdrver;
+		hdr5.default_is_stmt = hdr2->default_is_stmt;
+		hdr5.header_length = hdr2->header_length;
+		hdr5.line_base = hdr2->line_base;
+		hdr5.line_range = hdr2->line_range;
+		hdr5.minimum_instruction_length = hdr2->minimum_instruction_length;
+		hdr5.maximum_operations_per_instruction = 0xff;
+		hdr5.opcode_base = hdr2->opcode_base;
+		hdr5.unit_length = hdr2->unit_length;
+		hdr5.version = hdr2->version;
+		hdr = &hdr5;
+	}
+	else if (hdrver->version == 4)
+	{
+		auto hdr4 = (DWARF4_LineNumberProgramHeader*)hdrver;
+		hdr5.default_is_stmt = hdr4->default_is_stmt;
+		hdr5.header_length = hdr4->header_length;
+		hdr5.line_base = hdr4->line_base;
+		hdr5.line_range = hdr4->line_range;
+		hdr5.minimum_instruction_length = hdr4->minimum_instruction_length;
+		hdr5.maximum_operations_per_instruction = hdr4->maximum_operations_per_instruction;
+		hdr5.opcode_base = hdr4->opcode_base;
+		hdr5.unit_length = hdr4->unit_length;
+		hdr5.version = hdr4->version;
+		hdr = &hdr5;
+	}
+	else
+		hdr = hdrver;
+	int hdrlength = hdr->version <= 3 ? sizeof(DWARF2_LineNumberProgramHeader) : hdr->version == 4 ? sizeof(DWARF4_LineNumberProgramHeader) : sizeof(DWARF_LineNumberProgramHeader);
+	unsigned char* p = (unsigned char*) hdrver + hdrlength;
+	unsigned char* end = (unsigned char*) hdrver + length;
+
+	if (debug & DbgDwarfLines)
+		fprintf(stderr, "%s:%d: LineNumberProgramHeader offs=%x ver=%d\n", __FUNCTION__, __LINE__,
+				off, hdr->version);
+
+	std::vector<unsigned int> opcode_lengths;
+	opcode_lengths.resize(hdr->opcode_base);
+	if (hdr->opcode_base > 0)
+	{
+		opcode_lengths[0] = 0;
+		for(byte o = 1; o < hdr->opcode_base && p < end; o++)
+			opcode_lengths[o] = LEB128(p);
 	}
 
-	int ptrsize = cu.address_size;
-
-	debug = debug_;
+	DWARF_LineState state;
+	state.seg_offset = img.getImageBase() + img.getSection(img.text.secNo).VirtualAddress;
 
-	DWARF_LineNumberProgramHeader hdr5;
-	for(unsigned long off = 0; off < img.debug_line.length; )
+	if (hdr->version <= 4)
 	{
-		DWARF_LineNumberProgramHeader* hdrver = (DWARF_LineNumberProgramHeader*)img.debug_line.byteAt(off);
-		int length = hdrver->unit_length;
-		if(length < 0)
-			break;
-		length += sizeof(length);
-
-		DWARF_LineNumberProgramHeader* hdr;
-		if (hdrver->version <= 3)
-		{
-			auto hdr2 = (DWARF2_LineNumberProgramHeader*)hdrver;
-			hdr5.default_is_stmt = hdr2->default_is_stmt;
-			hdr5.header_length = hdr2->header_length;
-			hdr5.line_base = hdr2->line_base;
-			hdr5.line_range = hdr2->line_range;
-			hdr5.minimum_instruction_length = hdr2->minimum_instruction_length;
-			hdr5.maximum_operations_per_instruction = 0xff;
-			hdr5.opcode_base = hdr2->opcode_base;
-			hdr5.unit_length = hdr2->unit_length;
-			hdr5.version = hdr2->version;
-			hdr = &hdr5;
-		}
-		else if (hdrver->version == 4)
+		// dirs
+		while(p < end)
 		{
-			auto hdr4 = (DWARF4_LineNumberProgramHeader*)hdrver;
-			hdr5.default_is_stmt = hdr4->default_is_stmt;
-			hdr5.header_length = hdr4->header_length;
-			hdr5.line_base = hdr4->line_base;
-			hdr5.line_range = hdr4->line_range;
-			hdr5.minimum_instruction_length = hdr4->minimum_instruction_length;
-			hdr5.maximum_operations_per_instruction = hdr4->maximum_operations_per_instruction;
-			hdr5.opcode_base = hdr4->opcode_base;
-			hdr5.unit_length = hdr4->unit_length;
-			hdr5.version = hdr4->version;
-			hdr = &hdr5;
+			if(*p == 0)
+				break;
+			state.include_dirs.emplace_back((const char*) p);
+			auto &dir = state.include_dirs.back();
+			p += dir.size() + 1;
+			addTrailingSlash(dir);
 		}
-		else
-			hdr = hdrver;
-		int hdrlength = hdr->version <= 3 ? sizeof(DWARF2_LineNumberProgramHeader) : hdr->version == 4 ? sizeof(DWARF4_LineNumberProgramHeader) : sizeof(DWARF_LineNumberProgramHeader);
-		unsigned char* p = (unsigned char*) hdrver + hdrlength;
-		unsigned char* end = (unsigned char*) hdrver + length;
-
-		if (debug & DbgDwarfLines)
-			fprintf(stderr, "%s:%d: LineNumberProgramHeader offs=%x ver=%d\n", __FUNCTION__, __LINE__,
-					off, hdr->version);
-
-		std::vector<unsigned int> opcode_lengths;
-		opcode_lengths.resize(hdr->opcode_base);
-		if (hdr->opcode_base > 0)
+		p++;
+
+		// files
+		while(p < end && *p)
 		{
-			opcode_lengths[0] = 0;
-			for(byte o = 1; o < hdr->opcode_base && p < end; o++)
-				opcode_lengths[o] = LEB128(p);
+			DWARF_FileName fname;
+			fname.read(p);
+			state.files.emplace_back(std::move(fname));
 		}
+		p++;
+	}
+	else
+	{
+		DWARF_TypeForm type_and_form;
 
-		DWARF_LineState state;
-		state.seg_offset = img.getImageBase() + img.getSection(img.text.secNo).VirtualAddress;
-
-		if (hdr->version <= 4)
+		byte directory_entry_format_count = *(p++);
+		std::vector<DWARF_TypeForm> directory_entry_format;
+		for (int i = 0; i < directory_entry_format_count; i++)
 		{
-			// dirs
-			while(p < end)
-			{
-				if(*p == 0)
-					break;
-				state.include_dirs.emplace_back((const char*) p);
-				auto &dir = state.include_dirs.back();
-				p += dir.size() + 1;
-				addTrailingSlash(dir);
-			}
-			p++;
-
-			// files
-			while(p < end && *p)
-			{
-				DWARF_FileName fname;
-				fname.read(p);
-				state.files.emplace_back(std::move(fname));
-			}
-			p++;
+			type_and_form.type = LEB128(p);
+			type_and_form.form = LEB128(p);
+			directory_entry_format.push_back(type_and_form);
 		}
-		else
-		{
-			DWARF_TypeForm type_and_form;
 
-			byte directory_entry_format_count = *(p++);
-			std::vector<DWARF_TypeForm> directory_entry_format;
-			for (int i = 0; i < directory_entry_format_count; i++)
-			{
-				type_and_form.type = LEB128(p);
-				type_and_form.form = LEB128(p);
-				directory_entry_format.push_back(type_and_form);
-			}
-
-			unsigned int directories_count = LEB128(p);
-			for (unsigned int o = 0; o < directories_count; o++)
+		unsigned int directories_count = LEB128(p);
+		for (unsigned int o = 0; o < directories_count; o++)
+		{
+			for (const auto &typeForm : directory_entry_format)
 			{
-				for (const auto &typeForm : directory_entry_format)
+				switch (typeForm.type)
 				{
-					switch (typeForm.type)
+					case DW_LNCT_path:
 					{
-						case DW_LNCT_path:
+						switch (typeForm.form)
+						{
+						case DW_FORM_line_strp:
 						{
-							switch (typeForm.form)
-							{
-							case DW_FORM_line_strp:
-							{
-								size_t offset = cu.isDWARF64() ? RD8(p) : RD4(p);
-								state.include_dirs.emplace_back((const char*)img.debug_line_str.byteAt(offset));
-								break;
-							}
-							case DW_FORM_string:
-								state.include_dirs.emplace_back((const char*)p);
-								p += strlen((const char*)p) + 1;
-								break;
-							default:
-								fprintf(stderr, "%s:%d: ERROR: invalid form=%d for path lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
-										typeForm.form, off);
-								return false;
-							}
-
-							auto& dir = state.include_dirs.back();
-
-							// Relative dirs are relative to the first directory
-							// in the table.
-							if (state.include_dirs.size() > 1 && isRelativePath(dir))
-								dir = state.include_dirs.front() + dir;
-
-							addTrailingSlash(dir);
+							size_t offset = cu.isDWARF64() ? RD8(p) : RD4(p);
+							state.include_dirs.emplace_back((const char*)img.debug_line_str.byteAt(offset));
 							break;
 						}
-						case DW_LNCT_directory_index:
-						case DW_LNCT_timestamp:
-						case DW_LNCT_size:
+						case DW_FORM_string:
+							state.include_dirs.emplace_back((const char*)p);
+							p += strlen((const char*)p) + 1;
+							break;
 						default:
-							fprintf(stderr, "%s:%d: ERROR: unexpected type=%d form=%d for directory path lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
-										typeForm.type, typeForm.form, off);
+							fprintf(stderr, "%s:%d: ERROR: invalid form=%d for path lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
+									typeForm.form, off);
 							return false;
+						}
+
+						auto& dir = state.include_dirs.back();
+
+						// Relative dirs are relative to the first directory
+						// in the table.
+						if (state.include_dirs.size() > 1 && isRelativePath(dir))
+							dir = state.include_dirs.front() + dir;
+
+						addTrailingSlash(dir);
+						break;
 					}
+					case DW_LNCT_directory_index:
+					case DW_LNCT_timestamp:
+					case DW_LNCT_size:
+					default:
+						fprintf(stderr, "%s:%d: ERROR: unexpected type=%d form=%d for directory path lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
+									typeForm.type, typeForm.form, off);
+						return false;
 				}
 			}
+		}
 
-			byte file_name_entry_format_count = *(p++);
-			std::vector<DWARF_TypeForm> file_name_entry_format;
-			for (int i = 0; i < file_name_entry_format_count; i++)
-			{
-				type_and_form.type = LEB128(p);
-				type_and_form.form = LEB128(p);
-				file_name_entry_format.push_back(type_and_form);
-			}
+		byte file_name_entry_format_count = *(p++);
+		std::vector<DWARF_TypeForm> file_name_entry_format;
+		for (int i = 0; i < file_name_entry_format_count; i++)
+		{
+			type_and_form.type = LEB128(p);
+			type_and_form.form = LEB128(p);
+			file_name_entry_format.push_back(type_and_form);
+		}
 
-			unsigned int file_names_count = LEB128(p);
-			for (unsigned int o = 0; o < file_names_count; o++)
-			{
-				DWARF_FileName fname;
+		unsigned int file_names_count = LEB128(p);
+		for (unsigned int o = 0; o < file_names_count; o++)
+		{
+			DWARF_FileName fname;
 
-				for (const auto &typeForm : file_name_entry_format)
+			for (const auto &typeForm : file_name_entry_format)
+			{
+				switch (typeForm.type)
 				{
-					switch (typeForm.type)
-					{
-						case DW_LNCT_path:
-							switch (typeForm.form)
-							{
-							case DW_FORM_line_strp:
-							{
-								size_t offset = cu.isDWARF64() ? RD8(p) : RD4(p);
-								fname.file_name = (const char*)img.debug_line_str.byteAt(offset);
-								break;
-							}
-							case DW_FORM_string:
-								fname.file_name = (const char*)p;
-								p += strlen((const char*)p) + 1;
-								break;
-							default:
-								fprintf(stderr, "%s:%d: ERROR: invalid form=%d for path lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
-										typeForm.form, off);
-								assert(false && "invalid path form");
-								return false;
-							}
+					case DW_LNCT_path:
+						switch (typeForm.form)
+						{
+						case DW_FORM_line_strp:
+						{
+							size_t offset = cu.isDWARF64() ? RD8(p) : RD4(p);
+							fname.file_name = (const char*)img.debug_line_str.byteAt(offset);
 							break;
-						case DW_LNCT_directory_index:
-							// bias the directory index by 1 since _flushDWARFLines
-							// will check for 0 and subtract one (which is
-							// useful for DWARF4).
-							switch (typeForm.form)
-							{
-							case DW_FORM_data1:
-								fname.dir_index = *p++ + 1;
-								break;
-							case DW_FORM_data2:
-								fname.dir_index = RD2(p) + 1;
-								break;
-							case DW_FORM_udata:
-								fname.dir_index = LEB128(p) + 1;
-								break;
-							default:
-								fprintf(stderr, "%s:%d: ERROR: invalid form=%d for directory index lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
-										typeForm.form, off);
-								return false;
-							}
+						}
+						case DW_FORM_string:
+							fname.file_name = (const char*)p;
+							p += strlen((const char*)p) + 1;
 							break;
-						case DW_LNCT_timestamp:
-						case DW_LNCT_size:
 						default:
-							fprintf(stderr, "%s:%d: ERROR: unexpected type=%d form=%d for file path lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
-										typeForm.type, typeForm.form, off);
+							fprintf(stderr, "%s:%d: ERROR: invalid form=%d for path lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
+									typeForm.form, off);
+							assert(false && "invalid path form");
 							return false;
-					}
+						}
+						break;
+					case DW_LNCT_directory_index:
+						// bias the directory index by 1 since _flushDWARFLines
+						// will check for 0 and subtract one (which is
+						// useful for DWARF4).
+						switch (typeForm.form)
+						{
+						case DW_FORM_data1:
+							fname.dir_index = *p++ + 1;
+							break;
+						case DW_FORM_data2:
+							fname.dir_index = RD2(p) + 1;
+							break;
+						case DW_FORM_udata:
+							fname.dir_index = LEB128(p) + 1;
+							break;
+						default:
+							fprintf(stderr, "%s:%d: ERROR: invalid form=%d for directory index lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
+									typeForm.form, off);
+							return false;
+						}
+						break;
+					case DW_LNCT_MD5:
+						if (typeForm.form != DW_FORM_data16)
+						{
+							fprintf(stderr, "%s:%d: ERROR: invalid form=%d for MD5 lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
+									typeForm.form, off);
+							return false;
+						}
+						fname.md5 = p;
+						p += 16;
+						break;
+					case DW_LNCT_timestamp:
+					case DW_LNCT_size:
+					default:
+						fprintf(stderr, "%s:%d: ERROR: unexpected type=%d form=%d for file path lineHdrOffs=%x\n", __FUNCTION__, __LINE__,
+									typeForm.type, typeForm.form, off);
+						return false;
 				}
-
-				state.files.emplace_back(std::move(fname));
 			}
+
+			state.files.emplace_back(std::move(fname));
 		}
+	}
 
-		state.init(hdr);
-		while(p < end)
+	state.init(hdr);
+	while(p < end)
+	{
+		int opcode = *p++;
+		if(opcode >= hdr->opcode_base)
 		{
-			int opcode = *p++;
-			if(opcode >= hdr->opcode_base)
-			{
-				// special opcode
-				int adjusted_opcode = opcode - hdr->opcode_base;
-				int operation_advance = adjusted_opcode / hdr->line_range;
-				state.advance_addr(hdr, operation_advance);
-				int line_advance = hdr->line_base + (adjusted_opcode % hdr->line_range);
-				state.line += line_advance;
-
-				if (!addLineInfo(img, mod, state))
-					return false;
+			// special opcode
+			int adjusted_opcode = opcode - hdr->opcode_base;
+			int operation_advance = adjusted_opcode / hdr->line_range;
+			state.advance_addr(hdr, operation_advance);
+			int line_advance = hdr->line_base + (adjusted_opcode % hdr->line_range);
+			state.line += line_advance;
+
+			if (!addLineInfo(img, state, paths, prog.blocks))
+				return false;
 
-				state.basic_block = false;
-				state.prologue_end = false;
-				state.epilogue_end = false;
-				state.discriminator = 0;
-			}
-			else
+			state.basic_block = false;
+			state.prologue_end = false;
+			state.epilogue_end = false;
+			state.discriminator = 0;
+		}
+		else
+		{
+			switch(opcode)
 			{
-				switch(opcode)
-				{
-				case 0: // extended
+			case 0: // extended
+			{
+				int exlength = LEB128(p);
+				unsigned char* q = p + exlength;
+				int excode = *p++;
+				switch(excode)
 				{
-					int exlength = LEB128(p);
-					unsigned char* q = p + exlength;
-					int excode = *p++;
-					switch(excode)
-					{
-					case DW_LNE_end_sequence:
-						state.end_sequence = true;
-						state.last_addr = state.address;
-						if(!addLineInfo(img, mod, state))
-							return false;
-						state.init(hdr);
-						break;
-					case DW_LNE_set_address:
-					{
-						if (!mod && state.section == -1)
-							state.section = img.getRelocationInLineSegment(img.debug_line.sectOff(p));
-						unsigned long adr = ptrsize == 8 ? RD8(p) : RD4(p);
-						state.address = adr;
-						state.op_index = 0;
-						break;
-					}
-					case DW_LNE_define_file:
-						state.cur_file.read(p);
-						state.file = 0;
-						break;
-					case DW_LNE_set_discriminator:
-						state.discriminator = LEB128(p);
-						break;
-					}
-					p = q;
-					break;
-				}
-				case DW_LNS_copy:
-					if (!addLineInfo(img, mod, state))
+				case DW_LNE_end_sequence:
+					state.end_sequence = true;
+					state.last_addr = state.address;
+					if(!addLineInfo(img, state, paths, prog.blocks))
 						return false;
-					state.basic_block = false;
-					state.prologue_end = false;
-					state.epilogue_end = false;
-					state.discriminator = 0;
-					break;
-				case DW_LNS_advance_pc:
-					state.advance_addr(hdr, LEB128(p));
-					break;
-				case DW_LNS_advance_line:
-					state.line += SLEB128(p);
-					break;
-				case DW_LNS_set_file:
-					state.file = LEB128(p);
-					// DWARF5 numbers all files starting at zero.  We will
-					// subtract one in _flushDWARFLines when indexing the files
-					// array.
-					if (hdr->version >= 5)
-						state.file += 1;
-					break;
-				case DW_LNS_set_column:
-					state.column = LEB128(p);
-					break;
-				case DW_LNS_negate_stmt:
-					state.is_stmt = !state.is_stmt;
-					break;
-				case DW_LNS_set_basic_block:
-					state.basic_block = true;
+					state.init(hdr);
 					break;
-				case DW_LNS_const_add_pc:
-					state.advance_addr(hdr, (255 - hdr->opcode_base) / hdr->line_range);
-					break;
-				case DW_LNS_fixed_advance_pc:
-					state.address += RD2(p);
+				case DW_LNE_set_address:
+				{
+					if (dumpOnly && state.section == -1)
+						state.section = img.getRelocationInLineSegment(img.debug_line.sectOff(p));
+					unsigned long adr = ptrsize == 8 ? RD8(p) : RD4(p);
+					state.address = adr;
 					state.op_index = 0;
 					break;
-				case DW_LNS_set_prologue_end:
-					state.prologue_end = true;
-					break;
-				case DW_LNS_set_epilogue_begin:
-					state.epilogue_end = true;
-					break;
-				case DW_LNS_set_isa:
-					state.isa = LEB128(p);
+				}
+				case DW_LNE_define_file:
+					state.cur_file.read(p);
+					state.cur_file_id = -1;
+					state.file = 0;
 					break;
-				default:
-					// unknown standard opcode
-					for(unsigned int arg = 0; arg < opcode_lengths[opcode]; arg++)
-						LEB128(p);
+				case DW_LNE_set_discriminator:
+					state.discriminator = LEB128(p);
 					break;
 				}
+				p = q;
+				break;
+			}
+			case DW_LNS_copy:
+				if (!addLineInfo(img, state, paths, prog.blocks))
+					return false;
+				state.basic_block = false;
+				state.prologue_end = false;
+				state.epilogue_end = false;
+				state.discriminator = 0;
+				break;
+			case DW_LNS_advance_pc:
+				state.advance_addr(hdr, LEB128(p));
+				break;
+			case DW_LNS_advance_line:
+				state.line += SLEB128(p);
+				break;
+			case DW_LNS_set_file:
+				state.file = LEB128(p);
+				// DWARF5 numbers all files starting at zero.  We will
+				// subtract one in _flushDWARFLines when indexing the files
+				// array.
+				if (hdr->version >= 5)
+					state.file += 1;
+				break;
+			case DW_LNS_set_column:
+				state.column = LEB128(p);
+				break;
+			case DW_LNS_negate_stmt:
+				state.is_stmt = !state.is_stmt;
+				break;
+			case DW_LNS_set_basic_block:
+				state.basic_block = true;
+				break;
+			case DW_LNS_const_add_pc:
+				state.advance_addr(hdr, (255 - hdr->opcode_base) / hdr->line_range);
+				break;
+			case DW_LNS_fixed_advance_pc:
+				state.address += RD2(p);
+				state.op_index = 0;
+				break;
+			case DW_LNS_set_prologue_end:
+				state.prologue_end = true;
+				break;
+			case DW_LNS_set_epilogue_begin:
+				state.epilogue_end = true;
+				break;
+			case DW_LNS_set_isa:
+				state.isa = LEB128(p);
+				break;
+			default:
+				// unknown standard opcode
+				for(unsigned int arg = 0; arg < opcode_lengths[opcode]; arg++)
+					LEB128(p);
+				break;
 			}
 		}
-		if(!_flushDWARFLines(img, mod, state))
-			return false;
+	}
+	return _flushDWARFLines(img, state, paths, prog.blocks);
+}
+
+bool interpretDWARFLines(const PEImage& img, mspdb::Mod* mod, DebugLevel debug, int numThreads, bool useC13)
+{
+
+	DWARF_CompilationUnitInfo cu{};
+
+	unsigned long offs = 0;
+	if (!cu.read(debug, img, &offs)) {
+		return false;
+	}
 
+	// The line number programs are independent of each other, so find them
+	// first and decode them in parallel. Their lines are added to the module
+	// in the order of the section, the same as when decoding them serially.
+	std::vector<DWARF_LineProgram> programs;
+	for(unsigned long off = 0; off < img.debug_line.length; )
+	{
+		DWARF_LineNumberProgramHeader* hdrver = (DWARF_LineNumberProgramHeader*)img.debug_line.byteAt(off);
+		int length = hdrver->unit_length;
+		if(length < 0)
+			break;
+		length += sizeof(length);
+
+		programs.emplace_back();
+		programs.back().off = off;
+		programs.back().length = length;
+		programs.back().ok = false;
 		off += length;
 	}
 
+	DWARF_PathTable paths;
+	const size_t cntPrograms = programs.size();
+	std::atomic<size_t> nextProgram(0);
+	auto decodePrograms = [&]()
+	{
+		for (size_t p = nextProgram++; p < cntPrograms; p = nextProgram++)
+			programs[p].ok = decodeLineProgram(img, cu, paths, programs[p], !mod, debug);
+	};
+
+	size_t cntThreads = (size_t)numThreads < cntPrograms ? numThreads : cntPrograms;
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < cntThreads; t++)
+		threads.emplace_back(decodePrograms);
+	decodePrograms();
+	for (std::thread& t : threads)
+		t.join();
+
+	if (debug & DbgBasic)
+		fprintf(stderr, "%s:%d: decoded %zd line number programs on %zd threads\n", __FUNCTION__, __LINE__, cntPrograms, cntThreads);
+
+	if (mod && useC13)
+		return addLinesC13(mod, paths, programs, debug);
+
+	for (DWARF_LineProgram& prog : programs)
+	{
+		// lines before an error in a program are still added
+		if (!addLineBlocks(img, mod, paths, prog.blocks, debug) || !prog.ok)
+			return false;
+		prog.blocks = std::vector<DWARF_LineBlock>();
+	}
+
 	return true;
 }
-
@@ -0,0 +1,334 @@
+// Convert DMD CodeView debug information to PDB files
+// Copyright (c) 2009-2010 by Rainer Schuetze, All Rights Reserved
+//
+// License for redistribution is given by the Artistic License 2.0
+// see file LICENSE for further details
+
+// Minimal deflate decoder (RFC 1951) for compressed debug sections. The
+// canonical Huffman decoding follows puff.c from the zlib distribution.
+
+#include "inflate.h"
+
+namespace
+{
+
+const int kMaxBits = 15;     // maximum bits in a code
+const int kMaxLCodes = 286;  // maximum number of literal/length codes
+const int kMaxDCodes = 30;   // maximum number of distance codes
+const int kFixLCodes = 288;  // number of fixed literal/length codes
+
+struct Huffman
+{
+	short count[kMaxBits + 1]; // number of codes of each length
+	short symbol[kFixLCodes];  // symbols ordered by their code
+};
+
+// Build the decoding table from the code lengths. Returns 0 for a complete
+// code, a positive value for an incomplete code and a negative value for an
+// over-subscribed code.
+int construct(Huffman& h, const short* length, int n)
+{
+	for (int len = 0; len <= kMaxBits; len++)
+		h.count[len] = 0;
+	for (int s = 0; s < n; s++)
+		h.count[length[s]]++;
+	if (h.count[0] == n)
+		return 0; // no codes, complete but decoding will fail
+
+	int left = 1;
+	for (int len = 1; len <= kMaxBits; len++)
+	{
+		left <<= 1;
+		left -= h.count[len];
+		if (left < 0)
+			return left;
+	}
+
+	short offs[kMaxBits + 1];
+	offs[1] = 0;
+	for (int len = 1; len < kMaxBits; len++)
+		offs[len + 1] = offs[len] + h.count[len];
+	for (int s = 0; s < n; s++)
+		if (length[s] != 0)
+			h.symbol[offs[length[s]]++] = s;
+	return left;
+}
+
+class Inflater
+{
+public:
+	Inflater(const unsigned char* src, size_t srclen, unsigned char* dst, size_t dstlen)
+		: in(src), inlen(srclen), incnt(0), out(dst), outlen(dstlen), outcnt(0)
+		, bitbuf(0), bitcnt(0), overrun(false)
+	{
+	}
+
+	bool inflate()
+	{
+		int last;
+		do
+		{
+			last = bits(1);
+			bool ok;
+			switch (bits(2))
+			{
+			case 0:  ok = stored(); break;
+			case 1:  ok = fixed(); break;
+			case 2:  ok = dynamic(); break;
+			default: ok = false; break;
+			}
+			if (!ok || overrun)
+				return false;
+		}
+		while (!last);
+		return true;
+	}
+
+	size_t consumed() const { return incnt; }
+	size_t produced() const { return outcnt; }
+
+private:
+	int bits(int need)
+	{
+		unsigned int val = bitbuf;
+		while (bitcnt < need)
+		{
+			if (incnt == inlen)
+			{
+				overrun = true;
+				return 0;
+			}
+			val |= (unsigned int)in[incnt++] << bitcnt;
+			bitcnt += 8;
+		}
+		bitbuf = val >> need;
+		bitcnt -= need;
+		return (int)(val & ((1u << need) - 1));
+	}
+
+	bool stored()
+	{
+		// discard the remaining bits of the current byte
+		bitbuf = 0;
+		bitcnt = 0;
+
+		if (inlen - incnt < 4)
+			return false;
+		unsigned int len = in[incnt] | (in[incnt + 1] << 8);
+		unsigned int nlen = in[incnt + 2] | (in[incnt + 3] << 8);
+		incnt += 4;
+		if (len != (~nlen & 0xffff))
+			return false;
+		if (inlen - incnt < len || outlen - outcnt < len)
+			return false;
+		for (unsigned int i = 0; i < len; i++)
+			out[outcnt++] = in[incnt++];
+		return true;
+	}
+
+	int decode(const Huffman& h)
+	{
+		int code = 0;  // bits read so far
+		int first = 0; // first code of the current length
+		int index = 0; // index of the first code of the current length in symbol[]
+		for (int len = 1; len <= kMaxBits; len++)
+		{
+			code |= bits(1);
+			int count = h.count[len];
+			if (code - count < first)
+				return h.symbol[index + (code - first)];
+			index += count;
+			first += count;
+			first <<= 1;
+			code <<= 1;
+		}
+		return -1; // ran out of codes
+	}
+
+	bool codes(const Huffman& lencode, const Huffman& distcode)
+	{
+		static const short lbase[29] = {
+			3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const short lext[29] = {
+			0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const short dbase[30] = {
+			1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+			8193, 12289, 16385, 24577 };
+		static const short dext[30] = {
+			0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+			7, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+			12, 12, 13, 13 };
+
+		int symbol;
+		do
+		{
+			symbol = decode(lencode);
+			if (symbol < 0 || overrun)
+				return false;
+			if (symbol < 256)
+			{
+				if (outcnt == outlen)
+					return false;
+				out[outcnt++] = (unsigned char)symbol;
+			}
+			else if (symbol > 256)
+			{
+				symbol -= 257;
+				if (symbol >= 29)
+					return false;
+				size_t len = lbase[symbol] + bits(lext[symbol]);
+
+				symbol = decode(distcode);
+				if (symbol < 0 || symbol >= 30)
+					return false;
+				size_t dist = dbase[symbol] + bits(dext[symbol]);
+				if (overrun || dist > outcnt || outlen - outcnt < len)
+					return false;
+
+				// the source and destination can overlap
+				for (; len; len--, outcnt++)
+					out[outcnt] = out[outcnt - dist];
+			}
+		}
+		while (symbol != 256);
+		return true;
+	}
+
+	bool fixed()
+	{
+		Huffman lencode, distcode;
+		short lengths[kFixLCodes];
+		int s = 0;
+		for (; s < 144; s++)
+			lengths[s] = 8;
+		for (; s < 256; s++)
+			lengths[s] = 9;
+		for (; s < 280; s++)
+			lengths[s] = 7;
+		for (; s < kFixLCodes; s++)
+			lengths[s] = 8;
+		construct(lencode, lengths, kFixLCodes);
+
+		for (s = 0; s < kMaxDCodes; s++)
+			lengths[s] = 5;
+		construct(distcode, lengths, kMaxDCodes);
+
+		return codes(lencode, distcode);
+	}
+
+	bool dynamic()
+	{
+		static const short order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+		int nlen = bits(5) + 257;
+		int ndist = bits(5) + 1;
+		int ncode = bits(4) + 4;
+		if (overrun || nlen > kMaxLCodes || ndist > kMaxDCodes)
+			return false;
+
+		Huffman lencode, distcode;
+		short lengths[kMaxLCodes + kMaxDCodes];
+		int index;
+		for (index = 0; index < ncode; index++)
+			lengths[order[index]] = bits(3);
+		for (; index < 19; index++)
+			lengths[order[index]] = 0;
+		if (construct(lencode, lengths, 19) != 0)
+			return false;
+
+		// read the literal/length and distance code lengths
+		index = 0;
+		while (index < nlen + ndist)
+		{
+			int symbol = decode(lencode);
+			if (symbol < 0 || overrun)
+				return false;
+			if (symbol < 16)
+				lengths[index++] = symbol;
+			else
+			{
+				short len = 0;
+				if (symbol == 16)
+				{
+					if (index == 0)
+						return false;
+					len = lengths[index - 1];
+					symbol = 3 + bits(2);
+				}
+				else if (symbol == 17)
+					symbol = 3 + bits(3);
+				else
+					symbol = 11 + bits(7);
+				if (index + symbol > nlen + ndist)
+					return false;
+				while (symbol--)
+					lengths[index++] = len;
+			}
+		}
+		if (lengths[256] == 0)
+			return false; // no end-of-block code
+
+		// incomplete codes are only allowed for a single code
+		int err = construct(lencode, lengths, nlen);
+		if (err && (err < 0 || nlen != lencode.count[0] + lencode.count[1]))
+			return false;
+		err = construct(distcode, lengths + nlen, ndist);
+		if (err && (err < 0 || ndist != distcode.count[0] + distcode.count[1]))
+			return false;
+
+		return codes(lencode, distcode);
+	}
+
+	const unsigned char* in;
+	size_t inlen;
+	size_t incnt;
+	unsigned char* out;
+	size_t outlen;
+	size_t outcnt;
+	unsigned int bitbuf;
+	int bitcnt;
+	bool overrun;
+};
+
+unsigned int adler32(const unsigned char* p, size_t len)
+{
+	unsigned int a = 1, b = 0;
+	while (len > 0)
+	{
+		// process blocks small enough that the sums can't overflow
+		size_t n = len < 5552 ? len : 5552;
+		len -= n;
+		for (; n; n--)
+		{
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+} // namespace
+
+bool zlibInflate(const unsigned char* src, size_t srclen, unsigned char* dst, size_t dstlen)
+{
+	// 2 byte header, deflate data, 4 byte Adler-32 checksum
+	if (srclen < 6)
+		return false;
+	unsigned int cmf = src[0];
+	unsigned int flg = src[1];
+	if ((cmf & 0x0f) != 8 || (cmf * 256 + flg) % 31 != 0 || (flg & 0x20))
+		return false; // not deflate, bad check bits or preset dictionary
+
+	Inflater inflater(src + 2, srclen - 6, dst, dstlen);
+	if (!inflater.inflate() || inflater.produced() != dstlen)
+		return false;
+
+	const unsigned char* chk = src + 2 + inflater.consumed();
+	unsigned int adler = (chk[0] << 24) | (chk[1] << 16) | (chk[2] << 8) | chk[3];
+	return adler == adler32(dst, dstlen);
+}
@@ -9,6 +9,10 @@
 #include "symutil.h"
 
 #include <direct.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
 
 double
 #include "../VERSION"
@@ -22,6 +26,7 @@ double
 #define T_strncpy	wcsncpy
 #define T_strcat	wcscat
 #define T_strstr	wcsstr
+#define T_strcmp	wcscmp
 #define T_strncmp	wcsncmp
 #define T_strtoul	wcstoul
 #define T_strtod	wcstod
@@ -30,6 +35,7 @@ double
 #define T_main		wmain
 #define SARG		"%S"
 #define T_stat		_wstat
+#define T_fopen		_wfopen
 #else
 #define T_toupper	toupper
 #define T_getdcwd	_getdcwd
@@ -38,6 +44,7 @@ double
 #define T_strncpy	strncpy
 #define T_strcat	strcat
 #define T_strstr	strstr
+#define T_strcmp	strcmp
 #define T_strncmp	strncmp
 #define T_strtoul	strtoul
 #define T_strtod	strtod
@@ -46,6 +53,7 @@ double
 #define T_main		main
 #define SARG		"%s"
 #define T_stat		stat
+#define T_fopen		fopen
 #endif
 
 void fatal(const char *message, ...)
@@ -184,100 +192,77 @@ TCHAR* extractDebugLink(const PEImage& img, TCHAR* dbgname, const TCHAR* exename
 	return dbgname;
 }
 
-int T_main(int argc, TCHAR* argv[])
+// Options applying to all conversions of an invocation.
+struct ConvertOptions
 {
 	double Dversion = 2.072;
 	const TCHAR* pdbref = 0;
 	const TCHAR* debug_link = 0;
 	DebugLevel debug = DebugLevel{};
+	int numThreads = 1;
+};
 
-	CoInitialize(nullptr);
-
-	while (argc > 1 && argv[1][0] == '-')
-	{
-		argv++;
-		argc--;
-		if (argv[0][1] == '-')
-			break;
-		if (argv[0][1] == 'D')
-			Dversion = T_strtod(argv[0] + 2, 0);
-		else if (argv[0][1] == 'C')
-			Dversion = 0;
-		else if (argv[0][1] == 'n')
-			demangleSymbols = false;
-		else if (argv[0][1] == 'e')
-			useTypedefEnum = true;
-		else if (!T_strncmp(&argv[0][1], TEXT("debug"), 5)) // debug[level]
-		{
-			debug = (DebugLevel)T_strtoul(&argv[0][6], 0, 0);
-			if (!debug) {
-				debug = DbgBasic;
-			}
-
-			fprintf(stderr, "Debug set to %x\n", debug);
-		}
-		else if (argv[0][1] == 's' && argv[0][2])
-			dotReplacementChar = (char)argv[0][2];
-		else if (argv[0][1] == 'p' && argv[0][2])
-			pdbref = argv[0] + 2;
-		else if (argv[0][1] == 'l' && argv[0][2])
-			debug_link = argv[0] + 2;
-		else
-			fatal("unknown option: " SARG, argv[0]);
-	}
-
-	if (argc < 2)
-	{
-		printf("Convert DMD CodeView/DWARF debug information to PDB files, Version %.02f\n", VERSION);
-		printf("Copyright (c) 2009-2012 by Rainer Schuetze, All Rights Reserved\n");
-		printf("\n");
-		printf("License for redistribution is given by the Artistic License 2.0\n");
-		printf("see file LICENSE for further details\n");
-		printf("\n");
-		printf("usage: " SARG " [-D<version>|-C|-n|-e|-s<C>|-p<embedded-pdb>|-l<debug-link>] <exe-file> [new-exe-file] [pdb-file]\n", argv[0]);
-		return -1;
-	}
+// Format the error of a conversion and return false. Unlike fatal(), this
+// doesn't terminate the process, so that the other files of a batch are
+// still converted.
+static bool convertError(std::string& error, const char *message, ...)
+{
+	char buf[1024];
+	va_list argptr;
+	va_start(argptr, message);
+	vsnprintf(buf, sizeof(buf), message, argptr);
+	va_end(argptr);
+	error = buf;
+	return false;
+}
 
+// Convert the debug information of one executable, writing the image to
+// outname and the PDB to pdbfile. Both default to names derived from exename
+// if null.
+static bool convertImage(const ConvertOptions& opt, const TCHAR* exename, const TCHAR* outname, const TCHAR* pdbfile,
+                         std::string& error)
+{
 	PEImage exe, dbg, *img = NULL;
 	TCHAR dbgname[MAX_PATH];
 
-	if (!exe.loadExe(argv[1]))
-		fatal(SARG ": %s", argv[1], exe.getLastError());
+	exe.numThreads = dbg.numThreads = opt.numThreads;
+	if (!exe.loadExe(exename))
+		return convertError(error, SARG ": %s", exename, exe.getLastError());
 	if (exe.countCVEntries() || exe.hasDWARF())
 		img = &exe;
 	else
 	{
 		struct _stat buffer;
 
-		if (debug_link || exe.hasDebugLink())
+		if (opt.debug_link || exe.hasDebugLink())
 		{
 			img = &exe;
-			extractDebugLink(exe, dbgname, argv[1], debug_link);
+			extractDebugLink(exe, dbgname, exename, opt.debug_link);
 		}
 		else {
 			img = &dbg;
-			changeExtension(dbgname, argv[1], TEXT(".dbg"));
+			changeExtension(dbgname, exename, TEXT(".dbg"));
 		}
 		// try separate debug file
 		if (T_stat(dbgname, &buffer) != 0)
-			fatal(SARG ": no debug entries found", argv[1]);
+			return convertError(error, SARG ": no debug entries found", exename);
 		if (!dbg.loadExe(dbgname))
-			fatal(SARG ": %s", dbgname, dbg.getLastError());
+			return convertError(error, SARG ": %s", dbgname, dbg.getLastError());
 		if (dbg.countCVEntries() == 0 && !dbg.hasDWARF())
-			fatal(SARG ": no debug entries found", dbgname);
+			return convertError(error, SARG ": no debug entries found", dbgname);
 	}
 
-	CV2PDB cv2pdb(*img, dbg.hasDWARF() ? &dbg : NULL, debug);
-	cv2pdb.Dversion = Dversion;
+	CV2PDB cv2pdb(*img, dbg.hasDWARF() ? &dbg : NULL, opt.debug);
+	cv2pdb.Dversion = opt.Dversion;
+	cv2pdb.numThreads = opt.numThreads;
 	cv2pdb.initLibraries();
 
-	TCHAR* outname = argv[1];
-	if (argc > 2 && argv[2][0])
-		outname = argv[2];
+	if (!outname)
+		outname = exename;
 
 	TCHAR pdbname[260];
-	if (argc > 3)
-		T_strcpy (pdbname, argv[3]);
+	if (pdbfile)
+		T_strcpy (pdbname, pdbfile);
 	else
 	{
 		T_strcpy (pdbname, outname);
@@ -291,59 +276,251 @@ int T_main(int argc, TCHAR* argv[])
 
 	T_unlink(pdbname);
 
-	if(!cv2pdb.openPDB(pdbname, pdbref))
-		fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+	if(!cv2pdb.openPDB(pdbname, opt.pdbref))
+		return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 	if(exe.hasDWARF() || dbg.hasDWARF())
 	{
 		if(!exe.relocateDebugLineInfo(0x400000))
-			fatal(SARG ": %s", argv[1], cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", exename, cv2pdb.getLastError());
 
 		if(!cv2pdb.createDWARFModules())
-			fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 		if(!cv2pdb.addDWARFSymbols())
-			fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 		if(!cv2pdb.addDWARFLines())
-			fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 		if (!cv2pdb.addDWARFPublics())
-			fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 		if (!cv2pdb.writeDWARFImage(outname))
-			fatal(SARG ": %s", outname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", outname, cv2pdb.getLastError());
 	}
 	else
 	{
 		if (!cv2pdb.initSegMap())
-			fatal(SARG ": %s", argv[1], cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", exename, cv2pdb.getLastError());
 
 		if (!cv2pdb.initGlobalSymbols())
-			fatal(SARG ": %s", argv[1], cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", exename, cv2pdb.getLastError());
 
 		if (!cv2pdb.initGlobalTypes())
-			fatal(SARG ": %s", argv[1], cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", exename, cv2pdb.getLastError());
 
 		if (!cv2pdb.createModules())
-			fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 		if (!cv2pdb.addTypes())
-			fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 		if (!cv2pdb.addSymbols())
-			fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 		if (!cv2pdb.addSrcLines())
-			fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 		if (!cv2pdb.addPublics())
-			fatal(SARG ": %s", pdbname, cv2pdb.getLastError());
+			return convertError(error, SARG ": %s", pdbname, cv2pdb.getLastError());
 
 		if (!exe.isDBG())
 			if (!cv2pdb.writeImage(outname, exe))
-				fatal(SARG ": %s", outname, cv2pdb.getLastError());
+				return convertError(error, SARG ": %s", outname, cv2pdb.getLastError());
+	}
+
+	return true;
+}
+
+typedef std::basic_string<TCHAR> tstring;
+
+// One line of a batch list file: <exe-file> [new-exe-file] [pdb-file],
+// separated by white space. Names containing spaces can be quoted.
+struct BatchEntry
+{
+	tstring args[3];
+	int cntArgs = 0;
+	std::string error;
+	bool ok = false;
+};
+
+static bool readBatchList(const TCHAR* listname, std::vector<BatchEntry>& entries)
+{
+	FILE* f = T_fopen(listname, TEXT("rb"));
+	if (!f)
+		return false;
+
+	char line[3 * MAX_PATH + 16];
+	while (fgets(line, sizeof(line), f))
+	{
+		BatchEntry entry;
+		for (char* p = line; entry.cntArgs < 3; )
+		{
+			while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+				p++;
+			if (!*p)
+				break;
+
+			std::string arg;
+			if (*p == '"')
+			{
+				for (p++; *p && *p != '"'; p++)
+					arg += *p;
+				if (*p)
+					p++;
+			}
+			else
+			{
+				for (; *p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'; p++)
+					arg += *p;
+			}
+#ifdef UNICODE
+			TCHAR warg[MAX_PATH];
+			if (!MultiByteToWideChar(CP_UTF8, 0, arg.c_str(), -1, warg, MAX_PATH))
+				warg[0] = 0;
+			entry.args[entry.cntArgs++] = warg;
+#else
+			entry.args[entry.cntArgs++] = arg;
+#endif
+		}
+		if (entry.cntArgs > 0)
+			entries.push_back(std::move(entry));
+	}
+	fclose(f);
+	return true;
+}
+
+// Convert the files listed in listname on opt.numThreads threads. Each
+// thread takes the next pending file when done with its current one, the
+// compilation units of a file are not converted in parallel. A failing file
+// is reported and doesn't affect the others.
+static int convertBatch(const ConvertOptions& opt, const TCHAR* listname)
+{
+	std::vector<BatchEntry> entries;
+	if (!readBatchList(listname, entries))
+		fatal(SARG ": cannot read batch list", listname);
+
+	// Load the PDB DLL once before the threads start, they only use it.
+	if (!initMsPdb())
+		fatal("cannot load PDB helper DLL");
+
+	ConvertOptions fileOpt = opt;
+	fileOpt.numThreads = 1;
+
+	const size_t cntFiles = entries.size();
+	std::atomic<size_t> nextFile(0);
+	auto convertFiles = [&]()
+	{
+		for (size_t f = nextFile++; f < cntFiles; f = nextFile++)
+		{
+			BatchEntry& entry = entries[f];
+			const TCHAR* exename = entry.args[0].c_str();
+			const TCHAR* outname = entry.cntArgs > 1 && !entry.args[1].empty() ? entry.args[1].c_str() : 0;
+			const TCHAR* pdbname = entry.cntArgs > 2 ? entry.args[2].c_str() : 0;
+			entry.ok = convertImage(fileOpt, exename, outname, pdbname, entry.error);
+			if (entry.ok)
+				printf(SARG ": ok\n", exename);
+			else
+				printf("%s\n", entry.error.c_str());
+		}
+	};
+
+	size_t cntThreads = (size_t)opt.numThreads < cntFiles ? opt.numThreads : cntFiles;
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < cntThreads; t++)
+		threads.emplace_back(convertFiles);
+	convertFiles();
+	for (std::thread& t : threads)
+		t.join();
+
+	int cntFailed = 0;
+	for (const BatchEntry& entry : entries)
+		if (!entry.ok)
+			cntFailed++;
+	printf("%d of %d files converted\n", (int)cntFiles - cntFailed, (int)cntFiles);
+	return cntFailed ? 1 : 0;
+}
+
+int T_main(int argc, TCHAR* argv[])
+{
+	ConvertOptions opt;
+	const TCHAR* batchList = 0;
+
+	CoInitialize(nullptr);
+
+	while (argc > 1 && argv[1][0] == '-')
+	{
+		argv++;
+		argc--;
+		if (argv[0][1] == '-')
+		{
+			if (T_strcmp(argv[0], TEXT("--native-pdb")) == 0)
+				mspdb::nativeWriter = true;
+			else if (T_strcmp(argv[0], TEXT("--batch")) == 0 && argc >= 2)
+			{
+				batchList = argv[1];
+				argv++;
+				argc--;
+			}
+			else
+				break;
+		}
+		else if (argv[0][1] == 'D')
+			opt.Dversion = T_strtod(argv[0] + 2, 0);
+		else if (argv[0][1] == 'C')
+			opt.Dversion = 0;
+		else if (argv[0][1] == 'n')
+			demangleSymbols = false;
+		else if (argv[0][1] == 'e')
+			useTypedefEnum = true;
+		else if (!T_strncmp(&argv[0][1], TEXT("debug"), 5)) // debug[level]
+		{
+			opt.debug = (DebugLevel)T_strtoul(&argv[0][6], 0, 0);
+			if (!opt.debug) {
+				opt.debug = DbgBasic;
+			}
+
+			fprintf(stderr, "Debug set to %x\n", opt.debug);
+		}
+		else if (argv[0][1] == 's' && argv[0][2])
+			dotReplacementChar = (char)argv[0][2];
+		else if (argv[0][1] == 'p' && argv[0][2])
+			opt.pdbref = argv[0] + 2;
+		else if (argv[0][1] == 'l' && argv[0][2])
+			opt.debug_link = argv[0] + 2;
+		else if (argv[0][1] == 'j') // j[threads]
+		{
+			opt.numThreads = argv[0][2] ? T_strtoul(argv[0] + 2, 0, 0) : std::thread::hardware_concurrency();
+			if (opt.numThreads < 1)
+				opt.numThreads = 1;
+		}
+		else
+			fatal("unknown option: " SARG, argv[0]);
 	}
 
+	if (batchList)
+		return convertBatch(opt, batchList);
+
+	if (argc < 2)
+	{
+		printf("Convert DMD CodeView/DWARF debug information to PDB files, Version %.02f\n", VERSION);
+		printf("Copyright (c) 2009-2012 by Rainer Schuetze, All Rights Reserved\n");
+		printf("\n");
+		printf("License for redistribution is given by the Artistic License 2.0\n");
+		printf("see file LICENSE for further details\n");
+		printf("\n");
+		printf("usage: " SARG " [-D<version>|-C|-n|-e|-s<C>|-p<embedded-pdb>|-l<debug-link>|-j[<threads>]|--native-pdb] <exe-file> [new-exe-file] [pdb-file]\n", argv[0]);
+		printf("       " SARG " [options] --batch <list-file>\n", argv[0]);
+		printf("         converts the files listed in <list-file>, one \"<exe-file> [new-exe-file] [pdb-file]\" per line\n");
+		return -1;
+	}
+
+	std::string error;
+	const TCHAR* outname = argc > 2 && argv[2][0] ? argv[2] : 0;
+	const TCHAR* pdbname = argc > 3 ? argv[3] : 0;
+	if (!convertImage(opt, argv[1], outname, pdbname, error))
+		fatal("%s", error.c_str());
+
 	return 0;
 }
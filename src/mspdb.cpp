@@ -29,6 +29,7 @@ char* mspdb140_dll = "mspdb140.dll";
 // char* mspdb110shell_dll = "mspdbst.dll"; // the VS 2012 Shell uses this file instead of mspdb110.dll, but is missing mspdbsrv.exe
 
 int mspdb::vsVersion = 8;
+bool mspdb::nativeWriter = false;
 
 // verify mspdbsrv.exe is found in the same path
 void tryLoadLibrary(const char* mspdb)
@@ -323,6 +324,13 @@ void tryLoadMsPdb140(bool throughPath)
 
 bool initMsPdb()
 {
+	// the built-in writer creates PDB files in the format of mspdb140.dll
+	if (mspdb::nativeWriter)
+	{
+		mspdb::vsVersion = 14;
+		return true;
+	}
+
 #if 0 // might cause problems when combining VS Shell 2010 with VS 2008 or similar
 	if(const char* p = getenv("VisualStudioDir"))
 	{
@@ -349,7 +357,12 @@ bool initMsPdb()
 	tryLoadMsPdb80(false);
 
 	if (!modMsPdb)
-		return false;
+	{
+		// no DLL found, fall back to the built-in writer
+		mspdb::nativeWriter = true;
+		mspdb::vsVersion = 14;
+		return true;
+	}
 
 	if (!pPDBOpen2W)
 		pPDBOpen2W = (mspdb::fnPDBOpen2W*) GetProcAddress(modMsPdb, "PDBOpen2W");
@@ -368,11 +381,19 @@ bool exitMsPdb()
 	return true;
 }
 
-mspdb::PDB* CreatePDB(const wchar_t* pdbname)
+mspdb::PDB* CreatePDB(const wchar_t* pdbname, int numThreads)
 {
 	if (!initMsPdb ())
 		return 0;
 
+	if (mspdb::nativeWriter)
+	{
+		char pdbnameA[MAX_PATH * 3];
+		if (!WideCharToMultiByte(CP_UTF8, 0, pdbname, -1, pdbnameA, sizeof(pdbnameA), 0, 0))
+			return 0;
+		return (mspdb::PDB*) pdbw::PDB::Create(pdbnameA, numThreads);
+	}
+
 	mspdb::PDB* pdb = 0;
 	long data[194] = { 193, 0 };
 	wchar_t ext[256] = L".exe";
@@ -8,6 +8,7 @@
 #define __MSPDB_H__
 
 #include <stdio.h>
+#include "pdbwriter.h"
 
 namespace mspdb
 {
@@ -39,20 +40,21 @@ struct EnumNameMap;
 #define MRECmp MRECmp2
 #define PDBCommon PDB
 #define SrcCommon Src
-#define ModCommon Mod
+#define ModCommon Mod_VS
 
 #define MREUtil2 MREUtil
 #define MREFile2 MREFile
 #define MREBag2 MREBag
-#define Mod2 Mod
+#define Mod2 Mod_VS
 #define GSI2 GSI
-#define TPI2 TPI
+#define TPI2 TPI_VS
 #define NameMap2 NameMap
 #define EnumNameMap2 EnumNameMap
 
 struct DBI;
 
 extern int vsVersion;
+extern bool nativeWriter; // use pdbw::PDB instead of mspdb*.dll
 
 /*
 #define DBICommon DBI
@@ -257,31 +259,59 @@ struct PDB
 public:
 	static int __cdecl Open2W(unsigned short const *path,char const *mode,long *p,unsigned short *ext,unsigned int flags,struct PDB **pPDB);
 
-	unsigned long QueryAge() { return vs10.QueryAge(); }
-	int CreateDBI(char const *n,struct DBI * *pdbi) { return vs10.CreateDBI(n, pdbi); }
-	int OpenTpi(char const *n,struct TPI * *ptpi)  { return vs10.OpenTpi(n, ptpi); }
-	long QueryLastError(char * const lastErr) { return vs10.QueryLastError(lastErr); }
+	unsigned long QueryAge()
+	{
+		if(nativeWriter)
+			return ((pdbw::PDB*)this)->QueryAge();
+		return vs10.QueryAge();
+	}
+	int CreateDBI(char const *n,struct DBI * *pdbi)
+	{
+		if(nativeWriter)
+			return ((pdbw::PDB*)this)->CreateDBI(n, (pdbw::DBI**)pdbi);
+		return vs10.CreateDBI(n, pdbi);
+	}
+	int OpenTpi(char const *n,struct TPI * *ptpi)
+	{
+		if(nativeWriter)
+			return ((pdbw::PDB*)this)->OpenTpi(n, (pdbw::TPI**)ptpi);
+		return vs10.OpenTpi(n, ptpi);
+	}
+	long QueryLastError(char * const lastErr)
+	{
+		if(nativeWriter)
+			return ((pdbw::PDB*)this)->QueryLastError(lastErr);
+		return vs10.QueryLastError(lastErr);
+	}
 
 	int Commit()
 	{
+		if(nativeWriter)
+			return ((pdbw::PDB*)this)->Commit();
 		if(vsVersion >= 11)
 			return ((PDB_VS11*)&vs10)->Commit();
 		return vs10.Commit();
 	}
 	int Close()
 	{
+		if(nativeWriter)
+			return ((pdbw::PDB*)this)->Close();
 		if(vsVersion >= 11)
 			return ((PDB_VS11*)&vs10)->Close();
 		return vs10.Close();
 	}
 	int QuerySignature2(struct _GUID *guid)
 	{
+		if(nativeWriter)
+			return ((pdbw::PDB*)this)->QuerySignature2((unsigned char*)guid);
 		if(vsVersion >= 11)
 			return ((PDB_VS11*)&vs10)->QuerySignature2(guid);
 		return vs10.QuerySignature2(guid);
 	}
 	int OpenIpi(char const *name,struct TPI * *ipi)
 	{
+		if(nativeWriter)
+			return ((pdbw::PDB*)this)->OpenIpi(name, (pdbw::TPI**)ipi);
 		if(vsVersion >= 11)
 			return ((PDB_VS11*)&vs10)->OpenIpi(name, ipi);
 		return 0;
@@ -358,18 +388,18 @@ struct TypeData
 
 #include "poppack.h"
 
-struct Mod {
-public: virtual unsigned long Mod::QueryInterfaceVersion(void);
-public: virtual unsigned long Mod::QueryImplementationVersion(void);
-public: virtual int Mod::AddTypes(unsigned char *pTypeData,long cbTypeData);
-public: virtual int Mod::AddSymbols(unsigned char *pSymbolData,long cbSymbolData);
+struct Mod_VS {
+public: virtual unsigned long Mod_VS::QueryInterfaceVersion(void);
+public: virtual unsigned long Mod_VS::QueryImplementationVersion(void);
+public: virtual int Mod_VS::AddTypes(unsigned char *pTypeData,long cbTypeData);
+public: virtual int Mod_VS::AddSymbols(unsigned char *pSymbolData,long cbSymbolData);
 public: virtual int Mod2::AddPublic(char const *,unsigned short,long); // forwards to AddPublic2(...,0)
 public: virtual int ModCommon::AddLines(char const *fname,unsigned short sec,long off,long size,long off2,unsigned short firstline,unsigned char *pLineInfo,long cbLineInfo); // forwards to AddLinesW
 public: virtual int Mod2::AddSecContrib(unsigned short sec,long off,long size,unsigned long secflags); // forwards to Mod2::AddSecContribEx(..., 0, 0)
 public: virtual int ModCommon::QueryCBName(long *);
 public: virtual int ModCommon::QueryName(char * const,long *);
-public: virtual int Mod::QuerySymbols(unsigned char *,long *);
-public: virtual int Mod::QueryLines(unsigned char *,long *);
+public: virtual int Mod_VS::QuerySymbols(unsigned char *,long *);
+public: virtual int Mod_VS::QueryLines(unsigned char *,long *);
 public: virtual int Mod2::SetPvClient(void *);
 public: virtual int Mod2::GetPvClient(void * *);
 public: virtual int Mod2::QueryFirstCodeSecContrib(unsigned short *,long *,long *,unsigned long *);
@@ -378,25 +408,25 @@ public: virtual int Mod2::QueryDBI(struct DBI * *);
 public: virtual int Mod2::Close(void);
 public: virtual int ModCommon::QueryCBFile(long *);
 public: virtual int ModCommon::QueryFile(char * const,long *);
-public: virtual int Mod::QueryTpi(struct TPI * *);
+public: virtual int Mod_VS::QueryTpi(struct TPI * *);
 public: virtual int Mod2::AddSecContribEx(unsigned short sec,long off,long size,unsigned long secflags,unsigned long crc/*???*/,unsigned long);
-public: virtual int Mod::QueryItsm(unsigned short *);
+public: virtual int Mod_VS::QueryItsm(unsigned short *);
 public: virtual int ModCommon::QuerySrcFile(char * const,long *);
-public: virtual int Mod::QuerySupportsEC(void);
+public: virtual int Mod_VS::QuerySupportsEC(void);
 public: virtual int ModCommon::QueryPdbFile(char * const,long *);
-public: virtual int Mod::ReplaceLines(unsigned char *,long);
-public: virtual bool Mod::GetEnumLines(struct EnumLines * *);
-public: virtual bool Mod::QueryLineFlags(unsigned long *);
-public: virtual bool Mod::QueryFileNameInfo(unsigned long,unsigned short *,unsigned long *,unsigned long *,unsigned char *,unsigned long *);
-public: virtual int Mod::AddPublicW(unsigned short const *,unsigned short,long,unsigned long);
-public: virtual int Mod::AddLinesW(unsigned short const *fname,unsigned short sec,long off,long size,long off2,unsigned long firstline,unsigned char *plineInfo,long cbLineInfo);
-public: virtual int Mod::QueryNameW(unsigned short * const,long *);
-public: virtual int Mod::QueryFileW(unsigned short * const,long *);
-public: virtual int Mod::QuerySrcFileW(unsigned short * const,long *);
-public: virtual int Mod::QueryPdbFileW(unsigned short * const,long *);
+public: virtual int Mod_VS::ReplaceLines(unsigned char *,long);
+public: virtual bool Mod_VS::GetEnumLines(struct EnumLines * *);
+public: virtual bool Mod_VS::QueryLineFlags(unsigned long *);
+public: virtual bool Mod_VS::QueryFileNameInfo(unsigned long,unsigned short *,unsigned long *,unsigned long *,unsigned char *,unsigned long *);
+public: virtual int Mod_VS::AddPublicW(unsigned short const *,unsigned short,long,unsigned long);
+public: virtual int Mod_VS::AddLinesW(unsigned short const *fname,unsigned short sec,long off,long size,long off2,unsigned long firstline,unsigned char *plineInfo,long cbLineInfo);
+public: virtual int Mod_VS::QueryNameW(unsigned short * const,long *);
+public: virtual int Mod_VS::QueryFileW(unsigned short * const,long *);
+public: virtual int Mod_VS::QuerySrcFileW(unsigned short * const,long *);
+public: virtual int Mod_VS::QueryPdbFileW(unsigned short * const,long *);
 public: virtual int Mod2::AddPublic2(char const *name,unsigned short sec,long off,unsigned long type);
-public: virtual int Mod::InsertLines(unsigned char *,long);
-public: virtual int Mod::QueryLines2(long,unsigned char *,long *);
+public: virtual int Mod_VS::InsertLines(unsigned char *,long);
+public: virtual int Mod_VS::QueryLines2(long,unsigned char *,long *);
 // mspdb140.dll:
 public: virtual int QueryCrossScopeExports(unsigned long,unsigned char *,unsigned long *);
 public: virtual int QueryCrossScopeImports(unsigned long,unsigned char *,unsigned long *);
@@ -426,6 +456,60 @@ public: virtual int EnCReleaseCompilerGeneratedPDB_alias(unsigned char *,unsigne
 // mspdb140.dll!Mod_Proxy2::`vector deleting destructor'(unsigned int)
 };
 
+struct Mod
+{
+	Mod_VS vs;
+
+	unsigned long QueryInterfaceVersion()
+	{
+		if(nativeWriter)
+			return ((pdbw::Mod*)this)->QueryInterfaceVersion();
+		return vs.QueryInterfaceVersion();
+	}
+	unsigned long QueryImplementationVersion()
+	{
+		if(nativeWriter)
+			return ((pdbw::Mod*)this)->QueryImplementationVersion();
+		return vs.QueryImplementationVersion();
+	}
+	int AddTypes(unsigned char *pTypeData,long cbTypeData)
+	{
+		if(nativeWriter)
+			return ((pdbw::Mod*)this)->AddTypes(pTypeData, cbTypeData);
+		return vs.AddTypes(pTypeData, cbTypeData);
+	}
+	int AddSymbols(unsigned char *pSymbolData,long cbSymbolData)
+	{
+		if(nativeWriter)
+			return ((pdbw::Mod*)this)->AddSymbols(pSymbolData, cbSymbolData);
+		return vs.AddSymbols(pSymbolData, cbSymbolData);
+	}
+	int AddPublic2(char const *name,unsigned short sec,long off,unsigned long type)
+	{
+		if(nativeWriter)
+			return ((pdbw::Mod*)this)->AddPublic2(name, sec, off, type);
+		return vs.AddPublic2(name, sec, off, type);
+	}
+	int AddLines(char const *fname,unsigned short sec,long off,long size,long off2,unsigned short firstline,unsigned char *pLineInfo,long cbLineInfo)
+	{
+		if(nativeWriter)
+			return ((pdbw::Mod*)this)->AddLines(fname, sec, off, size, off2, firstline, pLineInfo, cbLineInfo);
+		return vs.AddLines(fname, sec, off, size, off2, firstline, pLineInfo, cbLineInfo);
+	}
+	int AddSecContrib(unsigned short sec,long off,long size,unsigned long secflags)
+	{
+		if(nativeWriter)
+			return ((pdbw::Mod*)this)->AddSecContrib(sec, off, size, secflags);
+		return vs.AddSecContrib(sec, off, size, secflags);
+	}
+	int Close()
+	{
+		if(nativeWriter)
+			return ((pdbw::Mod*)this)->Close();
+		return vs.Close();
+	}
+};
+
 
 struct DBI_part1 {
 public: virtual unsigned long QueryImplementationVersion(void);
@@ -510,20 +594,49 @@ struct DBI
 {
     DBI_VS9 vs9;
 
-    unsigned long QueryImplementationVersion() { return vs9.QueryImplementationVersion(); }
-    unsigned long QueryInterfaceVersion() { return vs9.QueryInterfaceVersion(); }
-    int Close() { return vs9.Close(); }
-    int OpenMod(char const *objName,char const *libName,struct Mod * *pmod) { return vs9.OpenMod(objName,libName,pmod); }
-    int AddSec(unsigned short sec,unsigned short flags,long offset,long cbseg) { return vs9.AddSec(sec,flags,offset,cbseg); }
+    unsigned long QueryImplementationVersion()
+    {
+        if(nativeWriter)
+            return ((pdbw::DBI*)this)->QueryImplementationVersion();
+        return vs9.QueryImplementationVersion();
+    }
+    unsigned long QueryInterfaceVersion()
+    {
+        if(nativeWriter)
+            return ((pdbw::DBI*)this)->QueryInterfaceVersion();
+        return vs9.QueryInterfaceVersion();
+    }
+    int Close()
+    {
+        if(nativeWriter)
+            return ((pdbw::DBI*)this)->Close();
+        return vs9.Close();
+    }
+    int OpenMod(char const *objName,char const *libName,struct Mod * *pmod)
+    {
+        if(nativeWriter)
+            return ((pdbw::DBI*)this)->OpenMod(objName, libName, (pdbw::Mod**)pmod);
+        return vs9.OpenMod(objName,libName,pmod);
+    }
+    int AddSec(unsigned short sec,unsigned short flags,long offset,long cbseg)
+    {
+        if(nativeWriter)
+            return ((pdbw::DBI*)this)->AddSec(sec, flags, offset, cbseg);
+        return vs9.AddSec(sec,flags,offset,cbseg);
+    }
 
     int AddPublic2(char const *name,unsigned short sec,long off,unsigned long type)
     {
+        if(nativeWriter)
+            return ((pdbw::DBI*)this)->AddPublic2(name, sec, off, type);
         if(vsVersion >= 10)
             return ((DBI_VS10*) &vs9)->AddPublic2(name, sec, off, type);
         return vs9.AddPublic2(name, sec, off, type);
     }
     void SetMachineType(unsigned short type)
     {
+        if(nativeWriter)
+            return ((pdbw::DBI*)this)->SetMachineType(type);
         if(vsVersion >= 10)
             return ((DBI_VS10*) &vs9)->SetMachineType(type);
         return vs9.SetMachineType(type);
@@ -556,34 +669,58 @@ public: virtual unsigned char * GSI2::HashSymW2(unsigned short const *,unsigned
 public: virtual int GSI::getEnumByAddr(struct EnumSyms * *);
 };
 
-struct TPI {
-public: virtual unsigned long TPI::QueryInterfaceVersion(void);
-public: virtual unsigned long TPI::QueryImplementationVersion(void);
-public: virtual int TPI::QueryTi16ForCVRecord(unsigned char *,unsigned short *);
-public: virtual int TPI::QueryCVRecordForTi16(unsigned short,unsigned char *,long *);
-public: virtual int TPI::QueryPbCVRecordForTi16(unsigned short,unsigned char * *);
-public: virtual unsigned short TPI::QueryTi16Min(void);
-public: virtual unsigned short TPI::QueryTi16Mac(void);
-public: virtual long TPI::QueryCb(void);
-public: virtual int TPI::Close(void);
-public: virtual int TPI::Commit(void);
-public: virtual int TPI::QueryTi16ForUDT(char const *,int,unsigned short *);
-public: virtual int TPI::SupportQueryTiForUDT(void);
-public: virtual int TPI::fIs16bitTypePool(void);
-public: virtual int TPI::QueryTiForUDT(char const *,int,unsigned long *);
+struct TPI_VS {
+public: virtual unsigned long TPI_VS::QueryInterfaceVersion(void);
+public: virtual unsigned long TPI_VS::QueryImplementationVersion(void);
+public: virtual int TPI_VS::QueryTi16ForCVRecord(unsigned char *,unsigned short *);
+public: virtual int TPI_VS::QueryCVRecordForTi16(unsigned short,unsigned char *,long *);
+public: virtual int TPI_VS::QueryPbCVRecordForTi16(unsigned short,unsigned char * *);
+public: virtual unsigned short TPI_VS::QueryTi16Min(void);
+public: virtual unsigned short TPI_VS::QueryTi16Mac(void);
+public: virtual long TPI_VS::QueryCb(void);
+public: virtual int TPI_VS::Close(void);
+public: virtual int TPI_VS::Commit(void);
+public: virtual int TPI_VS::QueryTi16ForUDT(char const *,int,unsigned short *);
+public: virtual int TPI_VS::SupportQueryTiForUDT(void);
+public: virtual int TPI_VS::fIs16bitTypePool(void);
+public: virtual int TPI_VS::QueryTiForUDT(char const *,int,unsigned long *);
 public: virtual int TPI2::QueryTiForCVRecord(unsigned char *,unsigned long *);
 public: virtual int TPI2::QueryCVRecordForTi(unsigned long,unsigned char *,long *);
 public: virtual int TPI2::QueryPbCVRecordForTi(unsigned long,unsigned char * *);
-public: virtual unsigned long TPI::QueryTiMin(void);
-public: virtual unsigned long TPI::QueryTiMac(void);
-public: virtual int TPI::AreTypesEqual(unsigned long,unsigned long);
+public: virtual unsigned long TPI_VS::QueryTiMin(void);
+public: virtual unsigned long TPI_VS::QueryTiMac(void);
+public: virtual int TPI_VS::AreTypesEqual(unsigned long,unsigned long);
 public: virtual int TPI2::IsTypeServed(unsigned long);
-public: virtual int TPI::QueryTiForUDTW(unsigned short const *,int,unsigned long *);
+public: virtual int TPI_VS::QueryTiForUDTW(unsigned short const *,int,unsigned long *);
 // mspdb140.dll!TPI_Proxy::QueryModSrcLineForUDTDefn(unsigned long,unsigned short *,unsigned long *,unsigned long *)
 // mspdb140.dll!TPI_Proxy2::QueryTIsForCVRecords(unsigned char *,unsigned long,unsigned long,unsigned long,unsigned long *)
 // mspdb140.dll!TPI_Proxy2::`vector deleting destructor'(unsigned int)
 };
 
+struct TPI
+{
+	TPI_VS vs;
+
+	unsigned long QueryInterfaceVersion()
+	{
+		if(nativeWriter)
+			return ((pdbw::TPI*)this)->QueryInterfaceVersion();
+		return vs.QueryInterfaceVersion();
+	}
+	unsigned long QueryImplementationVersion()
+	{
+		if(nativeWriter)
+			return ((pdbw::TPI*)this)->QueryImplementationVersion();
+		return vs.QueryImplementationVersion();
+	}
+	int Close()
+	{
+		if(nativeWriter)
+			return ((pdbw::TPI*)this)->Close();
+		return vs.Close();
+	}
+};
+
 
 struct NameMap {
 public: virtual int NameMap::close(void);
@@ -622,7 +759,7 @@ public: virtual void EnumNameMap_Special::get(char const * *,unsigned long *);
 bool initMsPdb();
 bool exitMsPdb();
 
-mspdb::PDB* CreatePDB(const wchar_t* pdbname);
+mspdb::PDB* CreatePDB(const wchar_t* pdbname, int numThreads);
 
 extern char* mspdb_dll;
 
@@ -0,0 +1,1343 @@
+// Convert DMD CodeView debug information to PDB files
+// Copyright (c) 2009-2010 by Rainer Schuetze, All Rights Reserved
+//
+// License for redistribution is given by the Artistic License 2.0
+// see file LICENSE for further details
+
+// The layout of the MSF container and the streams follows the description
+// of the PDB format by the LLVM project (llvm.org/docs/PDB) and the reference
+// implementation published by Microsoft (github.com/Microsoft/microsoft-pdb).
+// The host is assumed to be little endian like the PDB format.
+
+#include "pdbwriter.h"
+
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <thread>
+#include <unordered_set>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace pdbw
+{
+
+namespace
+{
+
+const unsigned int kBlockSize = 4096;
+const unsigned int kMaxBlockMapEntries = kBlockSize / 4;
+
+// fixed stream numbers, the module streams follow
+enum
+{
+	kStreamOldDirectory,
+	kStreamInfo,
+	kStreamTPI,
+	kStreamDBI,
+	kStreamIPI,
+	kStreamTPIHash,
+	kStreamIPIHash,
+	kStreamGlobals,
+	kStreamPublics,
+	kStreamSymRecords,
+	kStreamNames,
+	kStreamLinkInfo,
+	kStreamFirstModule
+};
+
+const unsigned int kPdbVersion = 20000404;   // VC70
+const unsigned int kPdbFeatureVC140 = 20140508;
+const unsigned int kTpiVersion = 20040203;   // V80
+const unsigned int kTpiHeaderSize = 56;
+const unsigned int kTpiHashBuckets = 0x3ffff;
+const unsigned int kFirstTypeIndex = 0x1000;
+const unsigned int kDbiVersion = 19990903;   // V70
+const unsigned int kSecContribVersion = 0xeffe0000 + 19970605;
+const unsigned int kGsiVersion = 0xeffe0000 + 19990810;
+const unsigned int kGsiHashBuckets = 4096;
+const unsigned int kNamesSignature = 0xeffeeffe;
+const unsigned int kCVSignatureC13 = 4;
+
+const unsigned int DEBUG_S_IGNORE = 0x80000000;
+const unsigned int DEBUG_S_SYMBOLS = 0xf1;
+const unsigned int DEBUG_S_LINES = 0xf2;
+const unsigned int DEBUG_S_STRINGTABLE = 0xf3;
+const unsigned int DEBUG_S_FILECHKSMS = 0xf4;
+
+const unsigned short S_END = 0x0006;
+const unsigned short S_THUNK_V3 = 0x1102;
+const unsigned short S_BLOCK_V3 = 0x1103;
+const unsigned short S_WITH_V3 = 0x1104;
+const unsigned short S_CONSTANT_V3 = 0x1107;
+const unsigned short S_UDT_V3 = 0x1108;
+const unsigned short S_LDATA_V3 = 0x110c;
+const unsigned short S_GDATA_V3 = 0x110d;
+const unsigned short S_PUB_V3 = 0x110e;
+const unsigned short S_LPROC_V3 = 0x110f;
+const unsigned short S_GPROC_V3 = 0x1110;
+const unsigned short S_LTHREAD_V3 = 0x1112;
+const unsigned short S_GTHREAD_V3 = 0x1113;
+const unsigned short S_PROCREF_V3 = 0x1125;
+const unsigned short S_DATAREF_V3 = 0x1126;
+const unsigned short S_LPROCREF_V3 = 0x1127;
+const unsigned short S_SEPCODE_V3 = 0x1132;
+const unsigned short S_LPROC32_ID = 0x1146;
+const unsigned short S_GPROC32_ID = 0x1147;
+const unsigned short S_INLINESITE = 0x114d;
+const unsigned short S_INLINESITE_END = 0x114e;
+const unsigned short S_PROC_ID_END = 0x114f;
+const unsigned short S_LPROC32_DPC = 0x1155;
+const unsigned short S_LPROC32_DPC_ID = 0x1156;
+const unsigned short S_INLINESITE2 = 0x115d;
+
+const unsigned short LF_CLASS_V3 = 0x1504;
+const unsigned short LF_STRUCTURE_V3 = 0x1505;
+const unsigned short LF_UNION_V3 = 0x1506;
+const unsigned short LF_ENUM_V3 = 0x1507;
+const unsigned short LF_INTERFACE_V3 = 0x1519;
+const unsigned short LF_NUMERIC = 0x8000;
+const unsigned short LF_VARSTRING = 0x8010;
+
+const unsigned short kPropFwdRef = 0x80;
+const unsigned short kPropScoped = 0x100;
+const unsigned short kPropUniquename = 0x200;
+
+template<class T>
+T get(const char* p)
+{
+	T val;
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+template<class T>
+void put(char* p, T val)
+{
+	memcpy(p, &val, sizeof(val));
+}
+
+template<class T>
+void append(std::vector<char>& buf, T val)
+{
+	buf.insert(buf.end(), (const char*)&val, (const char*)&val + sizeof(val));
+}
+
+void append(std::vector<char>& buf, const void* p, size_t len)
+{
+	buf.insert(buf.end(), (const char*)p, (const char*)p + len);
+}
+
+void align(std::vector<char>& buf, size_t n = 4)
+{
+	buf.resize((buf.size() + n - 1) / n * n, 0);
+}
+
+// append a symbol record padded to 4 bytes, the padding is added to its length
+void appendRecord(std::vector<char>& buf, const char* rec, size_t reclen)
+{
+	size_t start = buf.size();
+	append(buf, rec, reclen);
+	align(buf);
+	put<unsigned short>(buf.data() + start, (unsigned short)(buf.size() - start - 2));
+}
+
+// hashStringV1 of the reference implementation, used for names in all hash tables
+unsigned int hashString(const char* s, size_t len)
+{
+	unsigned int hash = 0;
+	size_t n = 0;
+	for ( ; n + 4 <= len; n += 4)
+		hash ^= get<unsigned int>(s + n);
+	if (n + 2 <= len)
+	{
+		hash ^= get<unsigned short>(s + n);
+		n += 2;
+	}
+	if (n < len)
+		hash ^= (unsigned char)s[n];
+
+	hash |= 0x20202020;
+	hash ^= hash >> 11;
+	return hash ^ (hash >> 16);
+}
+
+// CRC32 without final inversion and initial value 0, used for type records without name
+unsigned int hashCRC(const char* p, size_t len)
+{
+	struct Table
+	{
+		unsigned int crc[256];
+		Table()
+		{
+			for (unsigned int i = 0; i < 256; i++)
+			{
+				unsigned int c = i;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+				crc[i] = c;
+			}
+		}
+	};
+	static const Table table;
+
+	unsigned int crc = 0;
+	for (size_t i = 0; i < len; i++)
+		crc = table.crc[(crc ^ (unsigned char)p[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+// size of the numeric leaf at p, 0 if unknown or out of bounds
+size_t numericLeafSize(const char* p, size_t avail)
+{
+	if (avail < 2)
+		return 0;
+	unsigned short leaf = get<unsigned short>(p);
+	size_t size;
+	if (leaf < LF_NUMERIC)
+		size = 2;
+	else if (leaf == LF_VARSTRING)
+	{
+		if (avail < 4)
+			return 0;
+		size = 4 + get<unsigned short>(p + 2);
+	}
+	else
+	{
+		static const unsigned char sizes[] = {
+			1, 2, 2, 4, 4, 4, 8, 10, 16, 8, 8, 6, 8, 16, 20, 32, // LF_CHAR .. LF_COMPLEX128
+		};
+		if ((size_t)(leaf - LF_NUMERIC) >= sizeof(sizes))
+			return 0;
+		size = 2 + sizes[leaf - LF_NUMERIC];
+	}
+	return size <= avail ? size : 0;
+}
+
+// get the zero terminated string at pos of the record, false if it is not terminated
+bool recordString(const char* rec, size_t reclen, size_t pos, const char*& name, size_t& len)
+{
+	if (pos >= reclen)
+		return false;
+	const char* end = (const char*)memchr(rec + pos, 0, reclen - pos);
+	if (!end)
+		return false;
+	name = rec + pos;
+	len = end - name;
+	return true;
+}
+
+bool isAnonymous(const char* name, size_t len)
+{
+	static const char* const anon[] = { "<unnamed-tag>", "__unnamed" };
+	for (const char* a : anon)
+	{
+		size_t alen = strlen(a);
+		if (len == alen && memcmp(name, a, len) == 0)
+			return true;
+		if (len >= alen + 2 && memcmp(name + len - alen - 2, "::", 2) == 0 && memcmp(name + len - alen, a, alen) == 0)
+			return true;
+	}
+	return false;
+}
+
+// hash of a type record in the TPI hash stream: user defined types are found
+// by name, all other records by their contents
+unsigned int typeHash(const char* rec, size_t reclen)
+{
+	unsigned short kind = get<unsigned short>(rec + 2);
+	size_t pos;
+	switch (kind)
+	{
+	case LF_CLASS_V3:
+	case LF_STRUCTURE_V3:
+	case LF_INTERFACE_V3:
+		pos = 20;
+		pos += numericLeafSize(rec + pos, reclen > pos ? reclen - pos : 0);
+		break;
+	case LF_UNION_V3:
+		pos = 12;
+		pos += numericLeafSize(rec + pos, reclen > pos ? reclen - pos : 0);
+		break;
+	case LF_ENUM_V3:
+		pos = 16;
+		break;
+	default:
+		return hashCRC(rec, reclen);
+	}
+
+	const char* name;
+	size_t len;
+	if (reclen < 8 || !recordString(rec, reclen, pos, name, len))
+		return hashCRC(rec, reclen);
+
+	unsigned short prop = get<unsigned short>(rec + 6);
+	bool fwdref = (prop & kPropFwdRef) != 0;
+	bool anon = (prop & kPropUniquename) && isAnonymous(name, len);
+	if (!fwdref && !(prop & kPropScoped) && !anon)
+		return hashString(name, len);
+
+	const char* uname;
+	size_t ulen;
+	if (!fwdref && (prop & kPropUniquename) && !anon && recordString(rec, reclen, pos + len + 1, uname, ulen))
+		return hashString(uname, ulen);
+	return hashCRC(rec, reclen);
+}
+
+// name of a symbol record that goes into the globals or publics
+bool symbolName(const char* rec, size_t reclen, const char*& name, size_t& len)
+{
+	size_t pos;
+	switch (get<unsigned short>(rec + 2))
+	{
+	case S_UDT_V3:
+		pos = 8;
+		break;
+	case S_CONSTANT_V3:
+		pos = 8 + numericLeafSize(rec + 8, reclen > 8 ? reclen - 8 : 0);
+		break;
+	case S_GPROC_V3:
+	case S_LPROC_V3:
+	case S_GPROC32_ID:
+	case S_LPROC32_ID:
+	case S_LPROC32_DPC:
+	case S_LPROC32_DPC_ID:
+		pos = 39;
+		break;
+	default: // S_PUB_V3, S_xDATA_V3, S_xTHREAD_V3, S_xPROCREF_V3, S_DATAREF_V3
+		pos = 14;
+		break;
+	}
+	return recordString(rec, reclen, pos, name, len);
+}
+
+bool isProc(unsigned short kind)
+{
+	return kind == S_GPROC_V3 || kind == S_LPROC_V3 || kind == S_GPROC32_ID || kind == S_LPROC32_ID
+	    || kind == S_LPROC32_DPC || kind == S_LPROC32_DPC_ID;
+}
+
+// scope symbols have the offsets of the parent scope and the end record at +4 and +8
+bool isScope(unsigned short kind)
+{
+	return isProc(kind) || kind == S_THUNK_V3 || kind == S_BLOCK_V3 || kind == S_WITH_V3
+	    || kind == S_SEPCODE_V3 || kind == S_INLINESITE || kind == S_INLINESITE2;
+}
+
+bool isScopeEnd(unsigned short kind)
+{
+	return kind == S_END || kind == S_PROC_ID_END || kind == S_INLINESITE_END;
+}
+
+// compare names within a bucket of the GSI hash table in the order searched by the reference implementation
+int compareSymbolNames(const char* s1, size_t len1, const char* s2, size_t len2)
+{
+	if (len1 != len2)
+		return len1 < len2 ? -1 : 1;
+	bool ascii = true;
+	for (size_t i = 0; i < len1 && ascii; i++)
+		ascii = (unsigned char)s1[i] < 0x80 && (unsigned char)s2[i] < 0x80;
+	if (!ascii)
+		return memcmp(s1, s2, len1);
+	for (size_t i = 0; i < len1; i++)
+	{
+		int c1 = tolower((unsigned char)s1[i]);
+		int c2 = tolower((unsigned char)s2[i]);
+		if (c1 != c2)
+			return c1 < c2 ? -1 : 1;
+	}
+	return 0;
+}
+
+struct GSISymbol
+{
+	unsigned int off;     // offset of the record in the symbol record stream
+	unsigned int nameOff; // offset of the name in the symbol record stream
+	unsigned int nameLen;
+	unsigned int bucket;
+};
+
+// build the hash table of a GSI stream referring to records in the symbol record stream
+void appendGSIHash(std::vector<char>& out, const std::vector<char>& records, std::vector<GSISymbol>& syms)
+{
+	std::vector<unsigned int> bucketStart(kGsiHashBuckets + 1, 0);
+	for (GSISymbol& sym : syms)
+	{
+		sym.bucket = hashString(records.data() + sym.nameOff, sym.nameLen) % kGsiHashBuckets;
+		bucketStart[sym.bucket + 1]++;
+	}
+	for (unsigned int b = 0; b < kGsiHashBuckets; b++)
+		bucketStart[b + 1] += bucketStart[b];
+
+	std::vector<const GSISymbol*> sorted(syms.size());
+	std::vector<unsigned int> fill(bucketStart.begin(), bucketStart.end() - 1);
+	for (const GSISymbol& sym : syms)
+		sorted[fill[sym.bucket]++] = &sym;
+
+	auto less = [&records](const GSISymbol* s1, const GSISymbol* s2)
+	{
+		int cmp = compareSymbolNames(records.data() + s1->nameOff, s1->nameLen, records.data() + s2->nameOff, s2->nameLen);
+		return cmp != 0 ? cmp < 0 : s1->off < s2->off;
+	};
+	std::vector<unsigned int> bitmap((kGsiHashBuckets + 32) / 32, 0);
+	std::vector<unsigned int> chains;
+	for (unsigned int b = 0; b < kGsiHashBuckets; b++)
+	{
+		if (bucketStart[b] == bucketStart[b + 1])
+			continue;
+		std::sort(sorted.begin() + bucketStart[b], sorted.begin() + bucketStart[b + 1], less);
+		bitmap[b / 32] |= 1u << (b % 32);
+		chains.push_back(bucketStart[b] * 12); // offset in the in-memory table of the reference implementation
+	}
+
+	append(out, (unsigned int)0xffffffff);
+	append(out, kGsiVersion);
+	append(out, (unsigned int)(8 * syms.size()));
+	append(out, (unsigned int)(4 * (bitmap.size() + chains.size())));
+	for (const GSISymbol* sym : sorted)
+	{
+		append(out, sym->off + 1);
+		append(out, (unsigned int)1); // reference count
+	}
+	append(out, bitmap.data(), 4 * bitmap.size());
+	append(out, chains.data(), 4 * chains.size());
+}
+
+// string table in the format of the /names stream
+void appendStringTable(std::vector<char>& out, const std::vector<char>& strings)
+{
+	std::vector<unsigned int> offsets;
+	for (size_t off = 1; off < strings.size(); off += strlen(strings.data() + off) + 1)
+		offsets.push_back((unsigned int)off);
+
+	// same number of buckets as the reference implementation: one growth step
+	// beyond the size that keeps the table at most 3/4 full
+	unsigned int cntBuckets = 1;
+	while (cntBuckets * 3 / 4 < offsets.size())
+		cntBuckets = cntBuckets * 3 / 2 + 1;
+	cntBuckets = cntBuckets * 3 / 2 + 1;
+	std::vector<unsigned int> buckets(cntBuckets, 0);
+	for (unsigned int off : offsets)
+	{
+		unsigned int b = hashString(strings.data() + off, strlen(strings.data() + off)) % cntBuckets;
+		while (buckets[b] != 0)
+			b = (b + 1) % cntBuckets;
+		buckets[b] = off;
+	}
+
+	append(out, kNamesSignature);
+	append(out, (unsigned int)1); // hash version
+	append(out, (unsigned int)strings.size());
+	append(out, strings.data(), strings.size());
+	append(out, cntBuckets);
+	append(out, buckets.data(), 4 * buckets.size());
+	append(out, (unsigned int)offsets.size());
+}
+
+void appendSecContrib(std::vector<char>& out, unsigned short sec, unsigned int off, unsigned int size,
+                      unsigned int flags, unsigned short imod)
+{
+	append(out, sec);
+	append(out, (unsigned short)0);
+	append(out, off);
+	append(out, size);
+	append(out, flags);
+	append(out, imod);
+	append(out, (unsigned short)0);
+	append(out, (unsigned int)0); // data crc
+	append(out, (unsigned int)0); // reloc crc
+}
+
+void runTasks(const std::vector<std::function<void()>>& tasks, int numThreads)
+{
+	std::atomic<size_t> next(0);
+	auto run = [&]()
+	{
+		for (size_t t = next++; t < tasks.size(); t = next++)
+			tasks[t]();
+	};
+
+	size_t cntThreads = (size_t)numThreads < tasks.size() ? numThreads : tasks.size();
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < cntThreads; t++)
+		threads.emplace_back(run);
+	run();
+	for (std::thread& t : threads)
+		t.join();
+}
+
+} // namespace
+
+struct PDB::ModStreams
+{
+	std::vector<char> stream;
+	std::vector<char> globals; // records for the globals stream
+	unsigned int cbSymbols = 0;
+	unsigned int cbLines = 0;
+	std::string error;
+};
+
+struct PDB::Streams
+{
+	std::vector<char> globals;
+	std::vector<char> publics;
+	std::vector<char> symRecords;
+};
+
+///////////////////////////////////////////////////////////////////////
+unsigned long TPI::QueryInterfaceVersion()
+{
+	return kTpiVersion;
+}
+
+unsigned long TPI::QueryImplementationVersion()
+{
+	return kTpiVersion;
+}
+
+int TPI::Close()
+{
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////
+Mod::Mod(PDB* pdb, unsigned short imod, const char* objName, const char* libName)
+: pdb(pdb), imod(imod), objName(objName), libName(libName)
+{
+}
+
+unsigned long Mod::QueryInterfaceVersion()
+{
+	return kDbiVersion;
+}
+
+unsigned long Mod::QueryImplementationVersion()
+{
+	return kDbiVersion;
+}
+
+int Mod::AddTypes(unsigned char* pTypeData, long cbTypeData)
+{
+	const char* data = (const char*)pTypeData;
+	if (cbTypeData < 4 || get<unsigned int>(data) != kCVSignatureC13)
+		return pdb->setError("unsupported signature of type records");
+
+	// the writer has no type merging, all modules must share the same types
+	TPI& tpi = pdb->tpi;
+	if (tpi.added)
+	{
+		if (tpi.records.size() == (size_t)cbTypeData - 4 && memcmp(tpi.records.data(), data + 4, cbTypeData - 4) == 0)
+			return 1;
+		return pdb->setError("cannot add different types to multiple modules");
+	}
+
+	for (long pos = 4; pos < cbTypeData; )
+	{
+		if (pos + 4 > cbTypeData)
+			return pdb->setError("invalid type record");
+		long reclen = get<unsigned short>(data + pos) + 2;
+		if (reclen < 4 || pos + reclen > cbTypeData)
+			return pdb->setError("invalid type record");
+		pos += reclen;
+	}
+	tpi.records.assign(data + 4, data + cbTypeData);
+	tpi.added = true;
+	return 1;
+}
+
+// Symbols are kept until PDB::Commit, that moves global symbols to the
+// globals stream. The file names of the checksums are moved from the string
+// table subsection to /names and the checksums of multiple calls are merged,
+// adjusting the file references of the line subsections.
+int Mod::AddSymbols(unsigned char* pSymbolData, long cbSymbolData)
+{
+	const char* data = (const char*)pSymbolData;
+	if (cbSymbolData < 4 || get<unsigned int>(data) != kCVSignatureC13)
+		return pdb->setError("unsupported signature of symbols");
+
+	const char* strings = 0;
+	size_t cbStrings = 0;
+	bool hasChecksums = false;
+	for (long pos = 4; pos + 8 <= cbSymbolData; )
+	{
+		unsigned int kind = get<unsigned int>(data + pos);
+		unsigned int len = get<unsigned int>(data + pos + 4);
+		if (len > (unsigned long)(cbSymbolData - pos - 8))
+			return pdb->setError("invalid debug subsection");
+		if (kind == DEBUG_S_STRINGTABLE)
+		{
+			strings = data + pos + 8;
+			cbStrings = len;
+		}
+		hasChecksums = hasChecksums || kind == DEBUG_S_FILECHKSMS;
+		pos = (pos + 8 + len + 3) & ~3;
+	}
+
+	unsigned int fileBase = hasChecksums ? (unsigned int)checksums.size() : 0;
+	for (long pos = 4; pos + 8 <= cbSymbolData; )
+	{
+		unsigned int kind = get<unsigned int>(data + pos);
+		unsigned int len = get<unsigned int>(data + pos + 4);
+		const char* sub = data + pos + 8;
+		pos = (pos + 8 + len + 3) & ~3;
+
+		if (kind & DEBUG_S_IGNORE)
+			continue;
+		switch (kind)
+		{
+		case DEBUG_S_SYMBOLS:
+			append(symbols, sub, len);
+			break;
+		case DEBUG_S_STRINGTABLE:
+			break;
+		case DEBUG_S_FILECHKSMS:
+			for (unsigned int off = 0; off < len; )
+			{
+				if (off + 6 > len)
+					return pdb->setError("invalid file checksum");
+				unsigned int nameoff = get<unsigned int>(sub + off);
+				unsigned int entrylen = 6 + (unsigned char)sub[off + 4];
+				if (off + entrylen > len)
+					return pdb->setError("invalid file checksum");
+				const char* name;
+				size_t namelen;
+				if (!recordString(strings, cbStrings, nameoff, name, namelen))
+					return pdb->setError("invalid file name offset in checksum");
+
+				unsigned int ni = pdb->addName(name, namelen);
+				files.push_back(ni);
+				append(checksums, ni);
+				append(checksums, sub + off + 4, entrylen - 4);
+				align(checksums);
+				off = (off + entrylen + 3) & ~3;
+			}
+			break;
+		case DEBUG_S_LINES:
+		{
+			if (len < 12)
+				return pdb->setError("invalid line subsection");
+			size_t start = lines.size();
+			append(lines, kind);
+			append(lines, len);
+			append(lines, sub, len);
+			align(lines);
+			// blocks: file id, number of lines, size of block
+			for (unsigned int off = 12; fileBase && off + 12 <= len; )
+			{
+				char* block = lines.data() + start + 8 + off;
+				unsigned int cbBlock = get<unsigned int>(block + 8);
+				put<unsigned int>(block, get<unsigned int>(block) + fileBase);
+				if (cbBlock < 12)
+					return pdb->setError("invalid line subsection");
+				off += cbBlock;
+			}
+			break;
+		}
+		default:
+			append(lines, kind);
+			append(lines, len);
+			append(lines, sub, len);
+			align(lines);
+			break;
+		}
+	}
+	return 1;
+}
+
+int Mod::AddPublic2(const char* name, unsigned short sec, long off, unsigned long flags)
+{
+	return pdb->dbi.AddPublic2(name, sec, off, flags);
+}
+
+int Mod::AddLines(const char* fname, unsigned short sec, long off, long size, long off2,
+                  unsigned short firstline, unsigned char* pLineInfo, long cbLineInfo)
+{
+	return pdb->setError("C11 line numbers not supported");
+}
+
+int Mod::AddSecContrib(unsigned short sec, long off, long size, unsigned long secflags)
+{
+	if (firstContrib < 0)
+		firstContrib = (int)pdb->contribs.size();
+	PDB::SecContrib contrib = { sec, (unsigned int)off, (unsigned int)size, (unsigned int)secflags, imod };
+	pdb->contribs.push_back(contrib);
+	return 1;
+}
+
+int Mod::Close()
+{
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////
+unsigned long DBI::QueryImplementationVersion()
+{
+	return kDbiVersion;
+}
+
+unsigned long DBI::QueryInterfaceVersion()
+{
+	return kDbiVersion;
+}
+
+int DBI::Close()
+{
+	return 1;
+}
+
+int DBI::OpenMod(const char* objName, const char* libName, Mod** pmod)
+{
+	if (pdb->modules.size() + kStreamFirstModule >= 0xffff)
+		return pdb->setError("too many modules");
+	pdb->modules.emplace_back(new Mod(pdb, (unsigned short)pdb->modules.size(), objName, libName));
+	*pmod = pdb->modules.back().get();
+	return 1;
+}
+
+int DBI::AddSec(unsigned short sec, unsigned short flags, long offset, long cbseg)
+{
+	PDB::SecMapEntry entry = { flags, sec, (unsigned int)offset, (unsigned int)cbseg };
+	pdb->secMap.push_back(entry);
+	return 1;
+}
+
+int DBI::AddPublic2(const char* name, unsigned short sec, long off, unsigned long flags)
+{
+	PDB::Public pub = { name, sec, (unsigned int)off, (unsigned int)flags };
+	pdb->publics.push_back(pub);
+	return 1;
+}
+
+void DBI::SetMachineType(unsigned short type)
+{
+	pdb->machine = type;
+}
+
+///////////////////////////////////////////////////////////////////////
+PDB* PDB::Create(const char* filename, int numThreads)
+{
+#ifdef _WIN32
+	int len = MultiByteToWideChar(CP_UTF8, 0, filename, -1, 0, 0);
+	std::vector<wchar_t> wname(len > 0 ? len : 1, 0);
+	MultiByteToWideChar(CP_UTF8, 0, filename, -1, wname.data(), len);
+	FILE* fh = _wfopen(wname.data(), L"wb");
+#else
+	FILE* fh = fopen(filename, "wb");
+#endif
+	if (!fh)
+		return 0;
+	return new PDB(fh, numThreads);
+}
+
+PDB::PDB(FILE* fh, int numThreads)
+: fh(fh), numThreads(numThreads), dbi(this)
+{
+	signature = (unsigned int)time(0);
+
+	std::random_device rd;
+	for (int i = 0; i < 16; i += 4)
+		put<unsigned int>((char*)guid + i, rd());
+	guid[7] = (guid[7] & 0x0f) | 0x40; // version 4
+	guid[8] = (guid[8] & 0x3f) | 0x80; // variant 1
+
+	nameBuffer.push_back(0);
+}
+
+PDB::~PDB()
+{
+	if (fh)
+		fclose(fh);
+}
+
+int PDB::setError(const char* msg)
+{
+	lastError = msg;
+	return 0;
+}
+
+unsigned int PDB::addName(const char* name, size_t len)
+{
+	if (len == 0)
+		return 0;
+	auto it = nameOffsets.emplace(std::string(name, len), (unsigned int)nameBuffer.size());
+	if (it.second)
+	{
+		append(nameBuffer, name, len);
+		nameBuffer.push_back(0);
+	}
+	return it.first->second;
+}
+
+unsigned long PDB::QueryAge()
+{
+	return 1;
+}
+
+int PDB::QuerySignature2(unsigned char guid[16])
+{
+	memcpy(guid, this->guid, sizeof(this->guid));
+	return 1;
+}
+
+int PDB::CreateDBI(const char* target, DBI** pdbi)
+{
+	*pdbi = &dbi;
+	return 1;
+}
+
+int PDB::OpenTpi(const char* mode, TPI** ptpi)
+{
+	*ptpi = &tpi;
+	return 1;
+}
+
+int PDB::OpenIpi(const char* mode, TPI** pipi)
+{
+	*pipi = &ipi;
+	return 1;
+}
+
+long PDB::QueryLastError(char* lastErr)
+{
+	if (lastErr)
+	{
+		strncpy(lastErr, lastError.c_str(), 255);
+		lastErr[255] = 0;
+	}
+	return lastError.empty() ? 0 : 1;
+}
+
+int PDB::Close()
+{
+	delete this;
+	return 1;
+}
+
+int PDB::Commit()
+{
+	if (!fh)
+		return setError("PDB already committed");
+
+	// the streams are built in two rounds of independent tasks, the globals
+	// need the module streams for the references to the procedures
+	std::vector<ModStreams> mods(modules.size());
+	std::vector<char> tpiStream, tpiHash, ipiStream, ipiHash;
+	std::vector<std::function<void()>> tasks;
+	tasks.push_back([&]() { buildTypes(tpi, tpiStream, tpiHash, kStreamTPIHash); });
+	tasks.push_back([&]() { buildTypes(ipi, ipiStream, ipiHash, kStreamIPIHash); });
+	for (size_t m = 0; m < modules.size(); m++)
+		tasks.push_back([&, m]() { buildModule(*modules[m], mods[m]); });
+	runTasks(tasks, numThreads);
+
+	for (const ModStreams& ms : mods)
+		if (!ms.error.empty())
+			return setError(ms.error.c_str());
+
+	Streams st;
+	std::vector<char> dbiStream, names, info;
+	tasks.clear();
+	tasks.push_back([&]() { buildGlobals(mods, st); });
+	tasks.push_back([&]() { buildDBI(mods, dbiStream); });
+	tasks.push_back([&]() { buildNames(names); });
+	tasks.push_back([&]() { buildInfo(info); });
+	runTasks(tasks, numThreads);
+
+	std::vector<char> empty;
+	std::vector<const std::vector<char>*> streams(kStreamFirstModule + mods.size(), &empty);
+	streams[kStreamInfo] = &info;
+	streams[kStreamTPI] = &tpiStream;
+	streams[kStreamDBI] = &dbiStream;
+	streams[kStreamIPI] = &ipiStream;
+	streams[kStreamTPIHash] = &tpiHash;
+	streams[kStreamIPIHash] = &ipiHash;
+	streams[kStreamGlobals] = &st.globals;
+	streams[kStreamPublics] = &st.publics;
+	streams[kStreamSymRecords] = &st.symRecords;
+	streams[kStreamNames] = &names;
+	for (size_t m = 0; m < mods.size(); m++)
+		streams[kStreamFirstModule + m] = &mods[m].stream;
+
+	bool ok = writeMSF(streams);
+	if (fclose(fh) != 0 && ok)
+		ok = setError("cannot write PDB file") != 0;
+	fh = 0;
+	return ok ? 1 : 0;
+}
+
+void PDB::buildTypes(const TPI& tpi, std::vector<char>& stream, std::vector<char>& hashes, unsigned short hashStream) const
+{
+	const std::vector<char>& records = tpi.records;
+	std::vector<unsigned int> hashValues;
+	std::vector<unsigned int> indexOffsets; // type index and offset every 8 KB
+	for (size_t pos = 0; pos < records.size(); )
+	{
+		size_t reclen = get<unsigned short>(records.data() + pos) + 2;
+		if (hashValues.empty() || (pos + reclen) / 8192 > pos / 8192)
+		{
+			indexOffsets.push_back(kFirstTypeIndex + (unsigned int)hashValues.size());
+			indexOffsets.push_back((unsigned int)pos);
+		}
+		hashValues.push_back(typeHash(records.data() + pos, reclen) % kTpiHashBuckets);
+		pos += reclen;
+	}
+
+	append(hashes, hashValues.data(), 4 * hashValues.size());
+	append(hashes, indexOffsets.data(), 4 * indexOffsets.size());
+
+	append(stream, kTpiVersion);
+	append(stream, kTpiHeaderSize);
+	append(stream, kFirstTypeIndex);
+	append(stream, kFirstTypeIndex + (unsigned int)hashValues.size());
+	append(stream, (unsigned int)records.size());
+	append(stream, hashStream);
+	append(stream, (unsigned short)0xffff); // no auxiliary hash stream
+	append(stream, (unsigned int)4);        // hash key size
+	append(stream, kTpiHashBuckets);
+	append(stream, (unsigned int)0);        // hash values
+	append(stream, (unsigned int)(4 * hashValues.size()));
+	append(stream, (unsigned int)(4 * hashValues.size())); // index offsets
+	append(stream, (unsigned int)(4 * indexOffsets.size()));
+	append(stream, (unsigned int)hashes.size()); // no hash adjusters
+	append(stream, (unsigned int)0);
+	append(stream, records.data(), records.size());
+}
+
+// Module stream: signature, symbols, C13 lines and no global references.
+// Global symbols are removed and collected for the globals stream together
+// with references to the procedures, see also symbolGoesInGlobalsStream in
+// LLVM's lld/COFF/PDB.cpp.
+void PDB::buildModule(const Mod& mod, ModStreams& ms) const
+{
+	std::vector<char>& out = ms.stream;
+	append(out, kCVSignatureC13);
+
+	std::vector<unsigned int> scopes; // offsets of the open scope records
+	const char* symbols = mod.symbols.data();
+	for (size_t pos = 0; pos < mod.symbols.size(); )
+	{
+		size_t reclen = pos + 4 <= mod.symbols.size() ? get<unsigned short>(symbols + pos) + 2 : 0;
+		if (reclen < 4 || pos + reclen > mod.symbols.size())
+		{
+			ms.error = "invalid symbol record in module " + mod.objName;
+			return;
+		}
+		const char* rec = symbols + pos;
+		unsigned short kind = get<unsigned short>(rec + 2);
+		pos += reclen;
+
+		bool toplevel = scopes.empty();
+		bool global = false;
+		bool local = true;
+		switch (kind)
+		{
+		case S_GDATA_V3:
+		case S_GTHREAD_V3:
+		case S_PROCREF_V3:
+		case S_LPROCREF_V3:
+		case S_DATAREF_V3:
+			global = true;
+			local = false;
+			break;
+		case S_UDT_V3:
+		case S_CONSTANT_V3:
+			global = toplevel;
+			local = !toplevel;
+			break;
+		case S_LDATA_V3:
+		case S_LTHREAD_V3:
+			global = toplevel;
+			break;
+		}
+		if (global)
+			appendRecord(ms.globals, rec, reclen);
+		if (!local)
+			continue;
+
+		unsigned int off = (unsigned int)out.size();
+		appendRecord(out, rec, reclen);
+		if (isScope(kind))
+		{
+			if (reclen < 12)
+			{
+				ms.error = "invalid scope record in module " + mod.objName;
+				return;
+			}
+			put<unsigned int>(out.data() + off + 4, toplevel ? 0 : scopes.back());
+			scopes.push_back(off);
+
+			const char* name;
+			size_t len;
+			if (isProc(kind) && symbolName(rec, reclen, name, len))
+			{
+				bool lproc = kind != S_GPROC_V3 && kind != S_GPROC32_ID;
+				size_t start = ms.globals.size();
+				append(ms.globals, (unsigned short)0);
+				append(ms.globals, lproc ? S_LPROCREF_V3 : S_PROCREF_V3);
+				append(ms.globals, (unsigned int)0); // checksum of the name
+				append(ms.globals, off);
+				append(ms.globals, (unsigned short)(mod.imod + 1));
+				append(ms.globals, name, len);
+				ms.globals.push_back(0);
+				align(ms.globals);
+				put<unsigned short>(ms.globals.data() + start, (unsigned short)(ms.globals.size() - start - 2));
+			}
+		}
+		else if (isScopeEnd(kind) && !toplevel)
+		{
+			put<unsigned int>(out.data() + scopes.back() + 8, off);
+			scopes.pop_back();
+		}
+	}
+	ms.cbSymbols = (unsigned int)out.size();
+
+	if (!mod.checksums.empty())
+	{
+		append(out, DEBUG_S_FILECHKSMS);
+		append(out, (unsigned int)mod.checksums.size());
+		append(out, mod.checksums.data(), mod.checksums.size());
+	}
+	append(out, mod.lines.data(), mod.lines.size());
+	ms.cbLines = (unsigned int)out.size() - ms.cbSymbols;
+
+	append(out, (unsigned int)0); // size of global references
+}
+
+// The symbol record stream holds the global symbols followed by the publics,
+// the globals and publics streams are hash tables referring to them.
+void PDB::buildGlobals(const std::vector<ModStreams>& mods, Streams& st) const
+{
+	std::vector<char>& records = st.symRecords;
+	std::vector<GSISymbol> globals;
+	std::unordered_set<std::string> udts; // identical S_UDT and S_CONSTANT records are added once
+
+	for (const ModStreams& ms : mods)
+	{
+		for (size_t pos = 0; pos < ms.globals.size(); )
+		{
+			const char* rec = ms.globals.data() + pos;
+			size_t reclen = get<unsigned short>(rec) + 2;
+			pos += reclen;
+
+			unsigned short kind = get<unsigned short>(rec + 2);
+			if ((kind == S_UDT_V3 || kind == S_CONSTANT_V3) && !udts.insert(std::string(rec, reclen)).second)
+				continue;
+
+			GSISymbol sym = { (unsigned int)records.size(), 0, 0, 0 };
+			const char* name;
+			size_t len;
+			if (symbolName(rec, reclen, name, len))
+			{
+				sym.nameOff = sym.off + (unsigned int)(name - rec);
+				sym.nameLen = (unsigned int)len;
+			}
+			else
+				sym.nameOff = sym.off + (unsigned int)reclen - 1; // empty name
+			append(records, rec, reclen);
+			globals.push_back(sym);
+		}
+	}
+
+	std::vector<GSISymbol> pubs;
+	for (const Public& pub : publics)
+	{
+		GSISymbol sym = { (unsigned int)records.size(), (unsigned int)records.size() + 14, (unsigned int)pub.name.size(), 0 };
+		append(records, (unsigned short)0);
+		append(records, S_PUB_V3);
+		append(records, pub.flags);
+		append(records, pub.off);
+		append(records, pub.sec);
+		append(records, pub.name.c_str(), pub.name.size() + 1);
+		align(records);
+		put<unsigned short>(records.data() + sym.off, (unsigned short)(records.size() - sym.off - 2));
+		pubs.push_back(sym);
+	}
+
+	appendGSIHash(st.globals, records, globals);
+
+	std::vector<char> hash;
+	appendGSIHash(hash, records, pubs);
+
+	// the address map sorts the publics by section and offset
+	std::vector<unsigned int> addrMap(pubs.size());
+	for (size_t p = 0; p < pubs.size(); p++)
+		addrMap[p] = (unsigned int)p;
+	std::sort(addrMap.begin(), addrMap.end(), [this](unsigned int p1, unsigned int p2)
+	{
+		const Public& pub1 = publics[p1];
+		const Public& pub2 = publics[p2];
+		if (pub1.sec != pub2.sec)
+			return pub1.sec < pub2.sec;
+		if (pub1.off != pub2.off)
+			return pub1.off < pub2.off;
+		return pub1.name < pub2.name;
+	});
+	for (unsigned int& p : addrMap)
+		p = pubs[p].off;
+
+	append(st.publics, (unsigned int)hash.size());
+	append(st.publics, (unsigned int)(4 * addrMap.size()));
+	append(st.publics, (unsigned int)0);   // number of thunks
+	append(st.publics, (unsigned int)0);   // size of thunk
+	append(st.publics, (unsigned short)0); // section of thunk table
+	append(st.publics, (unsigned short)0);
+	append(st.publics, (unsigned int)0);   // offset of thunk table
+	append(st.publics, (unsigned int)0);   // number of sections
+	append(st.publics, hash.data(), hash.size());
+	append(st.publics, addrMap.data(), 4 * addrMap.size());
+}
+
+void PDB::buildDBI(const std::vector<ModStreams>& mods, std::vector<char>& out) const
+{
+	std::vector<char> modInfo;
+	for (size_t m = 0; m < modules.size(); m++)
+	{
+		const Mod& mod = *modules[m];
+		append(modInfo, (unsigned int)0);
+		if (mod.firstContrib >= 0)
+		{
+			const SecContrib& sc = contribs[mod.firstContrib];
+			appendSecContrib(modInfo, sc.sec, sc.off, sc.size, sc.flags, sc.imod);
+		}
+		else
+			appendSecContrib(modInfo, 0xffff, 0, 0, 0, mod.imod);
+		append(modInfo, (unsigned short)0); // flags
+		append(modInfo, (unsigned short)(kStreamFirstModule + m));
+		append(modInfo, mods[m].cbSymbols);
+		append(modInfo, (unsigned int)0); // size of C11 lines
+		append(modInfo, mods[m].cbLines);
+		append(modInfo, (unsigned short)std::min<size_t>(mod.files.size(), 0xffff));
+		append(modInfo, (unsigned short)0);
+		append(modInfo, (unsigned int)0);
+		append(modInfo, (unsigned int)0); // name index of source file
+		append(modInfo, (unsigned int)0); // name index of PDB file
+		append(modInfo, mod.objName.c_str(), mod.objName.size() + 1);
+		append(modInfo, mod.libName.c_str(), mod.libName.size() + 1);
+		align(modInfo);
+	}
+
+	std::vector<SecContrib> sorted(contribs);
+	std::stable_sort(sorted.begin(), sorted.end(), [](const SecContrib& sc1, const SecContrib& sc2)
+	{
+		return sc1.sec != sc2.sec ? sc1.sec < sc2.sec : sc1.off < sc2.off;
+	});
+	std::vector<char> secContribs;
+	append(secContribs, kSecContribVersion);
+	for (const SecContrib& sc : sorted)
+		appendSecContrib(secContribs, sc.sec, sc.off, sc.size, sc.flags, sc.imod);
+
+	std::vector<char> secMapData;
+	append(secMapData, (unsigned short)secMap.size());
+	append(secMapData, (unsigned short)secMap.size());
+	for (const SecMapEntry& entry : secMap)
+	{
+		append(secMapData, entry.flags);
+		append(secMapData, (unsigned short)0);      // overlay
+		append(secMapData, (unsigned short)0);      // group
+		append(secMapData, entry.frame);
+		append(secMapData, (unsigned short)0xffff); // section name
+		append(secMapData, (unsigned short)0xffff); // class name
+		append(secMapData, entry.offset);
+		append(secMapData, entry.size);
+	}
+
+	// file info: the source files of each module referring to a buffer of unique names
+	std::vector<char> fileInfo;
+	std::vector<char> fileNames;
+	std::unordered_map<unsigned int, unsigned int> fileNameOffsets;
+	append(fileInfo, (unsigned short)modules.size());
+	std::vector<unsigned int> fileRefs;
+	for (const auto& mod : modules)
+	{
+		for (unsigned int ni : mod->files)
+		{
+			auto it = fileNameOffsets.emplace(ni, (unsigned int)fileNames.size());
+			if (it.second)
+			{
+				const char* name = nameBuffer.data() + ni;
+				append(fileNames, name, strlen(name) + 1);
+			}
+			fileRefs.push_back(it.first->second);
+		}
+	}
+	append(fileInfo, (unsigned short)std::min<size_t>(fileNameOffsets.size(), 0xffff));
+	unsigned short firstFile = 0;
+	for (const auto& mod : modules)
+	{
+		append(fileInfo, firstFile);
+		firstFile += (unsigned short)mod->files.size();
+	}
+	for (const auto& mod : modules)
+		append(fileInfo, (unsigned short)std::min<size_t>(mod->files.size(), 0xffff));
+	append(fileInfo, fileRefs.data(), 4 * fileRefs.size());
+	append(fileInfo, fileNames.data(), fileNames.size());
+	align(fileInfo);
+
+	std::vector<char> ecNames;
+	appendStringTable(ecNames, std::vector<char>(1, 0));
+
+	std::vector<unsigned short> dbgStreams(11, 0xffff); // FPO, exception, fixup, omap, section headers, ...
+
+	append(out, (int)-1);
+	append(out, kDbiVersion);
+	append(out, (unsigned int)1); // age
+	append(out, (unsigned short)kStreamGlobals);
+	append(out, (unsigned short)0x8e00); // build number 14.0, new format
+	append(out, (unsigned short)kStreamPublics);
+	append(out, (unsigned short)0);      // version of mspdb.dll
+	append(out, (unsigned short)kStreamSymRecords);
+	append(out, (unsigned short)0);      // rebuild of mspdb.dll
+	append(out, (unsigned int)modInfo.size());
+	append(out, (unsigned int)secContribs.size());
+	append(out, (unsigned int)secMapData.size());
+	append(out, (unsigned int)fileInfo.size());
+	append(out, (unsigned int)0);        // type server map
+	append(out, (unsigned int)0);        // MFC type server
+	append(out, (unsigned int)(2 * dbgStreams.size()));
+	append(out, (unsigned int)ecNames.size());
+	append(out, (unsigned short)0);      // flags
+	append(out, machine);
+	append(out, (unsigned int)0);
+	append(out, modInfo.data(), modInfo.size());
+	append(out, secContribs.data(), secContribs.size());
+	append(out, secMapData.data(), secMapData.size());
+	append(out, fileInfo.data(), fileInfo.size());
+	append(out, ecNames.data(), ecNames.size());
+	append(out, dbgStreams.data(), 2 * dbgStreams.size());
+}
+
+void PDB::buildNames(std::vector<char>& names) const
+{
+	appendStringTable(names, nameBuffer);
+}
+
+// PDB info stream with the named stream map
+void PDB::buildInfo(std::vector<char>& info) const
+{
+	static const char* const streamNames[] = { "/names", "/LinkInfo" };
+	static const unsigned int streamNumbers[] = { kStreamNames, kStreamLinkInfo };
+	const unsigned int capacity = 8;
+
+	std::vector<char> strings;
+	unsigned int keys[capacity], values[capacity];
+	unsigned int present = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		unsigned int b = (unsigned short)hashString(streamNames[i], strlen(streamNames[i])) % capacity;
+		while (present & (1 << b))
+			b = (b + 1) % capacity;
+		present |= 1 << b;
+		keys[b] = (unsigned int)strings.size();
+		values[b] = streamNumbers[i];
+		append(strings, streamNames[i], strlen(streamNames[i]) + 1);
+	}
+
+	append(info, kPdbVersion);
+	append(info, signature);
+	append(info, (unsigned int)1); // age
+	append(info, guid, sizeof(guid));
+	append(info, (unsigned int)strings.size());
+	append(info, strings.data(), strings.size());
+	append(info, (unsigned int)2);  // size of the hash table
+	append(info, capacity);
+	append(info, (unsigned int)1);  // words of present bit vector
+	append(info, present);
+	append(info, (unsigned int)0);  // words of deleted bit vector
+	for (unsigned int b = 0; b < capacity; b++)
+	{
+		if (present & (1 << b))
+		{
+			append(info, keys[b]);
+			append(info, values[b]);
+		}
+	}
+	append(info, (unsigned int)0);
+	append(info, kPdbFeatureVC140);
+}
+
+// Write the MSF container: the streams are placed in consecutive blocks
+// skipping the two free page map blocks at the start of every 4096 blocks,
+// followed by the stream directory and the block with its block numbers.
+bool PDB::writeMSF(const std::vector<const std::vector<char>*>& streams)
+{
+	unsigned int numBlocks = 3; // super block and both free page maps
+	auto allocBlock = [&numBlocks]()
+	{
+		if (numBlocks % kBlockSize == 1)
+			numBlocks += 2;
+		return numBlocks++;
+	};
+
+	// data and size of each block, the rest of a block is filled with zeroes
+	std::vector<std::pair<const char*, size_t>> blocks;
+	auto setBlock = [&blocks](unsigned int block, const char* data, size_t size)
+	{
+		if (blocks.size() <= block)
+			blocks.resize(block + 1);
+		blocks[block] = std::make_pair(data, std::min<size_t>(size, kBlockSize));
+	};
+
+	std::vector<char> directory;
+	append(directory, (unsigned int)streams.size());
+	for (const std::vector<char>* s : streams)
+		append(directory, (unsigned int)s->size());
+	for (const std::vector<char>* s : streams)
+	{
+		for (size_t pos = 0; pos < s->size(); pos += kBlockSize)
+		{
+			unsigned int block = allocBlock();
+			setBlock(block, s->data() + pos, s->size() - pos);
+			append(directory, block);
+		}
+	}
+
+	std::vector<unsigned int> blockMap;
+	for (size_t pos = 0; pos < directory.size(); pos += kBlockSize)
+	{
+		blockMap.push_back(allocBlock());
+		setBlock(blockMap.back(), directory.data() + pos, directory.size() - pos);
+	}
+	if (blockMap.size() > kMaxBlockMapEntries)
+		return setError("PDB file too large");
+	unsigned int blockMapAddr = allocBlock();
+	setBlock(blockMapAddr, (const char*)blockMap.data(), 4 * blockMap.size());
+
+	// free page map with a bit set for every free block, the blocks of the
+	// map at the start of every interval of 4096 blocks are concatenated
+	unsigned int numIntervals = (numBlocks + kBlockSize - 1) / kBlockSize;
+	std::vector<char> fpm(numIntervals * kBlockSize, (char)0xff);
+	memset(fpm.data(), 0, numBlocks / 8);
+	fpm[numBlocks / 8] = (char)(0xff << (numBlocks % 8));
+	for (unsigned int i = 0; i < numIntervals && i * kBlockSize + 1 < numBlocks; i++)
+	{
+		setBlock(i * kBlockSize + 1, fpm.data() + i * kBlockSize, kBlockSize);
+		setBlock(i * kBlockSize + 2, fpm.data() + i * kBlockSize, kBlockSize);
+	}
+
+	std::vector<char> super;
+	append(super, "Microsoft C/C++ MSF 7.00\r\n\x1a" "DS\0\0", 32);
+	append(super, kBlockSize);
+	append(super, (unsigned int)1); // free page map block
+	append(super, numBlocks);
+	append(super, (unsigned int)directory.size());
+	append(super, (unsigned int)0);
+	append(super, blockMapAddr);
+	setBlock(0, super.data(), super.size());
+
+	std::vector<char> block(kBlockSize);
+	for (unsigned int b = 0; b < numBlocks; b++)
+	{
+		memset(block.data(), 0, kBlockSize);
+		if (b < blocks.size() && blocks[b].first)
+			memcpy(block.data(), blocks[b].first, blocks[b].second);
+		if (fwrite(block.data(), 1, kBlockSize, fh) != kBlockSize)
+			return setError("cannot write PDB file");
+	}
+	return true;
+}
+
+} // namespace pdbw
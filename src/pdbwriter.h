@@ -0,0 +1,175 @@
+// Convert DMD CodeView debug information to PDB files
+// Copyright (c) 2009-2010 by Rainer Schuetze, All Rights Reserved
+//
+// License for redistribution is given by the Artistic License 2.0
+// see file LICENSE for further details
+
+#ifndef __PDBWRITER_H__
+#define __PDBWRITER_H__
+
+// Built-in writer for MSF/PDB files, used instead of mspdb*.dll if that is
+// not found or --native-pdb is given. It implements the part of the PDB, DBI,
+// TPI and Mod interfaces of mspdb.h that cv2pdb calls, with the same return
+// values. All data is kept in memory until PDB::Commit builds the streams on
+// up to numThreads threads and writes the file. Only C13 line information is
+// supported, i.e. the interface of mspdb140.dll.
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+namespace pdbw
+{
+
+class PDB;
+
+class TPI
+{
+public:
+	unsigned long QueryInterfaceVersion();
+	unsigned long QueryImplementationVersion();
+	int Close();
+
+private:
+	friend class PDB;
+	friend class Mod;
+
+	bool added = false;
+	std::vector<char> records; // type records without the signature
+};
+
+class Mod
+{
+public:
+	unsigned long QueryInterfaceVersion();
+	unsigned long QueryImplementationVersion();
+	int AddTypes(unsigned char* pTypeData, long cbTypeData);
+	int AddSymbols(unsigned char* pSymbolData, long cbSymbolData);
+	int AddPublic2(const char* name, unsigned short sec, long off, unsigned long flags);
+	int AddLines(const char* fname, unsigned short sec, long off, long size, long off2,
+	             unsigned short firstline, unsigned char* pLineInfo, long cbLineInfo);
+	int AddSecContrib(unsigned short sec, long off, long size, unsigned long secflags);
+	int Close();
+
+private:
+	friend class PDB;
+	friend class DBI;
+
+	Mod(PDB* pdb, unsigned short imod, const char* objName, const char* libName);
+
+	PDB* pdb;
+	unsigned short imod;
+	std::string objName;
+	std::string libName;
+	int firstContrib = -1;
+
+	std::vector<char> symbols;   // contents of the symbol subsections
+	std::vector<char> checksums; // file checksums with /names offsets
+	std::vector<char> lines;     // all other C13 subsections with header
+	std::vector<unsigned int> files; // /names offsets of the checksum entries
+};
+
+class DBI
+{
+public:
+	unsigned long QueryImplementationVersion();
+	unsigned long QueryInterfaceVersion();
+	int Close();
+	int OpenMod(const char* objName, const char* libName, Mod** pmod);
+	int AddSec(unsigned short sec, unsigned short flags, long offset, long cbseg);
+	int AddPublic2(const char* name, unsigned short sec, long off, unsigned long flags);
+	void SetMachineType(unsigned short type);
+
+private:
+	friend class PDB;
+
+	DBI(PDB* pdb) : pdb(pdb) {}
+
+	PDB* pdb;
+};
+
+class PDB
+{
+public:
+	// Create the file and return a PDB object to be released with Close, or
+	// 0 if the file cannot be written. filename is UTF-8.
+	static PDB* Create(const char* filename, int numThreads);
+
+	unsigned long QueryAge();
+	int QuerySignature2(unsigned char guid[16]);
+	int CreateDBI(const char* target, DBI** pdbi);
+	int OpenTpi(const char* mode, TPI** ptpi);
+	int OpenIpi(const char* mode, TPI** pipi);
+	long QueryLastError(char* lastErr);
+	int Commit();
+	int Close();
+
+private:
+	friend class Mod;
+	friend class DBI;
+
+	struct Public
+	{
+		std::string name;
+		unsigned short sec;
+		unsigned int off;
+		unsigned int flags;
+	};
+	struct SecContrib
+	{
+		unsigned short sec;
+		unsigned int off;
+		unsigned int size;
+		unsigned int flags;
+		unsigned short imod;
+	};
+	struct SecMapEntry
+	{
+		unsigned short flags;
+		unsigned short frame;
+		unsigned int offset;
+		unsigned int size;
+	};
+	struct ModStreams;
+	struct Streams;
+
+	PDB(FILE* fh, int numThreads);
+	~PDB();
+
+	int setError(const char* msg);
+	unsigned int addName(const char* name, size_t len);
+
+	void buildTypes(const TPI& tpi, std::vector<char>& stream, std::vector<char>& hashes,
+	                unsigned short hashStream) const;
+	void buildModule(const Mod& mod, ModStreams& ms) const;
+	void buildGlobals(const std::vector<ModStreams>& mods, Streams& st) const;
+	void buildDBI(const std::vector<ModStreams>& mods, std::vector<char>& dbi) const;
+	void buildNames(std::vector<char>& names) const;
+	void buildInfo(std::vector<char>& info) const;
+	bool writeMSF(const std::vector<const std::vector<char>*>& streams);
+
+	FILE* fh;
+	int numThreads;
+	unsigned int signature;
+	unsigned char guid[16];
+	unsigned short machine = 0;
+	std::string lastError;
+
+	DBI dbi;
+	TPI tpi;
+	TPI ipi;
+	std::vector<std::unique_ptr<Mod>> modules;
+	std::vector<Public> publics;
+	std::vector<SecContrib> contribs;
+	std::vector<SecMapEntry> secMap;
+
+	// the /names string table
+	std::vector<char> nameBuffer;
+	std::unordered_map<std::string, unsigned int> nameOffsets;
+};
+
+} // namespace pdbw
+
+#endif //__PDBWRITER_H__
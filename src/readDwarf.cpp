@@ -1,35 +1,22 @@
 #include "readDwarf.h"
 #include <assert.h>
 #include <array>
-#include <memory> // unique_ptr
+#include <mutex>
 
 #include "PEImage.h"
 #include "cv2pdb.h"
 #include "dwarf.h"
 #include "mspdb.h"
 
-// declare hasher for pair<T1,T2>
-namespace std
+DWARF_Context::DWARF_Context(const PEImage* img_, DebugLevel debug_)
+	: img(img_), debug(debug_)
 {
-template<typename T1, typename T2>
-struct hash<std::pair<T1, T2>>
-{
-	size_t operator()(const std::pair<T1, T2>& t) const
-	{
-		return std::hash<T1>()(t.first) ^ std::hash<T2>()(t.second);
-	}
-};
 }
 
-const PEImage* DIECursor::img;
-abbrevMap_t DIECursor::abbrevMap;
-DebugLevel DIECursor::debug;
-
-void DIECursor::setContext(const PEImage* img_, DebugLevel debug_)
+byte* DWARF_Context::findTypeUnit(unsigned long long signature) const
 {
-	img = img_;
-	abbrevMap.clear();
-	debug = debug_;
+	typeUnitMap_t::const_iterator it = typeUnits.find(signature);
+	return it != typeUnits.end() ? it->second : nullptr;
 }
 
 // Read one compilation unit from `img`'s .debug_info section, starting at
@@ -41,6 +28,8 @@ byte* DWARF_CompilationUnitInfo::read(DebugLevel debug, const PEImage& img, unsi
 {
 	byte* ptr = img.debug_info.byteAt(*off);
 
+	this->img = &img;
+	info_base = 0;
 	start_ptr = ptr;
 	cu_offset = *off;
 	is_dwarf64 = false;
@@ -53,7 +42,18 @@ byte* DWARF_CompilationUnitInfo::read(DebugLevel debug, const PEImage& img, unsi
 				cu_offset);
 
 		uint64_t len64 = RD8(ptr);
-		*off = img.debug_info.sectOff(ptr + (intptr_t)len64);
+		if (len64 > (uint64_t)(img.debug_info.endByte() - ptr))
+			*off = img.debug_info.length; // skip the rest of the section
+		else
+			*off = img.debug_info.sectOff(ptr + len64);
+		return nullptr;
+	}
+
+	if (unit_length > (uint64_t)(img.debug_info.endByte() - ptr)) {
+		fprintf(stderr, "%s:%d: WARNING: compilation unit at offset=%x exceeds the section\n", __FUNCTION__, __LINE__,
+				cu_offset);
+
+		*off = img.debug_info.length;
 		return nullptr;
 	}
 
@@ -68,6 +68,12 @@ byte* DWARF_CompilationUnitInfo::read(DebugLevel debug, const PEImage& img, unsi
 		unit_type = *ptr++;
 		address_size = *ptr++;
 		debug_abbrev_offset = RD4(ptr);
+		if (unit_type == DW_UT_type || unit_type == DW_UT_split_type) {
+			type_signature = RD8(ptr);
+			type_offset = RD4(ptr);
+		} else if (unit_type == DW_UT_skeleton || unit_type == DW_UT_split_compile) {
+			dwo_id = RD8(ptr);
+		}
 	} else {
 		fprintf(stderr, "%s:%d: WARNING: Unsupported dwarf version %d for compilation unit at offset=%x\n", __FUNCTION__, __LINE__,
 				version, cu_offset);
@@ -109,7 +115,7 @@ static Location mkRegRel(int reg, int off)
 	return l;
 }
 
-Location decodeLocation(const DWARF_Attribute& attr, const Location* frameBase, int at)
+Location decodeLocation(const DWARF_Attribute& attr, const Location* frameBase, int at, const DIECursor* cursor)
 {
 	static Location invalid = { Location::Invalid };
 
@@ -318,6 +324,12 @@ Location decodeLocation(const DWARF_Attribute& attr, const Location* frameBase,
 				stack[stackDepth++] = mkAbs(RD4(p)); // TODO: 64-bit
 				break;
 
+			case DW_OP_addrx:
+				if (!cursor)
+					return invalid;
+				stack[stackDepth++] = mkAbs(cursor->readIndirectAddr(LEB128(p)));
+				break;
+
 			case DW_OP_skip:
 			{
 				unsigned off = RD2(p);
@@ -372,7 +384,7 @@ LOCCursor::LOCCursor(const DIECursor& parent, unsigned long off)
 
 	// DWARF v4 uses .debug_loc, DWARF v5 uses .debug_loclists with a different
 	// schema.
-	const PESection& sec = isLocLists ? parent.img->debug_loclists : parent.img->debug_loc;
+	const PESection& sec = isLocLists ? parent.cu->img->debug_loclists : parent.cu->img->debug_loc;
 	ptr = sec.byteAt(off);
 	end = sec.endByte();
 }
@@ -383,9 +395,9 @@ bool LOCCursor::readNext(LOCEntry& entry)
 	{
 		// DWARF v5 location list parsing.
 
-		if (parent.debug & DbgDwarfLocLists)
+		if (parent.ctx->debug & DbgDwarfLocLists)
 			fprintf(stderr, "%s:%d: loclists off=%x DIEoff=%x:\n", __FUNCTION__, __LINE__,
-					parent.img->debug_loclists.sectOff(ptr), parent.entryOff);
+					parent.cu->img->debug_loclists.sectOff(ptr), parent.entryOff);
 
 		auto readCountedLocation = [&entry](byte* &ptr) {
 			DWARF_Attribute attr;
@@ -436,7 +448,7 @@ bool LOCCursor::readNext(LOCEntry& entry)
 				return readCountedLocation(ptr);
 			default:
 				fprintf(stderr, "ERROR: %s:%d: unknown loclists entry %d at offs=%x die_offs=%x\n", __FUNCTION__, __LINE__,
-						type, parent.img->debug_loclists.sectOff(ptr - 1), parent.entryOff);
+						type, parent.cu->img->debug_loclists.sectOff(ptr - 1), parent.entryOff);
 
 				assert(false && "unknown rnglist opcode");
 				return false;
@@ -450,9 +462,9 @@ bool LOCCursor::readNext(LOCEntry& entry)
 		if (ptr >= end)
 			return false;
 
-		if (parent.debug & DbgDwarfLocLists)
+		if (parent.ctx->debug & DbgDwarfLocLists)
 			fprintf(stderr, "%s:%d: loclist off=%x DIEoff=%x:\n", __FUNCTION__, __LINE__,
-					parent.img->debug_loc.sectOff(ptr), parent.entryOff);
+					parent.cu->img->debug_loc.sectOff(ptr), parent.entryOff);
 
 		// Extract the begin and end offset
 		// TODO: Why is this truncating to 32 bit?
@@ -495,7 +507,7 @@ RangeCursor::RangeCursor(const DIECursor& parent, unsigned long off)
 	base = parent.cu->base_address;
 	isRngLists = (parent.cu->version >= 5);
 
-	const PESection& sec = isRngLists ? parent.img->debug_rnglists : parent.img->debug_ranges;
+	const PESection& sec = isRngLists ? parent.cu->img->debug_rnglists : parent.cu->img->debug_ranges;
 	ptr = sec.byteAt(off);
 	end = sec.endByte();
 }
@@ -504,9 +516,9 @@ bool RangeCursor::readNext(RangeEntry& entry)
 {
 	if (isRngLists)
 	{
-		if (parent.debug & DbgDwarfRangeLists)
+		if (parent.ctx->debug & DbgDwarfRangeLists)
 			fprintf(stderr, "%s:%d: rnglists off=%x DIEoff=%x:\n", __FUNCTION__, __LINE__,
-					parent.img->debug_rnglists.sectOff(ptr), parent.entryOff);
+					parent.cu->img->debug_rnglists.sectOff(ptr), parent.entryOff);
 
 		while (ptr < end)
 		{
@@ -544,7 +556,7 @@ bool RangeCursor::readNext(RangeEntry& entry)
 				return true;
 			default:
 				fprintf(stderr, "ERROR: %s:%d: unknown rnglists entry %d at offs=%x die_offs=%x\n", __FUNCTION__, __LINE__,
-						type, parent.img->debug_rnglists.sectOff(ptr - 1), parent.entryOff);
+						type, parent.cu->img->debug_rnglists.sectOff(ptr - 1), parent.entryOff);
 
 				assert(false && "unknown rnglist opcode");
 				return false;
@@ -554,9 +566,9 @@ bool RangeCursor::readNext(RangeEntry& entry)
 	else
 	{
 		while (ptr < end) {
-			if (parent.debug & DbgDwarfRangeLists)
+			if (parent.ctx->debug & DbgDwarfRangeLists)
 				fprintf(stderr, "%s:%d: rangelist off=%x DIEoff=%x:\n", __FUNCTION__, __LINE__,
-						parent.img->debug_ranges.sectOff(ptr), parent.entryOff);
+						parent.cu->img->debug_ranges.sectOff(ptr), parent.entryOff);
 
 			entry.pclo = parent.RDAddr(ptr);
 			entry.pchi = parent.RDAddr(ptr);
@@ -574,10 +586,12 @@ bool RangeCursor::readNext(RangeEntry& entry)
 	return false;
 }
 
-DIECursor::DIECursor(DWARF_CompilationUnitInfo* cu_, byte* ptr_)
+DIECursor::DIECursor(const DWARF_Context& ctx_, DWARF_CompilationUnitInfo* cu_, byte* ptr_)
 {
+	ctx = &ctx_;
 	cu = cu_;
 	ptr = ptr_;
+	abbrevTable = cu ? cu->abbrevTable : nullptr;
 	level = 0;
 	prevHasChild = false;
 	sibling = 0;
@@ -634,6 +648,14 @@ DIECursor DIECursor::getSubtreeCursor()
 	}
 }
 
+void DIECursor::gotoEntry(byte* entryPtr)
+{
+	ptr = entryPtr;
+	level = 0;
+	prevHasChild = false;
+	sibling = 0;
+}
+
 const char Cv2PdbInvalidString[] = "<Cv2Pdb invalid string>";
 
 const char* DIECursor::resolveIndirectString(uint32_t index) const
@@ -646,7 +668,7 @@ const char* DIECursor::resolveIndirectString(uint32_t index) const
 	}
 
 	byte* refAddr = cu->str_offset_base + index * refSize();
-	return (const char*)img->debug_str.byteAt(RDref(refAddr));
+	return (const char*)cu->img->debug_str.byteAt(RDref(refAddr));
 }
 
 uint32_t DIECursor::readIndirectAddr(uint32_t index) const
@@ -675,7 +697,7 @@ uint32_t DIECursor::resolveIndirectSecPtr(uint32_t index, const SectionDescripto
 
 	byte* refAddr = baseAddress + index * refSize();
 	byte* targetAddr = baseAddress + RDref(refAddr);
-	return (img->*(secDesc.pSec)).sectOff(targetAddr);
+	return (cu->img->*(secDesc.pSec)).sectOff(targetAddr);
 }
 
 static byte* getPointerInSection(const PEImage &img, const SectionDescriptor &secDesc, uint32_t offset)
@@ -692,41 +714,17 @@ static byte* getPointerInSection(const PEImage &img, const SectionDescriptor &se
 	return peSec.byteAt(offset);
 }
 
-// Scan the next DIE from the current CU.
-// TODO: Allocate a new element each time.
+// Scan the next DIE from the current CU into 'entry'. The caller typically
+// reuses the same entry over and over, so it is cleared first.
 DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 {
-	std::unique_ptr<DWARF_InfoData> node;
-
-	// Controls whether we should bother establishing links between nodes.
-	// If 'entry' is provided, we are just going to be using it instead
-	// of allocating our own nodes. The callers typically reuse the same
-	// node over and over in this case, so don't bother tracking the links.
-	// Furthermore, since we clear the input node in this case, we can't rely
-	// on it from call to call.
-	// TODO: Rethink how to more cleanly express the alloc vs reuse modes of
-	// operation.
-	bool establishLinks = false;
-
-	// If an entry was passed in, use it. Else allocate one.
-	if (!entry) {
-		establishLinks = true;
-		node = std::make_unique<DWARF_InfoData>();
-		entry = node.get();
-	}
-	// Even if an entry was provided, make sure we clear it.
 	entry->clear();
 
-	entry->img = img;
+	entry->img = cu->img;
 	
 	if (prevHasChild) {
 		// Prior element had a child, thus this element is its first child.
 		++level;
-
-		if (establishLinks) {
-			// Establish the first child.
-			prevParent->children = entry;
-		}
 	}
 
 	// Set up a convenience alias.
@@ -742,7 +740,7 @@ DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 			return nullptr; // root of the tree does not have a null terminator, but we know the length
 
 		id.entryPtr = ptr;
-		entryOff = id.entryOff = img->debug_info.sectOff(ptr);
+		entryOff = id.entryOff = cu->info_base + cu->img->debug_info.sectOff(ptr);
 		id.code = LEB128(ptr);
 
 		// If the previously scanned node claimed to have a child, this must be a valid DIE.
@@ -752,14 +750,6 @@ DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 		if (id.code == 0)
 		{
 			// Done with this level.
-			if (establishLinks) {
-				// Continue linking siblings from the parent node.
-				prevNode = prevParent;
-
-				// Unwind the parent one level up.
-				prevParent = prevParent->parent;
-			}
-
 			--level;
 			if (stopAtNull)
 			{
@@ -772,7 +762,9 @@ DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 		break;
 	}
 
-	byte* abbrev = getDWARFAbbrev(cu->debug_abbrev_offset, id.code);
+	if (!abbrevTable)
+		abbrevTable = ctx->getAbbrevTable(*cu->img, cu->debug_abbrev_offset);
+	const DWARF_Abbrev* abbrev = abbrevTable ? abbrevTable->find(id.code) : nullptr;
 	if (!abbrev) {
 		fprintf(stderr, "ERROR: %s:%d: unknown abbrev: num=%d off=%x\n", __FUNCTION__, __LINE__,
 				id.code, entryOff);
@@ -781,54 +773,26 @@ DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 	}
 
 	id.abbrev = abbrev;
-	id.tag = LEB128(abbrev);
-	id.hasChild = *abbrev++;
-
-	if (establishLinks) {
-		// If there was a previous node, link it to this one, thus continuing the chain.
-		if (prevNode) {
-			prevNode->next = entry;
-		}
-
-		// Establish parent of current node. If 'prevParent' is NULL, that is fine.
-		// It just means this node is a top-level node.
-		entry->parent = prevParent;
-
-		if (id.hasChild) {
-			// This node has children! Establish it as the new parent for future nodes.		
-			prevParent = entry;
+	id.tag = abbrev->tag;
+	id.hasChild = abbrev->hasChild;
 
-			// Clear the last DIE because the next scanned node will form the *start*
-			// of a new linked list comprising the children of the current node.
-			prevNode = nullptr;
-		}
-		else {
-			// Ensure the next node appends itself to this one.
-			prevNode = entry;
-		}
-	}
-
-	if (debug & DbgDwarfAttrRead)
+	if (ctx->debug & DbgDwarfAttrRead)
 		fprintf(stderr, "%s:%d: offs=%x level=%d tag=%d abbrev=%d\n", __FUNCTION__, __LINE__,
 				entryOff, level, id.tag, id.code);
 
 	// Read all the attribute data for this DIE.
-	int attr, form;
-	for (;;)
+	for (const DWARF_AbbrevAttr& spec : abbrev->attrs)
 	{
-		attr = LEB128(abbrev);
-		form = LEB128(abbrev);
-
-		if (attr == 0 && form == 0)
-			break;
+		int attr = spec.attr;
+		int form = spec.form;
 
-		if (debug & DbgDwarfAttrRead)
+		if (ctx->debug & DbgDwarfAttrRead)
 			fprintf(stderr, "%s:%d: offs=%x, attr=%d, form=%d\n", __FUNCTION__, __LINE__,
-					img->debug_info.sectOff(ptr), attr, form);
+					cu->img->debug_info.sectOff(ptr), attr, form);
 
 		while (form == DW_FORM_indirect) {
 			form = LEB128(ptr);
-			if (debug & DbgDwarfAttrRead)
+			if (ctx->debug & DbgDwarfAttrRead)
 				fprintf(stderr, "%s:%d: attr=%d, form=%d\n", __FUNCTION__, __LINE__,
 						attr, form);
 		}
@@ -853,16 +817,19 @@ DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 			case DW_FORM_data16:         a.type = Block; a.block.len = 16; a.block.ptr = ptr; ptr += a.block.len; break;
 			case DW_FORM_sdata:          a.type = Const; a.cons = SLEB128(ptr); break;
 			case DW_FORM_udata:          a.type = Const; a.cons = LEB128(ptr); break;
-			case DW_FORM_implicit_const: a.type = Const; a.cons = LEB128(abbrev); break;
+			case DW_FORM_implicit_const: a.type = Const; a.cons = spec.implicit_const; break;
 			case DW_FORM_string:         a.type = String; a.string = (const char*)ptr; ptr += strlen(a.string) + 1; break;
-            case DW_FORM_strp:           a.type = String; a.string = (const char*)img->debug_str.byteAt(RDref(ptr)); break;
-			case DW_FORM_line_strp:      a.type = String; a.string = (const char*)img->debug_line_str.byteAt(RDref(ptr)); break;
+            case DW_FORM_strp:           a.type = String; a.string = (const char*)cu->img->debug_str.byteAt(RDref(ptr)); break;
+			case DW_FORM_line_strp:      a.type = String; a.string = (const char*)cu->img->debug_line_str.byteAt(RDref(ptr)); break;
 			case DW_FORM_strx:           a.type = String; a.string = resolveIndirectString(LEB128(ptr)); break;
 			case DW_FORM_strx1:
 			case DW_FORM_strx2:
 			case DW_FORM_strx3:
 			case DW_FORM_strx4:          a.type = String; a.string = resolveIndirectString(RDsize(ptr, 1 + (form - DW_FORM_strx1))); break;
-			case DW_FORM_strp_sup:       a.type = Invalid; assert(false && "Unsupported supplementary object"); ptr += refSize(); break;
+			// Strings and references into a supplementary object or dwz alt
+			// file are not resolved, the file is not loaded.
+			case DW_FORM_strp_sup:
+			case DW_FORM_GNU_strp_alt:   a.type = String; a.string = Cv2PdbInvalidString; ptr += refSize(); break;
 			case DW_FORM_flag:           a.type = Flag; a.flag = (*ptr++ != 0); break;
 			case DW_FORM_flag_present:   a.type = Flag; a.flag = true; break;
 			case DW_FORM_ref1:           a.type = Ref; a.ref = cu->start_ptr + *ptr++; break;
@@ -870,10 +837,11 @@ DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 			case DW_FORM_ref4:           a.type = Ref; a.ref = cu->start_ptr + RD4(ptr); break;
 			case DW_FORM_ref8:           a.type = Ref; a.ref = cu->start_ptr + RD8(ptr); break;
 			case DW_FORM_ref_udata:      a.type = Ref; a.ref = cu->start_ptr + LEB128(ptr); break;
-			case DW_FORM_ref_addr:       a.type = Ref; a.ref = img->debug_info.byteAt(RDref(ptr)); break;
-			case DW_FORM_ref_sig8:       a.type = Invalid; ptr += 8;  break;
-			case DW_FORM_ref_sup4:       a.type = Invalid; assert(false && "Unsupported supplementary object"); ptr += 4; break;
-			case DW_FORM_ref_sup8:       a.type = Invalid; assert(false && "Unsupported supplementary object"); ptr += 8; break;
+			case DW_FORM_ref_addr:       a.type = Ref; a.ref = cu->img->debug_info.byteAt(RDref(ptr)); break;
+			case DW_FORM_ref_sig8:       a.ref = ctx->findTypeUnit(RD8(ptr)); a.type = a.ref ? Ref : Invalid; break;
+			case DW_FORM_ref_sup4:       a.type = Ref; a.ref = nullptr; ptr += 4; break;
+			case DW_FORM_ref_sup8:       a.type = Ref; a.ref = nullptr; ptr += 8; break;
+			case DW_FORM_GNU_ref_alt:    a.type = Ref; a.ref = nullptr; ptr += refSize(); break;
 			case DW_FORM_exprloc:        a.type = ExprLoc; a.expr.len = LEB128(ptr); a.expr.ptr = ptr; ptr += a.expr.len; break;
 			case DW_FORM_sec_offset:     a.type = SecOffset; a.sec_offset = RDref(ptr); break;
 			case DW_FORM_loclistx:       a.type = SecOffset; a.sec_offset = resolveIndirectSecPtr(LEB128(ptr), sec_desc_debug_loclists, cu->loclist_base); break;
@@ -893,6 +861,7 @@ DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 			case DW_AT_name:      assert(a.type == String); id.name = a.string; break;
 			case DW_AT_MIPS_linkage_name: assert(a.type == String); id.linkage_name = a.string; break;
 			case DW_AT_comp_dir:  assert(a.type == String); id.dir = a.string; break;
+			case DW_AT_dwo_name:  assert(a.type == String); id.dwo_name = a.string; break;
 			case DW_AT_low_pc:    assert(a.type == Addr); id.pclo = a.addr; break;
 			case DW_AT_high_pc:
 				if (a.type == Addr)
@@ -968,16 +937,16 @@ DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 				break;
 
 			case DW_AT_str_offsets_base:
-				cu->str_offset_base = getPointerInSection(*img, sec_desc_debug_str_offsets, a.sec_offset);
+				cu->str_offset_base = getPointerInSection(*cu->img, sec_desc_debug_str_offsets, a.sec_offset);
 				break;
 			case DW_AT_addr_base:
-				cu->addr_base = getPointerInSection(*img, sec_desc_debug_addr, a.sec_offset);
+				cu->addr_base = getPointerInSection(*cu->img, sec_desc_debug_addr, a.sec_offset);
 				break;
 			case DW_AT_rnglists_base:
-				cu->rnglist_base = getPointerInSection(*img, sec_desc_debug_rnglists, a.sec_offset);
+				cu->rnglist_base = getPointerInSection(*cu->img, sec_desc_debug_rnglists, a.sec_offset);
 				break;
 			case DW_AT_loclists_base:
-				cu->loclist_base = getPointerInSection(*img, sec_desc_debug_loclists, a.sec_offset);
+				cu->loclist_base = getPointerInSection(*cu->img, sec_desc_debug_loclists, a.sec_offset);
 				break;
 		}
 	}
@@ -985,50 +954,76 @@ DWARF_InfoData* DIECursor::readNext(DWARF_InfoData* entry, bool stopAtNull)
 	prevHasChild = id.hasChild != 0;
 	sibling = id.sibling;
 
-	// Transfer ownership of 'node' to caller, if we allocated one.
-	node.release();
 	return entry;
 }
 
-byte* DIECursor::getDWARFAbbrev(unsigned off, unsigned findcode)
+// Decode the abbreviation table at offset `off` in the .debug_abbrev section
+// of `img`. Each table is decoded only once and shared by all CUs referring
+// to it. Once decoded, a table is never changed.
+const DWARF_AbbrevTable* DWARF_Context::getAbbrevTable(const PEImage& img, unsigned off) const
 {
-	if (!img->debug_abbrev.isPresent())
-		return 0;
+	if (!img.debug_abbrev.isPresent() || off >= img.debug_abbrev.length)
+		return nullptr;
 
-	std::pair<unsigned, unsigned> key = std::make_pair(off, findcode);
+	// Tables are keyed by their address, as the .dwo files of split units
+	// have their own .debug_abbrev.
+	const byte* key = img.debug_abbrev.byteAt(off);
+
+	std::lock_guard<std::mutex> lock(abbrevMapMutex);
 	abbrevMap_t::iterator it = abbrevMap.find(key);
 	if (it != abbrevMap.end())
-	{
-		return it->second;
-	}
+		return &it->second;
+
+	std::vector<DWARF_Abbrev> abbrevs;
+	unsigned maxcode = 0;
 
-	byte* p = img->debug_abbrev.byteAt(off);
-	byte* end = img->debug_abbrev.endByte();
+	byte* p = img.debug_abbrev.byteAt(off);
+	byte* end = img.debug_abbrev.endByte();
 	while (p < end)
 	{
-		int code = LEB128(p);
-		if (code == findcode)
-		{
-			abbrevMap.insert(std::make_pair(key, p));
-			return p;
-		}
+		unsigned code = LEB128(p);
 		if (code == 0)
-			return 0;
+			break;
 
-		int tag = LEB128(p);
-		int hasChild = *p++;
+		DWARF_Abbrev abbrev;
+		abbrev.code = code;
+		abbrev.tag = LEB128(p);
+		abbrev.hasChild = *p++;
 
-		// skip attributes
-		int attr, form;
-		do
+		for (;;)
 		{
-			attr = LEB128(p);
-			form = LEB128(p);
+			DWARF_AbbrevAttr spec;
+			spec.attr = LEB128(p);
+			spec.form = LEB128(p);
+			if (spec.attr == 0 && spec.form == 0)
+				break;
 
 			// Implicit const forms have an extra constant value attached.
-			if (form == DW_FORM_implicit_const)
-				LEB128(p);
-		} while (attr || form);
+			spec.implicit_const = spec.form == DW_FORM_implicit_const ? SLEB128(p) : 0;
+			abbrev.attrs.push_back(spec);
+		}
+
+		if (code > maxcode)
+			maxcode = code;
+		abbrevs.push_back(std::move(abbrev));
+	}
+
+	DWARF_AbbrevTable& table = abbrevMap[key];
+	if (maxcode <= 2 * abbrevs.size() + 64)
+	{
+		table.byCode.resize(maxcode + 1);
+		for (DWARF_Abbrev& abbrev : abbrevs)
+			table.byCode[abbrev.code] = std::move(abbrev);
+	}
+	else
+	{
+		for (DWARF_Abbrev& abbrev : abbrevs)
+			table.sparse.emplace(abbrev.code, std::move(abbrev));
 	}
-	return 0;
+
+	if (debug & DbgDwarfCompilationUnit)
+		fprintf(stderr, "%s:%d: Decoded abbrev table offs=%x, entries=%d\n", __FUNCTION__, __LINE__,
+				off, (int)abbrevs.size());
+
+	return &table;
 }
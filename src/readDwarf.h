@@ -2,7 +2,10 @@
 #define __READDWARF_H__
 
 #include <Windows.h>
+#include <assert.h>
 #include <cstring>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -129,6 +132,8 @@ struct DWARF_Attribute
 
 ///////////////////////////////////////////////////////////////////////////////
 
+struct DWARF_AbbrevTable;
+
 struct DWARF_CompilationUnitInfo
 {
 	uint32_t unit_length; // 12 byte in DWARF-64
@@ -154,11 +159,30 @@ struct DWARF_CompilationUnitInfo
 	// Indirect base address in the .debug_rnglists for rnglistx forms
 	byte* rnglist_base;
 
+	// Image holding the sections of the unit. For a split unit, this is the
+	// .dwo file, while addr_base still refers to the skeleton's .debug_addr.
+	const PEImage* img;
+
+	// Offset of img's .debug_info in the offsets of the DIE tree, which
+	// continue after .debug_info for the .dwo files.
+	unsigned int info_base;
+
 	// Offset within the debug_info section
 	uint32_t cu_offset;
 	byte* start_ptr;
 	byte* end_ptr;
 
+	// Signature of a type unit and the offset of its type DIE within the unit.
+	unsigned long long type_signature;
+	unsigned int type_offset;
+
+	// Id matching a skeleton unit with its split unit.
+	unsigned long long dwo_id;
+
+	// Abbreviation table of the unit if already looked up, passed to the
+	// cursors reading the unit so that they don't need the DWARF_Context.
+	const DWARF_AbbrevTable* abbrevTable;
+
 	bool is_dwarf64;
 
 	byte* read(DebugLevel debug, const PEImage& img, unsigned long *off);
@@ -172,6 +196,7 @@ struct DWARF_FileName
 	unsigned int  dir_index;
 	unsigned long lastModification;
 	unsigned long fileLength;
+	const byte* md5 = nullptr; // DW_LNCT_MD5 of DWARF 5, 16 bytes in .debug_line
 
 	void read(byte* &p)
 	{
@@ -180,6 +205,45 @@ struct DWARF_FileName
 		dir_index = LEB128(p);
 		lastModification = LEB128(p);
 		fileLength = LEB128(p);
+		md5 = nullptr;
+	}
+};
+
+// One attribute specification of an abbreviation declaration.
+struct DWARF_AbbrevAttr
+{
+	unsigned attr;
+	unsigned form;
+	long long implicit_const; // value for DW_FORM_implicit_const, 0 otherwise
+};
+
+// Abbreviation declaration from .debug_abbrev, decoded once and shared by
+// all DIEs using it.
+struct DWARF_Abbrev
+{
+	unsigned code = 0; // 0 if the slot is not used
+	int tag = 0;
+	int hasChild = 0;
+	std::vector<DWARF_AbbrevAttr> attrs;
+};
+
+// All abbreviation declarations of one table in .debug_abbrev, i.e. those
+// starting at a given debug_abbrev_offset.
+struct DWARF_AbbrevTable
+{
+	// Declarations indexed by their code. Producers number them sequentially,
+	// so this is usually dense.
+	std::vector<DWARF_Abbrev> byCode;
+
+	// Fallback for tables with very sparse codes.
+	std::unordered_map<unsigned, DWARF_Abbrev> sparse;
+
+	const DWARF_Abbrev* find(unsigned code) const
+	{
+		if (code < byCode.size())
+			return byCode[code].code ? &byCode[code] : nullptr;
+		auto it = sparse.find(code);
+		return it != sparse.end() ? &it->second : nullptr;
 	}
 };
 
@@ -198,28 +262,17 @@ struct DWARF_InfoData
 	// the end of a sibling chain.
 	int code;
 
-	// Pointer to the abbreviation table entry that corresponds to this DIE.
-	byte* abbrev;
+	// Decoded abbreviation declaration that corresponds to this DIE.
+	const DWARF_Abbrev* abbrev;
 	int tag;
 
 	// Does this DIE have children?
 	int hasChild;
 
-	// Parent of this DIE, or NULL if top-level element.
-	DWARF_InfoData* parent = nullptr;
-
-	// Pointer to sibling in the tree. Not to be confused with 'sibling' below,
-	// which is a raw pointer to the DIE in the mapped/loaded image section.
-	// NULL if no more elements.
-	DWARF_InfoData* next = nullptr;
-
-	// Pointer to first child. This forms a linked list with the 'next' pointer.
-	// NULL if no children.
-	DWARF_InfoData* children = nullptr;
-
 	const char* name;
 	const char* linkage_name;
 	const char* dir;
+	const char* dwo_name;
 	unsigned long byte_size;
 
 	// Pointer to the sibling DIE in the mapped image.
@@ -260,11 +313,11 @@ struct DWARF_InfoData
 		abbrev = 0;
 		tag = 0;
 		hasChild = 0;
-		parent = nullptr;
 
 		name = 0;
 		linkage_name = 0;
 		dir = 0;
+		dwo_name = 0;
 		byte_size = 0;
 		sibling = 0;
 		encoding = 0;
@@ -320,6 +373,102 @@ struct DWARF_InfoData
 	}
 };
 
+// Node of the DIE tree built by CV2PDB::mapTypes(). Only the attributes
+// needed to navigate the tree and to match types are kept, everything else
+// is read again from entryPtr when needed (see CV2PDB::readDWARFEntry).
+struct DWARF_Node
+{
+	// Pointer into the memory-mapped image section where this DIE is located.
+	byte* entryPtr;
+	const char* name;
+
+	// Pointer to the DW_AT_type DIE describing the type of this DIE.
+	byte* type;
+
+	// Decoded abbreviation declaration that corresponds to this DIE.
+	const DWARF_Abbrev* abbrev;
+
+	// Parent of this DIE, or NULL if top-level element.
+	DWARF_Node* parent;
+
+	// Next sibling in the tree, NULL if no more elements.
+	DWARF_Node* next;
+
+	// First child. This forms a linked list with the 'next' pointer.
+	DWARF_Node* children;
+
+	unsigned int entryOff; // the entry offset in .debug_info
+	unsigned int unit;     // index of the compilation unit in CV2PDB::dwarfUnits
+	int typeID;            // type ID reserved by mapTypes, 0 if none
+	unsigned short tag;
+	bool isDecl;
+	bool isDuplicate;      // same definition as the node typeID was reserved for
+};
+
+// Bump allocator for the DIE tree. Nodes are allocated in large chunks and
+// released all at once with the arena.
+// As nodes are allocated in the order of their offsets, they can be looked
+// up by offset: for each block of kBlockSize bytes of .debug_info, the index
+// of the first node in the block is recorded and the node is then searched
+// within the nodes of that block.
+class DWARF_NodeArena
+{
+public:
+	DWARF_Node* alloc(unsigned int entryOff)
+	{
+		if (chunks.empty() || used == kChunkNodes)
+		{
+			chunks.push_back(std::make_unique<DWARF_Node[]>(kChunkNodes));
+			used = 0;
+		}
+
+		const unsigned int idx = (unsigned int)count();
+		assert(idx == 0 || at(idx - 1).entryOff < entryOff);
+		while (blockStart.size() <= entryOff / kBlockSize)
+			blockStart.push_back(idx);
+
+		DWARF_Node* node = &chunks.back()[used++];
+		node->entryOff = entryOff;
+		return node;
+	}
+
+	DWARF_Node* find(unsigned int entryOff) const
+	{
+		const size_t block = entryOff / kBlockSize;
+		if (block >= blockStart.size())
+			return nullptr;
+
+		size_t lo = blockStart[block];
+		size_t hi = block + 1 < blockStart.size() ? blockStart[block + 1] : count();
+		while (lo < hi)
+		{
+			const size_t mid = (lo + hi) / 2;
+			DWARF_Node& node = at(mid);
+			if (node.entryOff == entryOff)
+				return &node;
+			if (node.entryOff < entryOff)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return nullptr;
+	}
+
+	DWARF_Node& at(size_t idx) const { return chunks[idx / kChunkNodes][idx % kChunkNodes]; }
+
+	size_t count() const { return chunks.empty() ? 0 : (chunks.size() - 1) * kChunkNodes + used; }
+	size_t bytes() const { return chunks.size() * kChunkNodes * sizeof(DWARF_Node) + blockStart.size() * sizeof(unsigned int); }
+
+private:
+	static const size_t kChunkNodes = 16384;
+	static const size_t kBlockSize = 256;
+
+	std::vector<std::unique_ptr<DWARF_Node[]>> chunks;
+	size_t used = 0;
+
+	std::vector<unsigned int> blockStart;
+};
+
 static const int maximum_operations_per_instruction = 1;
 
 struct DWARF_TypeForm
@@ -406,14 +555,18 @@ struct DWARF_LineState
 	unsigned long section;
 	unsigned long last_addr;
 	std::vector<mspdb::LineInfoEntry> lineInfo;
+	std::vector<unsigned short> lineColumns; // column of each entry of lineInfo, 0 if unknown
 	unsigned int lineInfo_file;
 	unsigned int lineInfo_low_line;
+	std::vector<int> file_ids; // interned path of files[i], -1 if not yet resolved
+	int cur_file_id;           // interned path of cur_file, -1 if not yet resolved
 
 	DWARF_LineState()
 	{
 		seg_offset = 0x400000;
 		last_addr = 0;
 		lineInfo_file = 0;
+		cur_file_id = -1;
 
 		init(0);
 	}
@@ -542,12 +695,43 @@ public:
 	bool readNext(RangeEntry& entry);
 };
 
-typedef std::unordered_map<std::pair<unsigned, unsigned>, byte*> abbrevMap_t;
+// Decoded abbreviation tables keyed by their address in .debug_abbrev.
+typedef std::unordered_map<const byte*, DWARF_AbbrevTable> abbrevMap_t;
+
+// Type DIEs of the type units keyed by their signature.
+typedef std::unordered_map<unsigned long long, byte*> typeUnitMap_t;
+
+// State shared by all cursors reading the DWARF information of an image.
+// Cursors only use it through const methods, so several threads can read the
+// units of an image, and several images can be read at the same time.
+class DWARF_Context
+{
+public:
+	DWARF_Context(const PEImage* img_, DebugLevel debug_);
+
+	const PEImage* const img; // the image, the sections of a unit are in DWARF_CompilationUnitInfo::img
+	const DebugLevel debug;
+
+	// Type units of the image, to be registered before reading the units
+	// referring to them.
+	typeUnitMap_t typeUnits;
+
+	// Returns the type DIE of the type unit with the given signature, if any.
+	byte* findTypeUnit(unsigned long long signature) const;
+
+	const DWARF_AbbrevTable* getAbbrevTable(const PEImage& img, unsigned off) const;
+
+private:
+	// Abbreviation tables decoded on first use.
+	mutable abbrevMap_t abbrevMap;
+	mutable std::mutex abbrevMapMutex;
+};
 
 // Attempts to partially evaluate DWARF location expressions.
 // The only supported expressions are those, whose result may be represented
 // as either an absolute value, a register, or a register-relative address.
-Location decodeLocation(const DWARF_Attribute& attr, const Location* frameBase = 0, int at = 0);
+// DW_OP_addrx is only resolved if the cursor of the DIE is passed.
+Location decodeLocation(const DWARF_Attribute& attr, const Location* frameBase = 0, int at = 0, const DIECursor* cursor = 0);
 
 // Debug Information Entry Cursor
 class DIECursor
@@ -560,30 +744,18 @@ public:
 	int level; // the current level of the tree in the scan.
 	bool prevHasChild = false; // indicates whether the last read DIE has children
 
-	// last DIE scanned. Used to link subsequent nodes in a list.
-	DWARF_InfoData* prevNode = nullptr;
-	
-	// The last parent node to which all subsequent nodes should be assigned.
-	// Initially, NULL, but as we encounter a node with children, we establish
-	// it as the new "parent" for future nodes, and reset it once we reach
-	// a top level node.
-	DWARF_InfoData* prevParent = nullptr;
-
 	// The mapped address of the sibling of the last scanned node, if any.
 	byte* sibling = nullptr;
 
-	static const PEImage *img;
-	static abbrevMap_t abbrevMap;
-	static DebugLevel debug;
+	// Abbreviation table of the CU, taken from the CU or looked up on first use.
+	const DWARF_AbbrevTable* abbrevTable = nullptr;
 
-	byte* getDWARFAbbrev(unsigned off, unsigned findcode);
+	const DWARF_Context* ctx = nullptr; // the image we are reading from.
 
 public:
 
-	static void setContext(const PEImage* img_, DebugLevel debug_);
-
 	// Create a new DIECursor
-	DIECursor(DWARF_CompilationUnitInfo* cu_, byte* ptr);
+	DIECursor(const DWARF_Context& ctx_, DWARF_CompilationUnitInfo* cu_, byte* ptr);
 
 	// Create a child DIECursor
 	DIECursor(const DIECursor& parent, byte* ptr_);
@@ -594,6 +766,10 @@ public:
 	// Returns cursor that will enumerate children of the last read DIE.
 	DIECursor getSubtreeCursor();
 
+	// Position the cursor at the DIE at entryPtr, so that the next readNext()
+	// reads it as a top-level entry.
+	void gotoEntry(byte* entryPtr);
+
 	// Reads the next DIE in physical order, returns non-NULL if succeeds.
 	// If stopAtNull is true, readNext() will stop upon reaching a null DIE (end of the current tree level).
 	// Otherwise, it will skip null DIEs and stop only at the end of the subtree for which this DIECursor was created.
@@ -620,6 +796,9 @@ public:
 
 // iterate over DWARF debug_line information
 // if mod is null, print them out, otherwise add to module
-bool interpretDWARFLines(const PEImage& img, mspdb::Mod* mod, DebugLevel debug = DebugLevel{});
+// the line number programs are decoded on up to numThreads threads
+// with useC13, the lines are added as C13 subsections (mspdb140.dll and later)
+bool interpretDWARFLines(const PEImage& img, mspdb::Mod* mod, DebugLevel debug = DebugLevel{}, int numThreads = 1,
+                         bool useC13 = false);
 
 #endif
@@ -135,7 +135,7 @@ int dstrlen(const BYTE* &p, bool cstr)
 
 char* p2c(const BYTE* p, int idx)
 {
-	static char cname[4][2560];
+	thread_local char cname[4][2560];
 	int len = pstrlen(p);
 
 #if 1
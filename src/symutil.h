@@ -8,6 +8,8 @@
 #define __SYMUTIL_H__
 
 #include <windows.h>
+#include <string.h>
+#include <vector>
 
 struct p_string;
 
@@ -17,6 +19,7 @@ int dsym2c(const BYTE* p, int len, char* cname, int maxclen);
 
 int pstrmemlen(const BYTE* p);
 int pstrlen(const BYTE* &p);
+int dstrlen(const BYTE* &p, bool cstr);
 char* p2c(const BYTE* p, int idx = 0);
 char* p2c(const p_string& p, int idx = 0);
 int c2p(const char* c, BYTE* p); // return byte len
@@ -31,6 +34,28 @@ int pstrcpy_v(bool v3, BYTE* d, const BYTE* s);
 int cstrcpy_v(bool v3, BYTE* d, const char* s);
 bool dstrcmp(const BYTE* s1, bool cstr1, const BYTE* s2, bool cstr2);
 
+// helpers to build C13 debug subsections
+template<typename T>
+inline void append(std::vector<char>& v, const T& x)
+{
+	size_t sz = v.size();
+	v.resize(sz + sizeof(T));
+	memcpy(v.data() + sz, &x, sizeof(T));
+}
+
+inline void append(std::vector<char>& v, const void* data, size_t len)
+{
+	size_t sz = v.size();
+	v.resize(sz + len);
+	memcpy(v.data() + sz, data, len);
+}
+
+inline void align(std::vector<char>& v, int algn)
+{
+	while(v.size() & (algn - 1))
+		v.push_back(0);
+}
+
 extern char dotReplacementChar;
 extern bool demangleSymbols;
 extern bool useTypedefEnum;